@@ -1,190 +1,1986 @@
 /**
  * write a simple flight management system
+ *
+ * Build: cc -std=c11 -pthread -o flight "flight design.c" -lm
  **/
 
+#define _POSIX_C_SOURCE 200809L // mmap and friends for batch input
+#ifdef __linux__
+#define _GNU_SOURCE // SO_PEERCRED, for a shard to know its router
+#endif
+
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <math.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h> // server mode
+#include <sys/prctl.h> // shards stop with their router
+#endif
 
 // Limit constants
 #define MAX_CITY_NAME_LEN 20
-#define MAX_FLIGHTS_PER_CITY 5
+#define MAX_FLIGHTS_PER_CITY 1024 // power of 2, see flight array pool below
+#define INLINE_FLIGHTS_PER_CITY 2 // flights kept inside the schedule itself
+#define MIN_SPILL_FLIGHTS 16      // smallest flight array taken from the pool,
+                                  // a multiple of the widest vector (16 times)
+#define FLIGHT_ARRAY_CLASSES 7    // pool size classes: 16, 32, ..., 1024 flights
+#define MAX_FLIGHT_CAPACITY UINT16_MAX // seats of a flight fit in 16 bits
+#define FLIGHT_SEARCH_BLOCK 32    // flights left by binary search for the vector scan
 #define MAX_DEFAULT_SCHEDULES 50
+#define MAX_SCHEDULE_CHUNK (1L << 20) // largest chunk of the schedule pool, and of
+                                     // its first chunk, see flight_schedule_pool
+#define MAX_SCHEDULE_CHUNKS (22 + UINT32_MAX / MAX_SCHEDULE_CHUNK) // doubling up to
+                                     // the largest, then enough of those for every id
+#define MAX_SCHEDULE_ID (UINT32_MAX - 1) // schedule ids fit in 32 bits
+#define MIN_INDEX_SLOTS 64  // smallest city name hash index (power of 2)
+#define FIRST_CITY_NAMES 64 // chunk k of the city table holds FIRST_CITY_NAMES << k
+#define MAX_CITY_CHUNKS 26  // enough chunks for every 32 bit city id
+#define CITY_NONE UINT32_MAX // city id of a name that was never interned
+#define CITY_ORDER_LEVELS 16 // skip list levels, plenty for 4^16 cities
+#define BATCH_READ_BLOCK (1 << 20) // bytes per read() when batch input can't be mapped
+#define OUTPUT_BUFFER_SIZE (1 << 16) // bytes of output collected before a write()
+#define MAX_PATH_LEN 1024             // longest file name a command takes
+
+// Statistics definitions.  Build with -DFLIGHT_STATS=0 to leave all of it,
+// the T command and --stats-interval out.
+#ifndef FLIGHT_STATS
+#define FLIGHT_STATS 1
+#endif
+#define STATS_COMMANDS "ALPlFarsubBcWDNgGkKiIvVyYwRSOXEhqT" // commands timed apart, others as bad
+#define STATS_SUB_BUCKETS 16 // latency buckets per power of 2, 1/16 resolution
+#define STATS_MAX_BITS 40    // latencies are clamped below 2^40 ns (18 minutes)
+#define STATS_BUCKETS ((STATS_MAX_BITS - 3) * STATS_SUB_BUCKETS)
+#define STATS_PROBE_BUCKETS 16 // lookups probing 1..15 slots, and more
+#define STATS_HOT_CITIES 10  // busiest destinations shown
+#define STATS_TEXT_SIZE 8192 // longest statistics report
+
+// Server definitions
+#define SERVER_INPUT_SIZE (1 << 16) // longest run of requests kept per client
+#define SERVER_MAX_EVENTS 64        // epoll events taken per wakeup
+#define SERVER_BACKLOG 128          // connections waiting to be accepted
+#define LOAD_TEST_REQUESTS 100000   // default requests per load test client
+#define LOAD_TEST_PIPELINE 16       // default requests sent ahead of answers
+#define LOAD_TEST_CITY "LoadTest"   // city the load test books on, or prefix of its cities
+
+// Shard definitions
+#define MAX_SHARDS 64             // worker processes of a router
+#define DEFAULT_SHARDS 2          // started by --router without --shards
+#define SHARD_POINTS 128          // points of each shard on the hash ring
+#define SHARD_START_TRIES 500     // 10 ms waits for a shard to listen
+
+// Workload definitions
+#define WORKLOAD_OPS 1000000  // default operations in a workload
+#define WORKLOAD_CITIES 1000  // default destinations
+#define WORKLOAD_ZIPF 0.99    // default skew of the destinations
+#define WORKLOAD_TIMES 16     // recent times per city unbook and remove pick from
+#define WORKLOAD_CAPACITY 200 // most seats on a workload flight
+#define WORKLOAD_COMMANDS "asurR" // command of each kind of operation
+
+// Benchmark definitions (--bench NAME)
+#define BENCH_LOOKUPS 1000000 // hashed lookups timed at each number of cities
+#define BENCH_WALKS 20000000  // names compared by the list walks at each number
+#define BENCH_HELD 8          // schedules each pool bench thread holds at once
+#define BENCH_FLIGHTS 8       // flights of each city the startup bench saves
+#define BENCH_GROUP_OPS 256   // bookings the journal bench makes per record of a group
+#define BENCH_CHUNK 1024      // bookings the search bench times before giving them back
+#define BENCH_BATCH 1024      // requests in each batch of the batch bench
+
+// Stress test definitions (--stress THREADS)
+#define MAX_STRESS_THREADS 256
+#define STRESS_FLIGHTS 4      // flights of each city, spread over the day
+#define STRESS_CAPACITY 100   // seats of each, few so that they sell out
+#define STRESS_SEATS 4        // most seats booked or given back at once
+#define STRESS_CHURNERS 2     // threads adding and removing schedules meanwhile
+#define STRESS_CHURN_CITIES 64 // cities of each, with a schedule now and then
+#define STRESS_READERS 2      // threads reading the schedules meanwhile
+#define STRESS_WINDOW 60      // minutes of departures a reader lists at once
+
+// Snapshot file definitions
+#define SNAPSHOT_MAGIC "FLTSNAP"
+#define SNAPSHOT_VERSION 6 // 1 had no connections, 2 no services, 3 no
+                           // waitlists, 4 no journal sequence number and 5
+                           // no name order, all still loaded
+
+// Journal definitions
+#define DEFAULT_GROUP_COMMIT 64 // records written and synced together
 
 // Time definitions
 #define TIME_MIN 0
 #define TIME_MAX ((60 * 24)-1)
 #define TIME_NULL -1
+#define TIME_PAD INT16_MAX  // fills the unused end of a spilled time lane
+
+// Departure index definitions
+#define DEPARTURE_BUCKETS (TIME_MAX - TIME_NULL + 1) // a minute each, TIME_NULL first
+#define DEPARTURE_WORDS ((DEPARTURE_BUCKETS + 63) / 64) // of the non empty bitmap
+#define MIN_DEPARTURE_SLOTS 8  // smallest hash table of a bucket (power of 2)
+
+// Connection definitions
+#define DEFAULT_MIN_CONNECTION 30 // minutes between arriving and flying on
+#define MIN_CONNECTIONS 4         // smallest connection or service list of a city
+
+// Calendar definitions
+#define DAY_MAX UINT16_MAX        // last day number, days since 1970-01-01
+#define MAX_SEASON_DAYS 1024      // longest calendar of a service, in days
+#define MIN_SERVICE_DATES 4       // smallest booked dates array of a service
+
+// Read view definitions
+#define MIN_VIEWS 4               // smallest array of open view epochs
+
+// Waitlist definitions
+#define MIN_WAITLIST 4            // smallest waitlist ring of a flight (power of 2)
+#define MAX_WAITLIST 1024         // bookings waiting on a flight, power of 2
+#define WAITLIST_CLASSES 9        // pool size classes: 4, 8, ..., 1024 bookings
+#define MAX_OVERBOOK 100          // largest overbooking margin, percent of capacity
+
+// The departure time search has vector versions for x86 CPUs that have
+// them, picked at startup (see flight_simd_initialize)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FLIGHT_SIMD_X86 1
+#include <immintrin.h>
+#endif
 
 
 /******************************************************************************
  * Structure and Type definitions                                             *
  ******************************************************************************/
-typedef int time_t;                        // integers used for time values
+typedef int flight_time_t;                 // integers used for time values
 typedef char city_t[MAX_CITY_NAME_LEN+1];; // null terminate fixed length city
+typedef uint32_t city_id_t;                // interned city name, see city_table
+typedef int16_t packed_time_t;             // flight_time_t as kept in flights
+typedef uint16_t packed_seats_t;           // seat counts as kept in flights
 
 int add_flight = 0;
 
 
 // Structure to hold all the information for a single flight
-//   A city's schedule has an array of these
+//   Used to hand flights out of the engine; inside a schedule they are
+//   kept in struct flight_lanes form.  A time fits in 11 bits and seats are
+//   limited to MAX_FLIGHT_CAPACITY, so every field is 16 bits.
 struct flight {
-  time_t time;       // departure time of the flight
-  int available;  // number of seats currently available on the flight
-  int capacity;   // maximum seat capacity of the flight
+  packed_time_t time;       // departure time of the flight
+  packed_seats_t available; // number of seats currently available on the flight
+  packed_seats_t capacity;  // maximum seat capacity of the flight
+};
+
+// The flights of a schedule as a structure of arrays: flight i is
+// time[i], available[i] and capacity[i].  Keeping the times together lets
+// the search for a departure compare a whole vector of them at once.
+struct flight_lanes {
+  packed_time_t *time;        // departure times, sorted
+  packed_seats_t *available;  // seats currently available
+  packed_seats_t *capacity;   // maximum seat capacity
 };
 
 // Structure for an individual flight schedule
-// The main data structure of the program is an Array of these structures
-// Each structure will be placed on one of two linked lists:
-//                free or active
-// Initially the active list will be empty and all the schedules
-// will be on the free list.  Adding a schedule is finding the first
-// free schedule on the free list, removing it from the free list,
-// setting its destination city and putting it on the active list
+// The main data structure of the program is a pool of these structures
+// (see struct flight_schedule_pool below)
+// Each structure in use will be placed on one of two lists:
+//                the free stack of the pool or the active list
+// Initially the active list will be empty and so will the free stack,
+// schedules that were never used are still in the chunks of the pool.
+// Adding a schedule is taking one from the pool, setting its destination
+// city id and putting it on the active list.  Removing it takes it off the
+// active list and pushes it on the free stack.  The active list is linked
+// by pool ids rather than pointers, see flight_schedule_next().
+//
+// The flights of a schedule are kept sorted by time in lanes [0..n_flights).
+// Up to INLINE_FLIGHTS_PER_CITY of them are stored inside the schedule.
+// When a city needs more, they are moved to a block from the flight array
+// pool which doubles in size as needed.  The block holds the time lane,
+// then the available lane, then the capacity lane, max_flights each of
+// 16 bit fields, and
+// the time lane is padded with TIME_PAD past n_flights so vector code can
+// read it in whole vectors.  Use flight_schedule_lanes() to get at them
+// wherever they are.
+//
+// The flights that have bookings waiting for seats, or seats booked over
+// their capacity, each have a struct flight_waitlist on the waitlists list.
+// What the read views need of a schedule is kept beside it in the pool,
+// see struct flight_view_state.
 struct flight_schedule {
-  city_t destination;                          // destination city name
-  struct flight flights[MAX_FLIGHTS_PER_CITY]; // array of flights to the city
-  struct flight_schedule *next;                // link list next pointer
-  struct flight_schedule *prev;                // link list prev pointer
+  city_id_t city;                              // destination, see city_name()
+  uint16_t n_flights;                          // number of flights in use
+  uint16_t max_flights;                        // slots where flights are kept
+  union {
+    struct {
+      packed_time_t time[INLINE_FLIGHTS_PER_CITY];
+      packed_seats_t available[INLINE_FLIGHTS_PER_CITY];
+      packed_seats_t capacity[INLINE_FLIGHTS_PER_CITY];
+    } local;                                   // when max_flights is inline
+    void *spill;                               // otherwise, pool block
+  } flights;                                   // flights to the city
+  pthread_mutex_t lock;                        // guards the flights, see engine
+  uint32_t next;                               // id+1 of next on active list
+  uint32_t prev;                               // id+1 of prev on active list
+  uint32_t id;                                 // position in the pool
+  _Atomic uint32_t free_next;                  // id+1 of next on free stack
+  struct flight_waitlist *waitlists;           // in time order, see there
+#if FLIGHT_STATS
+  uint64_t hits;                               // engine calls on it, under lock
+#endif
+};
+
+// The packed fields have to hold every value they are given
+_Static_assert(sizeof(struct flight) == 6, "struct flight is not packed");
+_Static_assert(TIME_MAX <= INT16_MAX && TIME_NULL >= INT16_MIN, "times do not fit packed_time_t");
+_Static_assert(MAX_FLIGHT_CAPACITY <= UINT16_MAX, "seats do not fit packed_seats_t");
+_Static_assert(MAX_FLIGHTS_PER_CITY <= UINT16_MAX, "flight counts do not fit 16 bits");
+_Static_assert(MAX_SCHEDULE_ID < UINT32_MAX, "ids+1 do not fit the list links");
+_Static_assert(MAX_WAITLIST <= UINT16_MAX, "waitlist positions do not fit 16 bits");
+// and all of a schedule but its lock fits in 48 bytes (56 with statistics)
+_Static_assert(sizeof(struct flight_schedule) - sizeof(pthread_mutex_t) <= 48 + 8 * FLIGHT_STATS,
+               "struct flight_schedule grew");
+
+// Result of the seat reservation engine functions (flight_engine_*)
+enum flight_status {
+  FLIGHT_OK,          // done
+  FLIGHT_NO_CITY,     // there is no schedule for the city
+  FLIGHT_CITY_EXISTS, // there is a schedule for the city already
+  FLIGHT_NO_FREE,     // no memory left for another schedule
+  FLIGHT_MAX_FLIGHTS, // the city can not take more flights
+  FLIGHT_BAD_TIME,    // there is no flight at that time
+  FLIGHT_NO_SEATS,    // the flight found has not enough seats left, or there is none,
+                      // and the booking can't wait for them
+  FLIGHT_ALL_EMPTY,   // every seat of the flight is free already
+  FLIGHT_BAD_COUNT,   // asked for less than one seat
+  FLIGHT_BAD_CONNECTION, // a connection has to join two cities and arrive
+                         // the same day, not before it leaves
+  FLIGHT_BAD_CALENDAR,   // a service has to operate on at least one day,
+                         // all within MAX_SEASON_DAYS
+  FLIGHT_WAITLISTED      // the flight found has not enough seats left, the
+                         // booking waits for them
+};
+
+// The bookings waiting for seats on a flight, first come first served, and
+// the seats booked over its capacity (see flight_overbook).  The bookings
+// are the seats each wants, kept in a ring: they are added at position
+// (head + n) mod max and taken from head.  A waitlist is only kept while it
+// has either, its blocks come from a pool by size class like the spilled
+// flights.
+struct flight_waitlist {
+  struct flight_waitlist *next;    // of the next flight of the schedule
+  packed_time_t time;              // the flight, the first leaving then
+  packed_seats_t overbooked;       // seats booked over its capacity
+  uint16_t head;                   // position of the first booking waiting
+  uint16_t n;                      // bookings waiting
+  uint16_t max;                    // positions in the ring, a power of 2
+  packed_seats_t seats[];          // seats wanted by each booking
+};
+
+// One request of a batch booking, see flight_engine_book_batch
+struct flight_booking {
+  city_id_t city;       // destination
+  flight_time_t time;   // book on the first flight leaving at or after it
+  int count;            // seats wanted, all on that flight
+  bool spill;           // or on it and the ones after, see flight_engine_book_seats
+};
+
+// A flight with seats left handed out by flight_engine_for_each_departure
+struct departure {
+  city_id_t city;       // destination
+  struct flight flight; // its time and seats
+};
+
+// Working space of the batch bookings of one thread, kept from one batch
+// to the next.  The requests of a batch are grouped by schedule in one
+// pass: each schedule in it has a chain of its requests, in order, linked
+// through next and started from first[id].  Entries of first are -1
+// except while a batch is grouped.
+struct flight_booking_groups {
+  int32_t *first;                     // by schedule id, first request on it
+  int32_t *last;                      // and the last one so far
+  size_t max_ids;                     // room in first and last
+  int32_t *next;                      // by request, the next one on its schedule
+  struct flight_schedule **schedules; // the schedules of the batch, in order
+  int max_requests;                   // room in next and schedules
+};
+
+// The schedules live in chunks that are allocated on demand and never
+// freed or moved, so a pointer to a schedule stays valid for the whole run.
+// Every schedule has an id, its position counting through the chunks in
+// order, and chunk k holds first << k of them up to MAX_SCHEDULE_CHUNK,
+// after which every chunk holds that many.  When the free stack is
+// empty the next unused id is handed out, so the memory of a chunk is not
+// touched before it is needed.
+//
+// The free stack is a lock-free LIFO (Treiber stack) so threads can take
+// and give back schedules without any lock.  Its head packs the id+1 of
+// the top schedule (0 if empty) in the low 32 bits with a tag in the high
+// 32 bits that changes on every push and pop, so that a compare and swap
+// can't succeed on a top that was popped and pushed back meanwhile (ABA).
+struct flight_schedule_pool {
+  _Atomic uint64_t free_head;    // tag << 32 | id+1 of the top free schedule
+  _Atomic uint64_t carved;       // ids handed out from the chunks so far
+  long first;                    // number of schedules in chunk 0,
+                                 // 1 to MAX_SCHEDULE_CHUNK
+  struct flight_schedule *_Atomic chunks[MAX_SCHEDULE_CHUNKS]; // NULL until needed
+  struct flight_view_state *view_chunks[MAX_SCHEDULE_CHUNKS];   // of the same ids,
+                                 // set before chunks
+  pthread_mutex_t grow_lock;     // only one thread allocates a chunk
+};
+
+// The departure index finds the flights with seats left leaving in a range
+// of minutes, whatever their destination, without going through all the
+// schedules.  There is a bucket for every minute of the day (and for
+// TIME_NULL), holding an open addressing hash table, with linear probing,
+// of the cities that have flights with seats left at that minute and how
+// many.  Tables shrink as well as grow so walking one is proportional to
+// what it holds, and a bitmap of the non empty buckets skips the empty
+// minutes.  It changes with the flights, under the lock of their schedule;
+// each bucket has a lock of its own, so bookings of different cities only
+// meet when their flights fill up or leave in the same minute.
+struct departure_slot {
+  city_id_t city;       // CITY_NONE for an empty slot
+  uint32_t count;       // flights to it with seats left in the minute
+};
+
+struct departure_bucket {
+  pthread_mutex_t lock;         // guards the rest
+  uint32_t n;                   // cities in slots
+  uint32_t max;                 // size of slots, 0 or a power of 2
+  struct departure_slot *slots; // the hash table, NULL while max is 0
+};
+
+// A flight between two cities away from home.  The schedules only hold
+// the flights leaving home, each straight to its destination; connections
+// are the rest of the network, so an itinerary can go home -> A on a
+// schedule flight and then A -> B -> C on connections.  Unlike a schedule
+// flight, a connection has an arrival time, the same day.
+struct connection {
+  city_id_t destination;     // the origin is the city of its list
+  packed_time_t departure;
+  packed_time_t arrival;     // not before departure
+  packed_seats_t available;  // seats left
+  packed_seats_t capacity;   // 1 to MAX_FLIGHT_CAPACITY
+};
+
+// The connections leaving one city, sorted by departure time.  Kept per
+// origin so an itinerary search finds the ones a traveller ready to leave
+// at some time can take, the tail from the first departure at or after
+// it, by binary search instead of scanning every connection.
+struct connection_list {
+  struct connection *connections; // NULL while max is 0
+  uint32_t n;                     // connections in use
+  uint32_t max;                   // room for
+};
+
+// One flight of an itinerary, see flight_engine_itinerary
+struct itinerary_leg {
+  city_id_t origin;          // CITY_NONE for a schedule flight from home
+  city_id_t destination;
+  flight_time_t departure;
+  flight_time_t arrival;     // the departure for a schedule flight
+};
+
+// A flight that operates on many days, at the same times on each day of
+// its calendar, so one record holds a service running all season.  The
+// calendar is a bitmap of the days from first_day on, trimmed to the
+// first and last day the service operates: a season of a few months is a
+// few words.  Seats are only tracked for the dates somebody booked, in
+// dates, which is allocated on the first booking, so memory grows with
+// the dated flights booked rather than the length of the calendar.
+struct service {
+  city_id_t destination;       // the origin is the city of its list
+  packed_time_t departure;
+  packed_time_t arrival;       // the same day, not before departure
+  packed_seats_t capacity;     // of the flight of each day
+  uint16_t first_day;          // day of bit 0 of the calendar
+  uint16_t n_days;             // bits in the calendar, 1 to MAX_SEASON_DAYS
+  uint16_t n_dates;            // booked dates in use
+  uint16_t max_dates;          // room for
+  union {
+    uint64_t word;             // the calendar, when n_days <= 64
+    uint64_t *words;           // otherwise
+  } days;                      // see service_calendar()
+  struct service_date *dates;  // sorted by day, NULL while max_dates is 0
+};
+
+// The seats booked on a service one day
+struct service_date {
+  uint16_t day;
+  packed_seats_t booked;       // more than 0
+};
+
+// The services leaving one city, sorted by departure time
+struct service_list {
+  struct service *services;    // NULL while max is 0
+  uint32_t n;                  // services in use
+  uint32_t max;                // room for
+};
+
+// Working state of one itinerary search, indexed by city id
+struct itinerary_search {
+  packed_time_t *arrival;    // earliest arrival found, TIME_PAD for none
+  struct itinerary_leg *via; // the flight arriving then
+  uint64_t *heap;            // arrival << 32 | city, earliest on top
+  size_t n_heap, max_heap;
+};
+
+// A read view pins all the schedules as they were at one moment, so a
+// long report sees them consistent while bookings go on.  Opening a view
+// starts a new epoch.  Every change to the flights of a schedule is tagged
+// with the epoch it is made in, and a view sees the changes tagged before
+// its own.  The first change to a schedule in an epoch that an open view
+// may need to look past keeps a copy of its flights (struct
+// flight_version), so writers copy once per schedule at most and never
+// wait for a reader.  Copies are freed by the next change once no open
+// view is old enough to see them.
+struct flight_view {
+  uint64_t epoch;                  // sees the changes tagged before it
+  size_t n;                        // schedules in the view
+  struct flight_view_city *cities; // them, in name order
+};
+
+// One schedule of a view.  Schedules are never given back to the system,
+// so fs stays valid even if the city is removed meanwhile, and the view
+// holds the city id so that its name does too.
+struct flight_view_city {
+  city_id_t city;
+  struct flight_schedule *fs;
+};
+
+// The flights of a schedule as they were before a change, for the views
+// with an epoch in (from, to]
+struct flight_version {
+  struct flight_version *older; // the one kept before it, NULL if none
+  uint64_t from;                // epoch of the change that made them
+  uint64_t to;                  // epoch of the change that replaced them
+  int n_flights;
+  struct flight flights[];      // in time order
+};
+
+// Where a schedule is in the epochs, kept in chunks beside those of the
+// pool rather than in the schedule, see flight_schedule_views.  Guarded by
+// the lock of the schedule.
+struct flight_view_state {
+  uint64_t stamp;                   // epoch of the last change to the flights
+  struct flight_version *versions;  // flights kept for views, newest first
+};
+
+// The open views.  Opening and closing one take the lock, changes to the
+// flights only read the atomic fields.
+struct view_registry {
+  _Atomic uint64_t epoch;   // of the last view opened, changes are tagged with it
+  _Atomic uint64_t oldest;  // no open view has an older epoch
+  _Atomic int open;         // views open
+  uint64_t *epochs;         // theirs, oldest first
+  int max;                  // room in epochs
+  pthread_mutex_t lock;
+};
+
+// Command stream of batch mode (--batch FILE).  The whole file is mapped
+// (or read in big blocks if it can't be) and parsed in place, instead of
+// going through scanf and getchar one token at a time.
+struct batch_input {
+  char *base;        // start of the command stream
+  size_t size;       // its length in bytes
+  bool mapped;       // base comes from mmap rather than malloc
+  const char *pos;   // next character to parse
+  const char *end;   // one past the last character
+};
+
+// All output of the program is collected here and written to stdout in big
+// write() calls: when the buffer fills up, before waiting for the next
+// interactive command and at exit.
+struct output_buffer {
+  bool interactive;               // stdin and stdout are terminals, flush at
+                                  // each prompt
+  struct server_client *client;   // serving a client: flush to its queue
+  size_t len;                     // bytes waiting in data
+  char data[OUTPUT_BUFFER_SIZE];  // output not written yet
+};
+
+#if FLIGHT_STATS
+// Timings of one command letter.  The histogram is log linear like an HDR
+// histogram: latencies below STATS_SUB_BUCKETS ns have a bucket each, and
+// every power of 2 above is split in STATS_SUB_BUCKETS buckets, so any
+// percentile read from it is within 1/16 of the real value.
+struct command_stats {
+  uint64_t count;                       // commands run
+  uint64_t total_ns;                    // time spent in them
+  uint64_t max_ns;                      // slowest one
+  uint64_t histogram[STATS_BUCKETS];    // commands by latency, see stats_bucket
+};
+#endif
+
+// A client of the server (--server PATH).  Requests are read into in and
+// run as soon as all of their lines are there, any number per read.  The
+// answer to each is ended by a line holding just "." and queued in out
+// until the socket takes it.  Answers are only sent once the journal has
+// the changes they report.
+struct server_client {
+  int fd;                          // connected socket
+  bool quit;                       // sent q, close once out is sent
+  bool hung_up;                    // no more input, close once out is sent
+  bool blocked;                    // socket is full, waiting for EPOLLOUT
+  bool ready;                      // on the list to send this round
+  bool trusted;                    // the router of this shard, whose S O X
+                                   // can name any file (--shard-of PID)
+  struct server_client *next_ready; // next on the list to send
+  struct router_request *first_request; // router: requests still waiting
+  struct router_request *last_request;  // for shards, in order
+  struct router_shard *shard;      // router: the shard this links to,
+                                   // NULL for a client
+  char *out;                       // answers not sent yet
+  size_t out_len;                  // bytes in out
+  size_t out_sent;                 // bytes of out sent already
+  size_t out_max;                  // size of out
+  size_t in_len;                   // bytes in in
+  char in[SERVER_INPUT_SIZE];      // requests not run yet
+};
+
+// One connection of the load test (--load-test PATH), run in its own
+// thread.  It keeps pipeline requests in flight and records the time from
+// sending each request to reading its answer.
+struct load_test {
+  const char *path;                // server socket
+  int clients;                     // connections, one thread each
+  int cities;                      // destinations the bookings go to
+  int scaling;                     // --scaling: most shards to start, or 0
+  const char *journal;             // passed on to the routers it starts
+  int requests;                    // requests sent on each connection
+  int pipeline;                    // requests sent ahead of the answers
+  uint64_t *latency;               // nanoseconds for each request
+  bool ok;                         // the run went through
+};
+
+// The hash ring of a sharded inventory.  Every shard has SHARD_POINTS
+// points on it, placed by hashing the shard number, and a city belongs to
+// the shard of the first point at or after the hash of its name (going
+// round past the end).  Adding a shard only moves the cities that hash
+// just before one of its points, about 1 in n+1 of them, all to it.
+struct shard_ring {
+  int shards;                      // shards on it
+  uint64_t points[MAX_SHARDS * SHARD_POINTS]; // hash << 32 | shard, sorted
+};
+
+// A request of a router client, waiting for the answers of the shards it
+// went to.  A city's commands go to the shard that has it; the lists go
+// to every shard and their answers are merged by name or time.
+struct router_request {
+  struct router_request *next;     // the client's next request
+  struct server_client *client;    // who asked, NULL if the router did
+  bool orphan;                     // the client is gone, drop the answers
+  char command;                    // how the answers are put together
+  int shard;                       // shard added by E, -1 if none could be
+  int waiting;                     // answers still to come
+  int n_answers;                   // shards it went to
+  struct router_answer {
+    char *text;                    // the answer without its "." line
+    size_t len, max;
+  } answers[];
+};
+
+// An answer a shard owes the router: shards answer in order, so the next
+// one it sends goes to answer of request
+struct router_pending {
+  struct router_pending *next;
+  struct router_request *request;
+  int answer;
+};
+
+// A worker process of a router (--router PATH), serving PATH.<k>, and the
+// router's connection to it.  Requests are queued in link.out like the
+// answers to a client, the answers are split up as they are read.
+struct router_shard {
+  pid_t pid;
+  struct server_client link;
+  struct router_pending *first, *last; // answers it owes, in order
+  bool line_start;                 // the next byte read starts a line
+  bool end_line;                   // the rest of a "." line is to be read
+};
+
+// State of a router, see the Sharded inventory section
+struct router {
+  const char *path;                // clients connect here
+  const char *self;                // program the shards run
+  const char *journal;             // shard k journals to journal.k
+  const char *snapshot;            // and starts from snapshot.k, see
+                                   // router_base
+  char options[5][24];             // --group-commit, --min-connection,
+                                   // --overbook, the first chunk size and
+                                   // --shard-of, passed on
+  int ep;                          // epoll of clients and shards
+  int n_shards;
+  struct router_shard *shards[MAX_SHARDS];
+  struct shard_ring *ring;         // of the n_shards shards
+  struct server_client *ready;     // clients with answers to send
+};
+
+// Kinds of operation in a workload, in --mix order.  Churn removes a
+// whole schedule and adds it back empty.
+enum workload_kind {
+  WORKLOAD_ADD,
+  WORKLOAD_BOOK,
+  WORKLOAD_UNBOOK,
+  WORKLOAD_REMOVE,
+  WORKLOAD_CHURN,
+  WORKLOAD_KINDS
+};
+
+// Shape of a synthetic workload (--generate, --bench)
+struct workload {
+  long ops;                        // operations
+  int cities;                      // destinations, "City0" on
+  double zipf;                     // skew of the destinations, 0 is uniform
+  int mix[WORKLOAD_KINDS];         // percent of each kind of operation
+  uint64_t seed;                   // state of the random sequence
+};
+
+// A benchmark of one part of the program, run by --bench NAME instead of
+// the workload.  run returns false if it could not be run.
+struct bench {
+  const char *name;
+  bool (*run)(struct workload *w);
+};
+
+// One thread of the pool benchmark, allocating and freeing schedules
+struct bench_pool_thread {
+  pthread_t thread;
+  long pairs;             // allocations to make, each freed again
+  bool locked;            // under one lock, as the old free list was
+};
+
+// One thread of the stress test (--stress THREADS) and the seats it
+// changed on each flight, city * STRESS_FLIGHTS + flight
+struct stress_thread {
+  pthread_t thread;
+  const city_id_t *ids;   // ids of the cities
+  int cities;
+  long ops;               // bookings and unbookings to make
+  struct workload random; // its own random sequence
+  long *booked;           // seats booked
+  long *waited;           // seats that went on a waitlist
+  long *unbooked;         // seats given back
+};
+
+// One thread of the stress test that adds and removes the schedules of
+// cities of its own, and their flights, and books on them while the
+// others book, and what it left on each flight, city * STRESS_FLIGHTS +
+// flight
+struct stress_churn {
+  pthread_t thread;
+  int first;              // number of its first city
+  struct workload random; // its own random sequence
+  _Atomic bool *stop;     // set once the booking threads are done
+  long changes;           // operations made
+  bool failed;            // one was answered as it could not be
+  city_id_t ids[STRESS_CHURN_CITIES];                 // CITY_NONE for none
+  int capacity[STRESS_CHURN_CITIES * STRESS_FLIGHTS]; // 0 for no flight
+  long seats[STRESS_CHURN_CITIES * STRESS_FLIGHTS];   // booked and waited,
+                                                      // less given back
+};
+
+// One thread of the stress test that reads the schedules while the others
+// change them, checking that what it reads could be
+struct stress_reader {
+  pthread_t thread;
+  const city_id_t *ids;   // ids of the cities that keep their schedules
+  int cities;
+  struct workload random; // its own random sequence
+  _Atomic bool *stop;     // set once the booking threads are done
+  long reads;             // lookups and listings made
+  bool failed;            // one read what never was
+};
+
+// What a stress test reader saw of one listing so far
+struct stress_listing {
+  city_t last;            // name of the city before, "" for none yet
+  flight_time_t time;     // of the departure before, TIME_NULL at first
+  bool failed;
+};
+
+// One operation of a workload
+struct workload_op {
+  uint8_t kind;                    // enum workload_kind
+  int city;                        // number of the city, not an id
+  flight_time_t time;
+  int capacity;                    // seats, for adding a flight
+};
+
+// Snapshot files ('S' and 'O' commands, --snapshot FILE) hold the whole
+// state in a compact binary form that is mapped and copied straight into
+// the schedules on load, rather than replayed command by command.
+//   struct snapshot_header
+//   struct snapshot_schedule   [n_schedules], oldest schedule first
+//   struct snapshot_flight     [n_flights], each schedule's in time order
+//   uint64_t                   n_connections
+//   struct snapshot_connection [n_connections], by origin in departure order
+//   uint64_t                   n_services
+//   struct snapshot_service    [n_services], by origin in departure order
+//   uint64_t                   n_words
+//   uint64_t                   [n_words], the calendars of the services
+//   uint64_t                   n_dates
+//   struct snapshot_date       [n_dates], each service's in day order
+//   uint64_t                   n_waitlists
+//   struct snapshot_waitlist   [n_waitlists], by schedule in time order
+//   uint64_t                   n_waiting
+//   int32_t                    [n_waiting], the seats of each booking
+//                              waiting, each waitlist's in order
+//   uint64_t                   journal_seq, the sequence number of the last
+//                              journal record whose change it has, 0 if
+//                              there was no journal
+//   uint64_t                   n_order, n_schedules
+//   uint32_t                   [n_order], the schedule records in name
+//                              order, so that loading links the sorted
+//                              order in one pass without comparing names
+// Fields are fixed width in the byte order of the machine that wrote it.
+// Version 1 files end after the flights, version 2 after the connections,
+// version 3 after the services, version 4 after the waitlists and version
+// 5 after the journal sequence number.
+struct snapshot_header {
+  char magic[8];          // SNAPSHOT_MAGIC
+  uint32_t version;       // SNAPSHOT_VERSION
+  uint32_t n_schedules;   // number of schedule records
+  uint64_t n_flights;     // number of flight records, all schedules
+};
+
+struct snapshot_schedule {
+  char destination[MAX_CITY_NAME_LEN+3]; // null terminated, zero padded
+  uint8_t reserved;                      // zero
+  uint32_t n_flights;                    // its flights in the flight records
+};
+
+struct snapshot_flight {
+  int32_t time;
+  int32_t available;
+  int32_t capacity;
+};
+
+struct snapshot_connection {
+  char origin[MAX_CITY_NAME_LEN+3];      // null terminated, zero padded
+  char destination[MAX_CITY_NAME_LEN+3]; // null terminated, zero padded
+  uint8_t reserved[2];                   // zero
+  int32_t departure;
+  int32_t arrival;
+  int32_t available;
+  int32_t capacity;
+};
+
+struct snapshot_service {
+  char origin[MAX_CITY_NAME_LEN+3];      // null terminated, zero padded
+  char destination[MAX_CITY_NAME_LEN+3]; // null terminated, zero padded
+  uint8_t reserved[2];                   // zero
+  int32_t departure;
+  int32_t arrival;
+  int32_t capacity;
+  int32_t first_day;
+  int32_t n_days;                        // its calendar takes (n_days+63)/64 words
+  int32_t n_dates;                       // its booked dates in the date records
+};
+
+struct snapshot_date {
+  int32_t day;
+  int32_t booked;
+};
+
+struct snapshot_waitlist {
+  char destination[MAX_CITY_NAME_LEN+3]; // null terminated, zero padded
+  uint8_t reserved;                      // zero
+  int32_t time;
+  int32_t overbooked;
+  int32_t n_waiting;                     // its bookings in the seat records
+};
+
+// The journal (--journal FILE) is an append-only log of every change made
+// through the engine since the last snapshot was saved or loaded, so the
+// state survives a crash: on startup the journal is replayed on top of the
+// snapshot.  Records are numbered in the order they are logged, on from
+// the 'n' record an emptied journal starts with (from 1 in journals from
+// before there were any).  A snapshot has the number of the last one whose
+// change it has, and a replay after loading it skips up to that one, so a
+// crash between saving the snapshot and emptying the journal changes
+// nothing.  Records collect in memory and are written and fsynced in
+// groups of group_commit, or sooner when the program waits for input or
+// exits, so the cost of the sync is shared by many bookings.
+struct journal_record {
+  uint8_t op;                            // command letter: A R a r s u g G k K
+                                         // v V y Y, S for a booking with spill,
+                                         // o for the origin of the next record,
+                                         // d for the calendar of the next 'v',
+                                         // p for the overbooking of the
+                                         // records after it, n for the
+                                         // sequence number of this one (see
+                                         // struct journal), f for part of the
+                                         // name of the file of the next 'O' or
+                                         // O for a snapshot loaded
+  char destination[MAX_CITY_NAME_LEN+2]; // null terminated, zero padded
+  int32_t time;                          // flight time, time asked for by 's',
+                                         // arrival time of 'o', last day of 'd'
+  int32_t capacity;                      // seats of a flight added by 'a' 'g'
+                                         // 'v', seats of 's' 'S' 'u' 'k' 'K' 'y'
+                                         // 'Y', day of 'o', weekdays of 'd',
+                                         // percent of 'p'
+  uint32_t check;                        // hash of the bytes above
+};
+
+struct journal {
+  int fd;                           // journal file, -1 if there is none
+  int group_commit;                 // records per write and fsync
+  struct journal_record *pending;   // records not written yet
+  int n_pending, max_pending;
+  struct journal_record *writing;   // records being written by a commit
+  int max_writing;
+  pthread_mutex_t lock;             // guards fd and the pending records
+  pthread_mutex_t commit_lock;      // one commit at a time, in order
+  const char *snapshot;             // --snapshot a restart loads before
+                                    // replaying the journal, or NULL
+  uint64_t seq;                     // sequence number of the last record
+                                    // logged, guarded by lock
+  uint64_t loaded;                  // that a snapshot loaded last has
+  bool typed;                       // stdin is a terminal, commit before
+                                    // each wait for a command
+};
+
+// Interned city names.  Every name a schedule was added for gets a dense
+// id, its position in the table, once when it is parsed.  Schedules, the
+// engine and the journal work with ids, so finding a schedule is an array
+// lookup and only the parser and the messages see names.  The names live
+// in chunks that never move, chunk k holding FIRST_CITY_NAMES << k of
+// them, so city_name() needs no lock.
+//
+// An id is kept while anything holds it: the schedule of the city, the
+// connections and services from or to it, the open views of it, and
+// whoever called city_intern until it calls city_release.  When the last
+// holder lets go the id goes on a free stack, a lock-free LIFO tagged
+// against ABA like the one of the schedule pool, and the next new name
+// takes it, so churning through names does not grow the ids, nor the
+// arrays indexed by them.  Until then the name stays in the index: a
+// lookup of it still finds the id, which has nothing, and interning it
+// again revives the id, which the free stack then passes over.
+struct city_table {
+  struct city_entry *chunks[MAX_CITY_CHUNKS]; // names by id
+  uint32_t n;                      // ids handed out so far, the next new one
+  struct city_slot *index;         // hash index of the names
+  size_t slots;                    // slots in index, a power of 2
+  _Atomic uint64_t free_head;      // tag << 32 | id+1 of the top free id
+  pthread_rwlock_t lock;           // guards all of it but the reference
+                                   // counts and the free stack, lookups
+                                   // hold it shared
+};
+
+// The name of an id and who holds it
+struct city_entry {
+  city_t name;                     // null terminated
+  _Atomic bool on_free;            // on the free stack, or being taken off
+  _Atomic uint32_t refs;           // holders, see struct city_table
+  uint32_t free_next;              // id+1 of next on the free stack
+};
+
+// One slot of the city name hash index.  The index is an open addressing
+// table (linear probing) kept at most half full.  The hash is cached so
+// that probing only calls strcmp when the full hash values match.
+struct city_slot {
+  unsigned int hash;   // city_hash() of the name
+  uint32_t entry;      // id+1 of the name, 0 if the slot is empty
+};
+
+// Node of the skip list that keeps the active cities sorted by name.  A
+// node is on levels [0, levels); level 0 links every active city in order
+// and each level above skips about 3 in 4 of the nodes of the one below.
+struct city_order_node {
+  city_id_t city;                      // active city, see city_name()
+  int levels;                          // levels the node is linked on
+  struct city_order_node *next[];      // next node on each level
 };
 
 /******************************************************************************
  * Global / External variables                                                *
  ******************************************************************************/
-// This program uses two global linked lists of Schedules.  See comments
-// of struct flight_schedule above for details
-struct flight_schedule *flight_schedules_free = NULL;
+// This program uses a global linked list of active Schedules and a pool
+// of free ones.  See comments of struct flight_schedule above for details
 struct flight_schedule *flight_schedules_active = NULL;
+struct flight_schedule_pool flight_schedules_pool = {
+  .grow_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// The engine functions may be called from many threads.  This lock guards
+// the active list and flight_schedules_by_city: lookups hold it shared,
+// adding and removing schedules hold it exclusive.  The flights of a
+// schedule are guarded by its own lock, which is only taken while holding
+// flight_schedules_lock, so a schedule can't be freed under a booking and
+// bookings to different destinations run in parallel.
+pthread_rwlock_t flight_schedules_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Pool of spilled flight blocks that are not in use.  Class k holds blocks
+// of MIN_SPILL_FLIGHTS << k flights, chained through their first bytes.
+void *flight_arrays_free[FLIGHT_ARRAY_CLASSES];
+pthread_mutex_t flight_arrays_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Pool of waitlist blocks that are not in use.  Class k holds blocks of
+// MIN_WAITLIST << k bookings, chained through their first bytes.
+void *waitlists_free[WAITLIST_CLASSES];
+pthread_mutex_t waitlists_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counts the times before a given time in a padded time lane, the best
+// version for this CPU, set by flight_simd_initialize
+int (*flight_count_before)(const packed_time_t *times, int n, flight_time_t time);
+
+// Batch mode input, base == NULL when reading commands from stdin
+struct batch_input batch = {NULL, 0, false, NULL, NULL};
+
+// Pending output, see struct output_buffer
+struct output_buffer output = {false, NULL, 0, {0}};
+
+// Journal of changes, see struct journal
+struct journal journal = {
+  .fd = -1, .group_commit = DEFAULT_GROUP_COMMIT,
+  .lock = PTHREAD_MUTEX_INITIALIZER, .commit_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// Directory the S, O and X commands of server clients have their files
+// in (--files DIR), NULL if they can't use files at all
+const char *server_files = NULL;
+
+// The router that started this shard (--shard-of PID), 0 if none did.
+// Its connection is trusted with any file, as it names them itself.
+long server_router = 0;
+
+// Interned city names, see struct city_table
+struct city_table cities = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+// The active schedule of each city id, NULL if it has none.  Always holds
+// exactly the schedules on flight_schedules_active.
+struct flight_schedule **flight_schedules_by_city = NULL;
+size_t flight_schedules_by_city_max = 0;
+
+#if FLIGHT_STATS
+// Timings of the commands run from stdin, a batch file or the server,
+// by stats_slot.  Only the thread running commands updates them.
+struct command_stats command_stats[sizeof(STATS_COMMANDS)];
+
+// City name lookups by the number of index slots probed, the last bucket
+// counting all longer probes.  Lookups run in any thread.
+_Atomic uint64_t stats_probes[STATS_PROBE_BUCKETS];
+
+// Periodic dump of the statistics to stderr (--stats-interval SECONDS)
+uint64_t stats_interval = 0;   // nanoseconds between dumps, 0 for none
+uint64_t stats_next_dump = 0;  // monotonic_ns() of the next one
+#endif
+
+// Skip list of the active cities sorted by name, see struct city_order_node.
+// Changed with the active list, so guarded by flight_schedules_lock too.
+struct city_order_node *city_order_head[CITY_ORDER_LEVELS];
+int city_order_levels = 1;          // levels in use
+uint32_t city_order_random = 1;     // xorshift state for node levels
+
+// The departure index, see struct departure_bucket.  Bit b of
+// departure_bits is set while departures[b] is not empty.
+struct departure_bucket departures[DEPARTURE_BUCKETS];
+_Atomic uint64_t departure_bits[DEPARTURE_WORDS];
+
+// The connections of each origin city id, see struct connection_list.
+// Changes hold connections_lock exclusive and itinerary searches hold it
+// shared.  Taken after flight_schedules_lock when both are held.
+struct connection_list *connections_by_city = NULL;
+size_t connections_by_city_max = 0;
+uint64_t connections_count = 0;   // in all the lists
+pthread_rwlock_t connections_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// The services of each origin city id, see struct service.  Guarded like
+// the connections by services_lock, taken after connections_lock.
+struct service_list *services_by_city = NULL;
+size_t services_by_city_max = 0;
+uint64_t services_count = 0;      // in all the lists
+pthread_rwlock_t services_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// The open read views, see struct flight_view
+struct view_registry views = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// The router of a sharded inventory (--router PATH), see struct router
+struct router router = {.ep = -1};
+
+// Minutes an itinerary leaves between arriving in a city and flying on
+// (--min-connection MINUTES)
+int connection_minutes = DEFAULT_MIN_CONNECTION;
+
+// Seats a flight can be booked over its capacity, in percent of it
+// (--overbook PERCENT).  The journal records it, so that replaying one
+// books with the margin its bookings were made with.
+int flight_overbook = 0;
+
+// Names of the kinds of workload operation, as the benchmark prints them
+const char *workload_names[WORKLOAD_KINDS] = {"add", "book", "unbook", "remove", "churn"};
 
 
 /******************************************************************************
  * Function Prototypes                                                        *
  ******************************************************************************/
 // Misc utility io functions
+bool command_get(char *command);
 int city_read(city_t city);           
-bool time_get(time_t *time_ptr);      
+int path_read(char *path);
+bool int_get(int *value_ptr);
+bool time_get(flight_time_t *time_ptr);      
 bool flight_capacity_get(int *capacity_ptr);
+bool seat_count_get(int *count_ptr);
+bool date_get(int *day_ptr);
+bool weekdays_get(int *weekdays_ptr);
 void print_command_help(void);
 
+// Buffered output
+void output_flush(void);
+void output_write(const char *data, size_t len);
+void output_str(const char *str);
+void output_char(char ch);
+void output_int(int value);
+
+// Statistics
+uint64_t monotonic_ns(void);
+#if FLIGHT_STATS
+int  stats_slot(char command);
+int  stats_bucket(uint64_t ns);
+uint64_t stats_bucket_top(int bucket);
+uint64_t stats_percentile(const struct command_stats *stats, double fraction);
+void stats_record(char command, uint64_t ns);
+void stats_probed(int probes);
+size_t stats_format(char *text, size_t max);
+void stats_append(char *text, size_t max, size_t *len, const char *format, ...);
+void stats_print(void);
+void stats_tick(void);
+#endif
+
+// Server mode
+bool command_run(char command);
+bool command_execute(char command);
+bool server_run(const char *path);
+int  server_listen(const char *path);
+bool server_file(const struct server_client *client, char *path);
+void server_accept(int ep, int listener);
+void server_read(struct server_client *client, void (*run)(struct server_client *client));
+size_t server_request_length(const char *p, const char *end);
+void server_run_requests(struct server_client *client);
+void server_queue(struct server_client *client, const char *data, size_t len);
+void server_send(int ep, struct server_client *client);
+void server_watch(int ep, struct server_client *client, bool out);
+void server_close(int ep, struct server_client *client);
+
+// Load test client
+int  load_test_size(int argc, char *argv[], int arg);
+bool load_test_run(struct load_test *load);
+bool load_test_setup(struct load_test *load);
+void load_test_city(const struct load_test *load, int i, city_t city);
+bool load_test_scale(struct load_test *load);
+void * load_test_client(void *arg);
+int  load_test_connect(const char *path);
+bool load_test_send(int fd, const char *data, size_t len);
+int  load_test_answers(const char *data, ssize_t n, bool *line_start);
+int  load_test_compare(const void *a, const void *b);
+
+// Sharded inventory
+struct shard_ring * shard_ring_new(int shards);
+int  shard_of(const struct shard_ring *ring, const char *city);
+uint64_t shard_mix(uint64_t x);
+bool shard_moves(city_id_t city, void *arg);
+bool router_run(struct router *r);
+bool router_start_shard(struct router *r, int k);
+void router_run_requests(struct server_client *client);
+struct router_request * router_request(struct server_client *client, char command, int n);
+void router_forward(struct router_request *request, int answer, int k,
+                    const char *text, size_t len);
+void router_read_shard(struct router_shard *shard);
+void router_answer(struct router_shard *shard, const char *text, size_t len, bool done);
+void router_send_shard(struct router_shard *shard);
+void router_watch_shard(struct router_shard *shard, bool out);
+void router_reply(struct server_client *client);
+void router_merge_lines(const struct router_request *request);
+void router_merge_departures(const struct router_request *request);
+bool router_departure(const char **p, const char *end, int *time, city_t city, int *avail);
+void router_ready(struct server_client *client);
+void router_drain(void);
+bool router_base(const struct router *r, char *base, size_t size);
+int  router_saved_shards(const struct router *r);
+int  router_add_shard(void);
+void router_close(struct server_client *client);
+void router_free(struct router_request *request);
+
+// Workloads and benchmark
+void workload_mix(struct workload *w, const char *text);
+uint64_t workload_random(struct workload *w);
+struct workload_op * workload_make(struct workload *w);
+bool workload_generate(struct workload *w);
+bool workload_bench(struct workload *w);
+long workload_max_rss(void);
+const struct bench * bench_find(const char *name);
+void bench_clear(void);
+bool bench_lookup(struct workload *w);
+struct flight_schedule * bench_walk(const char *name);
+bool bench_parse(struct workload *w);
+bool bench_pool(struct workload *w);
+bool bench_startup(struct workload *w);
+bool bench_journal(struct workload *w);
+bool bench_search(struct workload *w);
+bool bench_batch(struct workload *w);
+bool bench_interning(struct workload *w);
+void * bench_pool_run(void *arg);
+long bench_commands(const char *path, bool batched, const char *answers,
+                    uint64_t *elapsed);
+bool bench_same(const char *a, const char *b);
+void bench_path(char *path, size_t size, const char *what);
+int  bench_redirect(int fd);
+bool stress_run(struct workload *w, int threads);
+bool stress_round(struct workload *w, const city_id_t *ids, int threads, double *rate,
+                  long *changes, long *reads);
+void * stress_thread_run(void *arg);
+void * stress_churn_run(void *arg);
+void * stress_reader_run(void *arg);
+void stress_reader_city(city_id_t city, void *arg);
+bool stress_reader_departure(const struct departure *d, void *arg);
+bool stress_flight(city_id_t city, const struct flight *flight, long seats);
+bool stress_churn_check(const struct stress_churn *c);
+bool stress_index_check(size_t schedules);
+
+// Batch mode input
+bool batch_open(const char *path);
+void batch_close(void);
+int batch_city_read(city_t city);
+int batch_path_read(char *path);
+bool batch_int_get(int *value_ptr);
+
 // Core functions of the program
-void flight_schedule_initialize(struct flight_schedule array[], int n);
-struct flight_schedule * flight_schedule_find(city_t city);
+void flight_schedule_initialize(long n);
+long flight_schedule_chunk_size(int k);
+int  flight_schedule_chunk_of(uint32_t id, long *offset);
+struct flight_schedule * flight_schedule_at(uint32_t id);
+struct flight_schedule * flight_schedule_link(uint32_t link);
+struct flight_view_state * flight_schedule_views(const struct flight_schedule *fs);
+bool flight_schedule_grow(int k);
+struct flight_schedule * flight_schedule_find(city_id_t city);
 struct flight_schedule * flight_schedule_allocate(void);
 void flight_schedule_free(struct flight_schedule *fs);
+void flight_schedule_activate(struct flight_schedule *fs);
+void flight_schedule_deactivate(struct flight_schedule *fs);
 void flight_schedule_add(city_t city);
 void flight_schedule_listAll(void);
+void flight_schedule_listPrefix(city_t prefix);
 void flight_schedule_list(city_t city);
+void flight_schedule_list_inventory(void);
+void flight_schedule_list_view(const char *prefix);
+void flight_schedule_print(const char *city, const struct flight *flights, int n);
 void flight_schedule_add_flight(city_t city);
 void flight_schedule_remove_flight(city_t city);
 void flight_schedule_schedule_seat(city_t city);
 void flight_schedule_unschedule_seat(city_t city);
+void flight_schedule_schedule_seats(city_t city, bool spill);
+void flight_schedule_unschedule_seats(city_t city);
 void flight_schedule_remove(city_t city);
+void flight_schedule_list_city(city_id_t city, void *arg);
+void flight_schedule_departures(void);
+void flight_schedule_next_departures(void);
+bool flight_schedule_list_departure(const struct departure *d, void *arg);
+void flight_schedule_add_connection(city_t origin, city_t destination);
+void flight_schedule_remove_connection(city_t origin, city_t destination);
+void flight_schedule_book_connection(city_t origin, city_t destination, bool unbook);
+void flight_schedule_list_connections(city_t origin);
+void flight_schedule_list_connection(const struct connection *c, void *arg);
+void flight_schedule_itinerary(city_t destination);
+void flight_schedule_add_service(city_t origin, city_t destination);
+void flight_schedule_remove_service(city_t origin, city_t destination);
+void flight_schedule_book_service(city_t origin, city_t destination, bool unbook);
+void flight_schedule_list_services(city_t origin);
+void flight_schedule_list_service(const struct service *sv, int available, void *arg);
+void flight_schedule_list_waitlist(city_t city);
+
+// Seat reservation engine, safe to call from any thread
+struct flight_schedule * flight_engine_lock_city(city_id_t city);
+void flight_engine_unlock_city(struct flight_schedule *fs);
+bool flight_engine_exists(city_id_t city);
+enum flight_status flight_engine_add(city_id_t city);
+enum flight_status flight_engine_remove(city_id_t city);
+void flight_engine_for_each_city(void (*visit)(city_id_t city, void *arg), void *arg);
+void flight_engine_for_each_city_range(const char *from, const char *to,
+                                       void (*visit)(city_id_t city, void *arg), void *arg);
+void flight_engine_for_each_city_prefix(const char *prefix,
+                                        void (*visit)(city_id_t city, void *arg), void *arg);
+int  flight_engine_flights(city_id_t city, struct flight *flights, int max);
+void flight_engine_for_each_departure(flight_time_t from, flight_time_t to,
+                                      bool (*visit)(const struct departure *d, void *arg),
+                                      void *arg);
+enum flight_status flight_engine_add_flight(city_id_t city, flight_time_t time, int capacity);
+enum flight_status flight_engine_remove_flight(city_id_t city, flight_time_t time);
+enum flight_status flight_engine_book(city_id_t city, flight_time_t time, flight_time_t *booked);
+enum flight_status flight_engine_book_seats(city_id_t city, flight_time_t time, int count,
+                                            bool spill, flight_time_t *booked);
+int  flight_engine_book_batch(const struct flight_booking *requests, int n, uint8_t *status);
+enum flight_status flight_engine_unbook(city_id_t city, flight_time_t time);
+enum flight_status flight_engine_unbook_seats(city_id_t city, flight_time_t time, int count);
+int  flight_engine_waitlist(city_id_t city, flight_time_t time, int *overbooked,
+                            int *seats, int max);
+enum flight_status flight_schedule_book_seats(struct flight_schedule *fs, flight_time_t time,
+                                              int count, bool spill, flight_time_t *booked);
+struct flight_booking_groups * flight_booking_groups(int n);
+void flight_booking_groups_free(void *groups);
+void flight_booking_groups_key(void);
+enum flight_status flight_engine_add_connection(city_id_t origin, city_id_t destination,
+                                                flight_time_t departure, flight_time_t arrival,
+                                                int capacity);
+enum flight_status flight_engine_remove_connection(city_id_t origin, city_id_t destination,
+                                                   flight_time_t departure);
+enum flight_status flight_engine_book_connection(city_id_t origin, city_id_t destination,
+                                                 flight_time_t departure, int count);
+enum flight_status flight_engine_unbook_connection(city_id_t origin, city_id_t destination,
+                                                   flight_time_t departure, int count);
+void flight_engine_for_each_connection(city_id_t origin,
+                                       void (*visit)(const struct connection *c, void *arg),
+                                       void *arg);
+int  flight_engine_itinerary(city_id_t destination, flight_time_t time, flight_time_t deadline,
+                             struct itinerary_leg **legs, int *max);
+enum flight_status flight_engine_add_service(city_id_t origin, city_id_t destination,
+                                             flight_time_t departure, flight_time_t arrival,
+                                             int capacity, int first_day, int last_day,
+                                             int weekdays);
+enum flight_status flight_engine_remove_service(city_id_t origin, city_id_t destination,
+                                                flight_time_t departure, int day);
+enum flight_status flight_engine_book_service(city_id_t origin, city_id_t destination,
+                                              flight_time_t departure, int day, int count);
+enum flight_status flight_engine_unbook_service(city_id_t origin, city_id_t destination,
+                                                flight_time_t departure, int day, int count);
+void flight_engine_for_each_service(city_id_t origin, int day,
+                                    void (*visit)(const struct service *sv, int available,
+                                                  void *arg),
+                                    void *arg);
+
+struct flight_view * flight_engine_view_open(const char *prefix, bool flights);
+void flight_engine_view_close(struct flight_view *view);
+int  flight_engine_view_flights(const struct flight_view *view, size_t i,
+                                struct flight *flights, int max);
+
+// Snapshots of the whole state
+void flight_schedule_save(char *path);
+void flight_schedule_load(char *path);
+void flight_schedule_export(char *path);
+bool flight_engine_save(const char *path);
+bool flight_engine_load(const char *path);
+bool flight_engine_merge(const char *path);
+bool flight_engine_read(const char *path, bool replace);
+bool flight_engine_export(const char *path, bool (*moves)(city_id_t city, void *arg),
+                          void *arg);
+bool snapshot_write(const char *path, bool (*keep)(city_id_t city, void *arg), void *arg);
+bool flight_snapshot_valid(const char *base, size_t size);
+const void * snapshot_section(const char **p, const char *end, size_t size, uint64_t *n);
+
+// Write-ahead journal
+bool journal_open(const char *path);
+void journal_log(char op, city_id_t city, flight_time_t time, int capacity);
+void journal_log_connection(char op, city_id_t origin, city_id_t destination,
+                            flight_time_t departure, flight_time_t arrival, int seats);
+void journal_log_service(char op, city_id_t origin, city_id_t destination,
+                         flight_time_t departure, int day, int seats);
+void journal_log_service_add(city_id_t origin, city_id_t destination,
+                             flight_time_t departure, flight_time_t arrival, int capacity,
+                             int first_day, int last_day, int weekdays);
+void journal_log_overbook(void);
+void journal_log_sequence(void);
+void journal_log_load(const char *path);
+void journal_record_set(struct journal_record *record, char op, city_id_t city,
+                        flight_time_t time, int capacity);
+void journal_append(const struct journal_record *records, int n);
+void journal_commit(void);
+void journal_reset(void);
+bool journal_snapshot(const char *path);
+void journal_close(void);
+uint32_t journal_check(const struct journal_record *record);
+
+// Interned city names
+unsigned int city_hash(const char *city);
+city_id_t city_intern(const char *name);
+city_id_t city_lookup(const char *name);
+void city_hold(city_id_t city);
+void city_release(city_id_t city);
+const char * city_name(city_id_t city);
+struct city_entry * city_entry(city_id_t city);
+int city_chunk_of(city_id_t city, size_t *offset);
+city_id_t city_table_find(const char *name, unsigned int hash);
+city_id_t city_table_reuse(void);
+void city_table_place(struct city_slot *slots, size_t mask, unsigned int hash,
+                      uint32_t entry);
+void city_table_unplace(city_id_t city);
+bool city_table_resize(size_t slots);
+void city_table_initialize(size_t n);
+void city_table_reserve(size_t more);
 
-void flight_schedule_sort_flights_by_time(struct flight_schedule *fs);
-int  flight_compare_time(const void *a, const void *b);
+// Departure index
+void departure_initialize(void);
+void departure_open(city_id_t city, flight_time_t time);
+void departure_build(struct flight_schedule *const *schedules, size_t n);
+void departure_close(city_id_t city, flight_time_t time);
+uint32_t departure_slot_of(const struct departure_bucket *b, city_id_t city);
+void departure_resize(struct departure_bucket *b, uint32_t max);
+int  departure_next(int bucket);
+int  departure_cities(int bucket, city_id_t **cities, int *max);
+int  departure_compare(const void *a, const void *b);
+
+// Connections and itineraries
+struct connection_list * connection_list_of(city_id_t origin);
+int  connection_lower_bound(const struct connection_list *list, flight_time_t departure);
+int  connection_find(const struct connection_list *list, city_id_t destination,
+                     flight_time_t departure);
+bool connection_insert(city_id_t origin, const struct connection *c);
+void connection_delete(struct connection_list *list, int i);
+void connection_clear(void);
+void itinerary_push(struct itinerary_search *s, flight_time_t arrival, city_id_t city);
+uint64_t itinerary_pop(struct itinerary_search *s);
+
+// Services and calendars
+int  date_day(int year, int month, int day);
+int  date_of_day(int day);
+int  date_weekday(int day);
+bool service_calendar(struct service *sv, int first_day, int last_day, int weekdays);
+const uint64_t * service_words(const struct service *sv);
+bool service_operates(const struct service *sv, int day);
+int  service_date_lower_bound(const struct service *sv, int day);
+int  service_booked(const struct service *sv, int day);
+bool service_date_insert(struct service *sv, int d, int day);
+void service_date_delete(struct service *sv, int d);
+struct service_list * service_list_of(city_id_t origin);
+int  service_lower_bound(const struct service_list *list, flight_time_t departure);
+int  service_find(const struct service_list *list, city_id_t destination,
+                  flight_time_t departure, int day);
+bool service_insert(city_id_t origin, const struct service *sv);
+void service_delete(struct service_list *list, int i);
+void service_free(struct service *sv);
+void service_clear(void);
+
+// Waitlists
+int  waitlist_margin(int capacity);
+struct flight_waitlist ** waitlist_find(struct flight_schedule *fs, flight_time_t time);
+struct flight_waitlist * waitlist_at(struct flight_waitlist **link, flight_time_t time);
+enum flight_status waitlist_book(struct flight_schedule *fs, int i, int count);
+void waitlist_unbook(struct flight_schedule *fs, int i, int count);
+bool waitlist_waiting(struct flight_waitlist **cursor, flight_time_t time);
+bool waitlist_push(struct flight_waitlist **link, flight_time_t time, int seats);
+struct flight_waitlist * waitlist_new(struct flight_waitlist **link, flight_time_t time,
+                                      int max);
+bool waitlist_restore(struct flight_schedule *fs, flight_time_t time, int overbooked,
+                      const int32_t *seats, int n);
+void waitlist_drop(struct flight_waitlist **link);
+void waitlist_clear(struct flight_schedule *fs);
+int  waitlist_class(int max);
+struct flight_waitlist * waitlist_get(int max);
+void waitlist_put(struct flight_waitlist *wl);
+
+// Read views
+void view_preserve(struct flight_schedule *fs);
+uint64_t view_oldest(uint64_t epoch);
+void view_prune(struct flight_schedule *fs, uint64_t oldest);
+bool view_register(struct flight_view *view);
+void view_unregister(const struct flight_view *view);
+void view_reclaim(void);
+
+// Sorted destination order
+void city_order_insert(city_id_t city);
+void city_order_build(struct flight_schedule *const *schedules, const uint32_t *order,
+                      size_t n);
+struct city_order_node * city_order_node_new(city_id_t city);
+void city_order_remove(city_id_t city);
+struct city_order_node * city_order_seek(const char *name,
+                                         struct city_order_node ***before);
+
+// Flight storage helpers
+struct flight_lanes flight_schedule_lanes(struct flight_schedule *fs);
+int  flight_schedule_copy(struct flight_schedule *fs, struct flight *flights, int max);
+bool flight_schedule_reserve_flight(struct flight_schedule *fs);
+bool flight_schedule_reserve_flights(struct flight_schedule *fs, int n);
+void flight_schedule_release_flights(struct flight_schedule *fs);
+void flight_schedule_insert_flight(struct flight_schedule *fs, int i, flight_time_t time,
+                                   int available, int capacity);
+void flight_schedule_delete_flight(struct flight_schedule *fs, int i);
+void flight_schedule_set_available(struct flight_schedule *fs, int i, int available);
+int flight_array_class(int n);
+void * flight_array_get(int n);
+void flight_array_put(void *array, int n);
+
+// Departure time search
+int  flight_schedule_lower_bound(struct flight_schedule *fs, flight_time_t time);
+void flight_simd_initialize(void);
+int  flight_count_before_scalar(const packed_time_t *times, int n, flight_time_t time);
+#ifdef FLIGHT_SIMD_X86
+int  flight_count_before_sse2(const packed_time_t *times, int n, flight_time_t time);
+int  flight_count_before_avx2(const packed_time_t *times, int n, flight_time_t time);
+#endif
 
  
 int main(int argc, char *argv[]) 
 {
   long n = MAX_DEFAULT_SCHEDULES;
   char command;
-  city_t city;
+  const char *snapshot = NULL;
+  const char *journal_path = NULL;
+  const char *server_path = NULL;
+  int shards = DEFAULT_SHARDS;
+  struct load_test load = {.clients = 1, .cities = 1, .requests = LOAD_TEST_REQUESTS,
+                           .pipeline = LOAD_TEST_PIPELINE};
+  struct workload workload = {.ops = WORKLOAD_OPS, .cities = WORKLOAD_CITIES,
+                              .zipf = WORKLOAD_ZIPF, .mix = {20, 50, 20, 8, 2},
+                              .seed = 1};
+  bool generate = false;
+  const char *bench = NULL;
+  int stress = 0;
 
-  if (argc > 1) {
+  // whatever way we leave, buffered output gets written
+  atexit(output_flush);
+  router.self = argv[0]; // shards and routers started run this program
+  // somebody types the commands, and what they were told is done has to
+  // be durable wherever the answers go; answers are flushed at each prompt
+  // only when they read them too
+  journal.typed = isatty(STDIN_FILENO);
+  output.interactive = journal.typed && isatty(STDOUT_FILENO);
+
+  for (int arg = 1; arg < argc; arg++) {
+    if (strcmp(argv[arg], "--batch") == 0) {
+      // Read the commands from a file instead of stdin
+      if (arg+1 >= argc || !batch_open(argv[++arg])) {
+        output_str("ERROR: Can not read batch command file.\n");
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+    if (strcmp(argv[arg], "--journal") == 0) {
+      // Log all changes to a journal, replaying what is in it already
+      if (arg+1 >= argc) {
+        output_str("ERROR: Can not open journal file.\n");
+        exit(EXIT_FAILURE);
+      }
+      journal_path = argv[++arg];
+      continue;
+    }
+    if (strcmp(argv[arg], "--group-commit") == 0) {
+      // Number of journal records written and synced together
+      journal.group_commit = (arg+1 < argc) ? atoi(argv[++arg]) : 0;
+      if (journal.group_commit <= 0) {
+        output_str("ERROR: Bad group commit size specified.\n");
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+    if (strcmp(argv[arg], "--server") == 0) {
+      // Serve clients on a Unix domain socket
+      if (arg+1 >= argc) {
+        output_str("ERROR: Can not listen on server socket.\n");
+        exit(EXIT_FAILURE);
+      }
+      server_path = argv[++arg];
+      continue;
+    }
+    if (strcmp(argv[arg], "--files") == 0) {
+      // Directory the file commands of server clients are confined to
+      if (arg+1 >= argc) {
+        output_str("ERROR: Bad file directory specified.\n");
+        exit(EXIT_FAILURE);
+      }
+      server_files = argv[++arg];
+      continue;
+    }
+    if (strcmp(argv[arg], "--shard-of") == 0) {
+      // Started as a shard by the router with this process id
+      server_router = (arg+1 < argc) ? atol(argv[++arg]) : 0;
+      if (server_router <= 0) {
+        output_str("ERROR: Bad router process specified.\n");
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+    if (strcmp(argv[arg], "--router") == 0) {
+      // Serve clients on a Unix domain socket, the schedules sharded
+      // across worker processes
+      if (arg+1 >= argc) {
+        output_str("ERROR: Can not listen on router socket.\n");
+        exit(EXIT_FAILURE);
+      }
+      router.path = argv[++arg];
+      continue;
+    }
+    if (strcmp(argv[arg], "--shards") == 0) {
+      // Worker processes the router starts with
+      shards = (arg+1 < argc) ? atoi(argv[++arg]) : 0;
+      if (shards < 1 || shards > MAX_SHARDS) {
+        output_str("ERROR: Bad number of shards specified.\n");
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+    if (strcmp(argv[arg], "--load-test") == 0) {
+      // Measure the latency of a server instead of running one
+      if (arg+1 >= argc) {
+        output_str("ERROR: Can not connect to server socket.\n");
+        exit(EXIT_FAILURE);
+      }
+      load.path = argv[++arg];
+      continue;
+    }
+    // Shape of the load test: connections, requests on each, and how
+    // many of them are sent ahead of the answers
+    if (strcmp(argv[arg], "--clients") == 0) {
+      load.clients = load_test_size(argc, argv, ++arg);
+      continue;
+    }
+    if (strcmp(argv[arg], "--requests") == 0) {
+      load.requests = load_test_size(argc, argv, ++arg);
+      continue;
+    }
+    if (strcmp(argv[arg], "--pipeline") == 0) {
+      load.pipeline = load_test_size(argc, argv, ++arg);
+      continue;
+    }
+    if (strcmp(argv[arg], "--scaling") == 0) {
+      // Load test routers with 1, 2, 4 ... shards up to this many
+      load.scaling = load_test_size(argc, argv, ++arg);
+      if (load.scaling > MAX_SHARDS) {
+        output_str("ERROR: Bad number of shards specified.\n");
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+    if (strcmp(argv[arg], "--generate") == 0) {
+      // Print a synthetic workload as commands
+      generate = true;
+      continue;
+    }
+    if (strcmp(argv[arg], "--bench") == 0) {
+      // Run a synthetic workload against the engine and time it, or the
+      // benchmark named next, see benches
+      bench = "";
+      if (arg+1 < argc && argv[arg+1][0] >= 'a' && argv[arg+1][0] <= 'z') {
+        bench = argv[++arg];
+        if (bench_find(bench) == NULL) {
+          output_str("ERROR: Bad benchmark specified.\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      continue;
+    }
+    if (strcmp(argv[arg], "--stress") == 0) {
+      // Book and unbook from 1 to this many threads at once, checking the
+      // seats of every flight add up
+      stress = (arg+1 < argc) ? atoi(argv[++arg]) : 0;
+      if (stress < 1 || stress > MAX_STRESS_THREADS) {
+        output_str("ERROR: Bad number of stress test threads specified.\n");
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+    // Shape of the workload: operations, destinations, their skew, the
+    // percent of each kind of operation and where the random sequence starts
+    if (strcmp(argv[arg], "--ops") == 0) {
+      workload.ops = load_test_size(argc, argv, ++arg);
+      continue;
+    }
+    if (strcmp(argv[arg], "--cities") == 0) {
+      // also the destinations of the load test
+      workload.cities = load.cities = load_test_size(argc, argv, ++arg);
+      continue;
+    }
+    if (strcmp(argv[arg], "--zipf") == 0) {
+      char *end = NULL;
+      workload.zipf = (arg+1 < argc) ? strtod(argv[++arg], &end) : -1;
+      if (!(workload.zipf >= 0) || *end != '\0') {
+        output_str("ERROR: Bad workload skew specified.\n");
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+    if (strcmp(argv[arg], "--mix") == 0) {
+      workload_mix(&workload, (arg+1 < argc) ? argv[++arg] : "");
+      continue;
+    }
+    if (strcmp(argv[arg], "--seed") == 0) {
+      workload.seed = (arg+1 < argc) ? strtoull(argv[++arg], NULL, 10) : 0;
+      continue;
+    }
+    if (strcmp(argv[arg], "--min-connection") == 0) {
+      // Minutes an itinerary leaves to change flights
+      char *end = NULL;
+      long minutes = (arg+1 < argc) ? strtol(argv[++arg], &end, 10) : -1;
+      if (minutes < 0 || minutes > TIME_MAX || *end != '\0') {
+        output_str("ERROR: Bad minimum connection time specified.\n");
+        exit(EXIT_FAILURE);
+      }
+      connection_minutes = minutes;
+      continue;
+    }
+    if (strcmp(argv[arg], "--overbook") == 0) {
+      // Percent of its capacity a flight can be booked over it
+      char *end = NULL;
+      long percent = (arg+1 < argc) ? strtol(argv[++arg], &end, 10) : -1;
+      if (percent < 0 || percent > MAX_OVERBOOK || *end != '\0') {
+        output_str("ERROR: Bad overbooking margin specified.\n");
+        exit(EXIT_FAILURE);
+      }
+      flight_overbook = percent;
+      continue;
+    }
+#if FLIGHT_STATS
+    if (strcmp(argv[arg], "--stats-interval") == 0) {
+      // Dump the statistics to stderr every so many seconds
+      long seconds = (arg+1 < argc) ? strtol(argv[++arg], NULL, 10) : 0;
+      if (seconds <= 0) {
+        output_str("ERROR: Bad statistics interval specified.\n");
+        exit(EXIT_FAILURE);
+      }
+      stats_interval = seconds * 1000000000ull;
+      stats_next_dump = monotonic_ns() + stats_interval;
+      continue;
+    }
+#endif
+    if (strcmp(argv[arg], "--snapshot") == 0) {
+      // Start from the state saved in a snapshot file
+      if (arg+1 >= argc) {
+        output_str("ERROR: Can not load snapshot file.\n");
+        exit(EXIT_FAILURE);
+      }
+      snapshot = argv[++arg];
+      continue;
+    }
     // If the program was passed an argument then try and convert the first
     // argument in the a number that will override the default max number
     // of schedule we will support
     char *end;
-    n = strtol(argv[1], &end, 10); // CPAMA p 787
-    if (n==0) {
-      printf("ERROR: Bad number of default max scedules specified.\n");
+    n = strtol(argv[arg], &end, 10); // CPAMA p 787
+    if (n<=0) {
+      output_str("ERROR: Bad number of default max scedules specified.\n");
       exit(EXIT_FAILURE);
     }
   }
 
-  // C99 lets us allocate an array of a fixed length as a local 
-  // variable.  Since we are doing this in main and a call to main will be 
-  // active for the entire time of the program's execution this
-  // array will be alive for the entire time -- its memory and values
-  // will be stable for the entire program execution.
-  struct flight_schedule flight_schedules[n];
- 
-  // Initialize our global lists of free and active schedules using
-  // the elements of the flight_schedules array
-  flight_schedule_initialize(flight_schedules, n);
+  if (load.path != NULL) {
+    if (load.scaling > 0) {
+      load.journal = journal_path;
+      return load_test_scale(&load) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    return load_test_run(&load) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (generate) {
+    if (!workload_generate(&workload)) {
+      output_str("ERROR: Out of memory for the workload.\n");
+      exit(EXIT_FAILURE);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  // Initialize our global lists of free and active schedules.  n is only
+  // the size of the first chunk of the pool; more schedules are allocated
+  // on the heap as they are needed so the pool is not limited to n.
+  flight_schedule_initialize(n);
 
   // DEFENSIVE PROGRAMMING:  Write code that avoids bad things from happening.
   //  When possible, if we know that some particular thing should have happened
   //  we think of that as an assertion and write code to test them.
   // Use the assert function (CPAMA p749) to be sure the initilization has set
   // the free list to a non-null value and the the active list is a null value.
-  assert(flight_schedules_free != NULL && flight_schedules_active == NULL);
+  assert(flight_schedules_pool.chunks[0] != NULL && flight_schedules_active == NULL);
 
-  // Print the instruction in the beginning
-  print_command_help();
+  if (bench != NULL && *bench != '\0') {
+    // the named benchmarks start from nothing, without journal or snapshot
+    if (!bench_find(bench)->run(&workload)) {
+      output_str("ERROR: Can not run the benchmark.\n");
+      exit(EXIT_FAILURE);
+    }
+    return EXIT_SUCCESS;
+  }
+  if (stress > 0) {
+    if (!stress_run(&workload, stress)) {
+      output_str("ERROR: The stress test failed.\n");
+      exit(EXIT_FAILURE);
+    }
+    return EXIT_SUCCESS;
+  }
 
-  // Command processing loop
-  while (scanf(" %c", &command) == 1) {
-    switch (command) {
-    case 'A': 
-      //  Add an active flight schedule for a new city eg "A Toronto\n"
-      city_read(city);
-      flight_schedule_add(city);
+  if (router.path != NULL) {
+    // The shards run this program as servers, with the journal and
+    // snapshot options.  The router itself only uses the engine to put
+    // together the cities moving to a new shard.
+    router.journal = journal_path;
+    router.snapshot = snapshot;
+    snprintf(router.options[0], sizeof(router.options[0]), "%d", journal.group_commit);
+    snprintf(router.options[1], sizeof(router.options[1]), "%d", connection_minutes);
+    snprintf(router.options[2], sizeof(router.options[2]), "%d", flight_overbook);
+    snprintf(router.options[3], sizeof(router.options[3]), "%ld", n);
+    snprintf(router.options[4], sizeof(router.options[4]), "%ld", (long)getpid());
+    router.n_shards = shards;
+    if (!router_run(&router)) {
+      output_str("ERROR: Can not start the router.\n");
+      exit(EXIT_FAILURE);
+    }
+    return EXIT_SUCCESS;
+  }
 
-      break;
-    case 'L':
-      // List all active flight schedules eg. "L\n"
-      flight_schedule_listAll();
-      break;
-    case 'l': 
-      // List the flights for a particular city eg. "l\n"
-      city_read(city);
-      flight_schedule_list(city);
-      break;
-    case 'a':
-      // Adds a flight for a particular city "a Toronto\n
-      //                                      360 100\n"
-      city_read(city);
-      flight_schedule_add_flight(city);
-      break;
-    case 'r':
-      // Remove a flight for a particular city "r Toronto\n
-      //                                        360\n"
-      city_read(city);
-      flight_schedule_remove_flight(city);
-	break;
-    case 's':
-      // schedule a seat on a flight for a particular city "s Toronto\n
-      //                                                    300\n"
-      city_read(city);
-      flight_schedule_schedule_seat(city);
-      break;
-    case 'u':
-      // unschedule a seat on a flight for a particular city "u Toronto\n
-      //                                                      360\n"
-        city_read(city);
-        flight_schedule_unschedule_seat(city);
-        break;
-    case 'R':
-      // remove the schedule for a particular city "R Toronto\n"
-      city_read(city);
-      flight_schedule_remove(city);  
-      break;
-    case 'h':
-        print_command_help();
-        break;
-    case 'q':
-      goto done;
-    default:
-      printf("Bad command. Use h to see help.\n");
+  // a shard starts with nothing until the router first saves its snapshot
+  if (snapshot != NULL && !(server_router != 0 && access(snapshot, F_OK) != 0) &&
+      !flight_engine_load(snapshot)) {
+    output_str("ERROR: Can not load snapshot file.\n");
+    exit(EXIT_FAILURE);
+  }
+  journal.snapshot = snapshot;
+  if (journal_path != NULL && !journal_open(journal_path)) {
+    output_str("ERROR: Can not open journal file.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (bench != NULL) {
+    if (!workload_bench(&workload)) {
+      output_str("ERROR: Out of memory for the workload.\n");
+      exit(EXIT_FAILURE);
     }
+    journal_close();
+    return EXIT_SUCCESS;
   }
- done:
-  return EXIT_SUCCESS;
-}
+
+  if (server_path != NULL) {
+    // Answer the commands of clients on a socket instead of stdin
+    if (!server_run(server_path)) {
+      output_str("ERROR: Can not listen on server socket.\n");
+      exit(EXIT_FAILURE);
+    }
+    journal_close();
+    return EXIT_SUCCESS;
+  }
+
+  // Print the instruction in the beginning
+  print_command_help();
+
+  // Command processing loop
+  while (command_get(&command) && command_run(command))
+    ;
+  batch_close();
+  journal_close();
+  return EXIT_SUCCESS;
+}
+
+/**********************************************************************
+ * command_run: runs one command, reading its arguments from the     *
+ * input, and times it.  Returns false for the quit command.         *
+ *********************************************************************/
+bool command_run(char command)
+{
+#if FLIGHT_STATS
+  uint64_t start = monotonic_ns();
+  bool more = command_execute(command);
+  stats_record(command, monotonic_ns() - start);
+  stats_tick();
+  return more;
+#else
+  return command_execute(command);
+#endif
+}
+
+/**********************************************************************
+ * command_execute: the commands themselves, see command_run         *
+ *********************************************************************/
+bool command_execute(char command)
+{
+  city_t city, destination;
+  char path[MAX_PATH_LEN+1];
+
+  switch (command) {
+  case 'A': 
+    //  Add an active flight schedule for a new city eg "A Toronto\n"
+    city_read(city);
+    flight_schedule_add(city);
+
+    break;
+  case 'L':
+    // List all active flight schedules eg. "L\n"
+    flight_schedule_listAll();
+    break;
+  case 'P':
+    // List the cities whose name starts with a prefix eg. "P San\n"
+    city_read(city);
+    flight_schedule_listPrefix(city);
+    break;
+  case 'l': 
+    // List the flights for a particular city eg. "l\n"
+    city_read(city);
+    flight_schedule_list(city);
+    break;
+  case 'F':
+    // List the flights of every city, all as of one moment eg. "F\n"
+    flight_schedule_list_inventory();
+    break;
+  case 'a':
+    // Adds a flight for a particular city "a Toronto\n
+    //                                      360 100\n"
+    city_read(city);
+    flight_schedule_add_flight(city);
+    break;
+  case 'r':
+    // Remove a flight for a particular city "r Toronto\n
+    //                                        360\n"
+    city_read(city);
+    flight_schedule_remove_flight(city);
+	break;
+  case 's':
+    // schedule a seat on a flight for a particular city "s Toronto\n
+    //                                                    300\n"
+    city_read(city);
+    flight_schedule_schedule_seat(city);
+    break;
+  case 'u':
+    // unschedule a seat on a flight for a particular city "u Toronto\n
+    //                                                      360\n"
+      city_read(city);
+      flight_schedule_unschedule_seat(city);
+      break;
+  case 'b':
+  case 'B':
+    // schedule seats for a party, on one flight or spread over the next
+    // ones with B "b Toronto\n
+    //              300 40\n"
+    city_read(city);
+    flight_schedule_schedule_seats(city, command == 'B');
+    break;
+  case 'c':
+    // unschedule seats of a party "c Toronto\n
+    //                              360 40\n"
+    city_read(city);
+    flight_schedule_unschedule_seats(city);
+    break;
+  case 'W':
+    // list the seats waiting for a flight "W Toronto\n
+    //                                      360\n"
+    city_read(city);
+    flight_schedule_list_waitlist(city);
+    break;
+  case 'D':
+    // list the flights with seats left between two times "D 480 540\n"
+    flight_schedule_departures();
+    break;
+  case 'N':
+    // list the next flights with seats left from a time "N 480 10\n"
+    flight_schedule_next_departures();
+    break;
+  case 'g':
+    // add a connection between two cities away from home "g Paris\n
+    //                                                      Rome\n
+    //                                                      480 600 100\n"
+    city_read(city);
+    city_read(destination);
+    flight_schedule_add_connection(city, destination);
+    break;
+  case 'G':
+    // remove a connection "G Paris\n
+    //                      Rome\n
+    //                      480\n"
+    city_read(city);
+    city_read(destination);
+    flight_schedule_remove_connection(city, destination);
+    break;
+  case 'k':
+  case 'K':
+    // schedule seats on a connection, or unschedule them with K "k Paris\n
+    //                                                            Rome\n
+    //                                                            480 2\n"
+    city_read(city);
+    city_read(destination);
+    flight_schedule_book_connection(city, destination, command == 'K');
+    break;
+  case 'i':
+    // list the connections leaving a city "i Paris\n"
+    city_read(city);
+    flight_schedule_list_connections(city);
+    break;
+  case 'I':
+    // find the earliest way to a city from home "I Rome\n
+    //                                            420 1080\n"
+    city_read(city);
+    flight_schedule_itinerary(city);
+    break;
+  case 'v':
+    // add a service running on many days "v Paris\n
+    //                                     Rome\n
+    //                                     480 600 100 20260601 20260930 1111100\n"
+    city_read(city);
+    city_read(destination);
+    flight_schedule_add_service(city, destination);
+    break;
+  case 'V':
+    // remove the service operating on a date "V Paris\n
+    //                                         Rome\n
+    //                                         480 20260715\n"
+    city_read(city);
+    city_read(destination);
+    flight_schedule_remove_service(city, destination);
+    break;
+  case 'y':
+  case 'Y':
+    // schedule seats on a service on a date, or unschedule them with Y
+    //   "y Paris\n
+    //    Rome\n
+    //    480 20260715 2\n"
+    city_read(city);
+    city_read(destination);
+    flight_schedule_book_service(city, destination, command == 'Y');
+    break;
+  case 'w':
+    // list the services leaving a city on a date "w Paris\n
+    //                                             20260715\n"
+    city_read(city);
+    flight_schedule_list_services(city);
+    break;
+  case 'R':
+    // remove the schedule for a particular city "R Toronto\n"
+    city_read(city);
+    flight_schedule_remove(city);  
+    break;
+  case 'S':
+    // save all schedules to a snapshot file "S state.snap\n"
+    path_read(path);
+    flight_schedule_save(path);
+    break;
+  case 'O':
+    // replace all schedules with those of a snapshot file "O state.snap\n"
+    path_read(path);
+    flight_schedule_load(path);
+    break;
+  case 'X':
+    // move the cities a new shard takes to a snapshot file "X new.snap\n
+    //                                                        3\n"
+    path_read(path);
+    flight_schedule_export(path);
+    break;
+  case 'E':
+    // add a shard, only a router does "E\n"
+    output_str("Sorry this is not a sharded inventory.\n");
+    break;
+#if FLIGHT_STATS
+  case 'T':
+    // print the statistics of the commands run so far "T\n"
+    stats_print();
+    break;
+#endif
+  case 'h':
+      print_command_help();
+      break;
+  case 'q':
+    return false;
+  default:
+    output_str("Bad command. Use h to see help.\n");
+  }
+  return true;
+}
 
 /**********************************************************************
  * city_read: Takes in and processes a given city following a command *
@@ -192,6 +1988,8 @@ int main(int argc, char *argv[])
 int city_read(city_t city) {
   int ch, i=0;
 
+  if (batch.base != NULL) return batch_city_read(city);
+
   // skip leading non letter characters
   while (true) {
     ch = getchar();
@@ -210,532 +2008,8295 @@ int city_read(city_t city) {
 }
 
 
-/****************************************************************
- * Message functions so that your messages match what we expect *
- ****************************************************************/
-void msg_city_bad(char *city) {
-  printf("No schedule for %s\n", city);
+/**********************************************************************
+ * path_read: Takes in a file name following a command: the rest of  *
+ * the line without leading and trailing blanks, up to MAX_PATH_LEN   *
+ *********************************************************************/
+int path_read(char *path) {
+  int ch, i=0;
+
+  if (batch.base != NULL) return batch_path_read(path);
+
+  while ((ch = getchar()) == ' ' || ch == '\t')
+    ;
+  while (ch != '\n' && ch != EOF) {
+    if (i < MAX_PATH_LEN) {
+      path[i++] = ch;
+    }
+    ch = getchar();
+  }
+  while (i > 0 && (path[i-1] == ' ' || path[i-1] == '\t' || path[i-1] == '\r')) {
+    i--;
+  }
+  path[i] = '\0';
+  return i;
 }
 
-void msg_city_exists(char *city) {
-  printf("There is a schedule of %s already.\n", city);
+
+/**********************************************************************
+ * command_get: reads the next command character, skipping white     *
+ * space.  Returns false at the end of the input.                    *
+ *********************************************************************/
+bool command_get(char *command) {
+  if (batch.base == NULL) {
+    if (journal.typed) {
+      journal_commit(); // what the user was told is done must be durable
+    }
+    if (output.interactive) {
+      output_flush(); // the user should see all answers before typing again
+    }
+    return scanf(" %c", command) == 1;
+  }
+
+  while (batch.pos < batch.end && (*batch.pos == ' ' ||
+         (*batch.pos >= '\t' && *batch.pos <= '\r'))) {
+    batch.pos++;
+  }
+  if (batch.pos == batch.end) return false;
+  *command = *batch.pos++;
+  return true;
 }
 
-void msg_schedule_no_free(void) {
-  printf("Sorry no more free schedules.\n");
+/**********************************************************************
+ * int_get: reads an integer like scanf("%d") does.  Returns false if *
+ * there is no number next in the input.                              *
+ *********************************************************************/
+bool int_get(int *value_ptr) {
+  if (batch.base == NULL) return scanf("%d", value_ptr) == 1;
+  return batch_int_get(value_ptr);
 }
 
-void msg_city_flights(char *city) {
-  printf("The flights for %s are:", city);
+
+/******************************************************************************
+ * Batch mode input                                                           *
+ ******************************************************************************/
+
+/* Maps the command file into memory (reads it in BATCH_READ_BLOCK sized
+   blocks when it can't be mapped, eg. a pipe) and makes it the input of
+   command_get, city_read and int_get.  Returns false if it can't be read. */
+bool batch_open(const char *path)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) return false;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      batch.base = map;
+      batch.size = st.st_size;
+      batch.mapped = true;
+    }
+  }
+
+  if (batch.base == NULL) {
+    size_t max = BATCH_READ_BLOCK;
+    ssize_t got;
+
+    batch.size = 0;
+    batch.base = malloc(max);
+    while (batch.base != NULL &&
+           (got = read(fd, batch.base + batch.size, max - batch.size)) > 0) {
+      batch.size += got;
+      if (batch.size == max) { // full, make room for another block
+        char *bigger = realloc(batch.base, max + BATCH_READ_BLOCK);
+        if (bigger == NULL) {
+          free(batch.base);
+        }
+        batch.base = bigger;
+        max += BATCH_READ_BLOCK;
+      }
+    }
+    if (batch.base == NULL || got < 0) {
+      free(batch.base);
+      batch.base = NULL;
+      close(fd);
+      return false;
+    }
+    batch.mapped = false;
+  }
+
+  close(fd);
+  batch.pos = batch.base;
+  batch.end = batch.base + batch.size;
+  return true;
 }
 
-void msg_flight_info(int time, int avail, int capacity) {
-  printf(" (%d, %d, %d)", time, avail, capacity);
+/* Releases the batch command stream, if there is one */
+void batch_close(void)
+{
+  if (batch.base == NULL) return;
+  if (batch.mapped) {
+    munmap(batch.base, batch.size);
+  } else {
+    free(batch.base);
+  }
+  batch.base = NULL;
+  batch.pos = batch.end = NULL;
 }
 
-void msg_city_max_flights_reached(char *city) {
-  printf("Sorry we cannot add more flights on this city.\n");
+/* city_read for batch mode: skips to the first letter and takes the rest of
+   the line, truncated to MAX_CITY_NAME_LEN characters */
+int batch_city_read(city_t city)
+{
+  const char *p = batch.pos, *end = batch.end;
+
+  // skip leading non letter characters
+  while (p < end && !((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'))) {
+    p++;
+  }
+
+  const char *nl = memchr(p, '\n', end - p);
+  size_t len = (nl != NULL ? nl : end) - p;
+
+  if (len > MAX_CITY_NAME_LEN) len = MAX_CITY_NAME_LEN;
+  memcpy(city, p, len);
+  city[len] = '\0';
+
+  batch.pos = (nl != NULL) ? nl + 1 : end;
+  return len;
 }
 
-void msg_flight_bad_time(void) {
-  printf("Sorry there's no flight scheduled on this time.\n");
+/* path_read for batch mode */
+int batch_path_read(char *path)
+{
+  const char *p = batch.pos, *end = batch.end;
+
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+
+  const char *nl = (p < end) ? memchr(p, '\n', end - p) : NULL;
+  const char *last = (nl != NULL) ? nl : end;
+
+  batch.pos = (nl != NULL) ? nl + 1 : end;
+  while (last > p && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r')) {
+    last--;
+  }
+
+  size_t len = last - p;
+  if (len > MAX_PATH_LEN) len = MAX_PATH_LEN;
+  memcpy(path, p, len);
+  path[len] = '\0';
+  return len;
 }
 
-void msg_flight_no_seats(void) {
-    printf("Sorry there's no more seats available!\n");
+/* int_get for batch mode: optional sign and decimal digits after white
+   space, consumed the same way scanf("%d") consumes them.  Like scanf the
+   number is converted as strtol would, saturating at LONG_MIN and
+   LONG_MAX, and then cut down to an int, so an overflowing number gives
+   the same value both ways. */
+bool batch_int_get(int *value_ptr)
+{
+  const char *p = batch.pos, *end = batch.end;
+  bool negative = false;
+  unsigned long value = 0, limit;
+
+  while (p < end && (*p == ' ' || (*p >= '\t' && *p <= '\r'))) {
+    p++;
+  }
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p++ == '-');
+  }
+  if (p == end || *p < '0' || *p > '9') {
+    batch.pos = p;
+    return false;
+  }
+  limit = negative ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+  while (p < end && *p >= '0' && *p <= '9') {
+    unsigned digit = *p++ - '0';
+    value = (value > (limit - digit) / 10) ? limit : value * 10 + digit;
+  }
+  batch.pos = p;
+
+  long number;
+  if (!negative) {
+    number = value;
+  } else if (value == limit) {
+    number = LONG_MIN;
+  } else {
+    number = -(long)value;
+  }
+  *value_ptr = (int)number;
+  return true;
 }
 
-void msg_flight_all_seats_empty(void) {
-  printf("All the seats on this flights are empty!\n");
+
+/******************************************************************************
+ * Buffered output                                                            *
+ ******************************************************************************/
+
+/* Writes out everything in the output buffer */
+void output_flush(void)
+{
+  size_t done = 0;
+
+  if (output.client != NULL) {
+    server_queue(output.client, output.data, output.len);
+    output.len = 0;
+    return;
+  }
+
+  while (done < output.len) {
+    ssize_t n = write(STDOUT_FILENO, output.data + done, output.len - done);
+    if (n <= 0) break; // stdout is gone, nothing we can do
+    done += n;
+  }
+  output.len = 0;
 }
 
-void msg_time_bad() {
-  printf("Invalid time value\n");
+/* Appends len bytes to the output, flushing first if they don't fit */
+void output_write(const char *data, size_t len)
+{
+  if (output.len + len > OUTPUT_BUFFER_SIZE) {
+    output_flush();
+  }
+  if (len > OUTPUT_BUFFER_SIZE) { // too big to buffer, pass it through
+    memcpy(output.data, data, OUTPUT_BUFFER_SIZE);
+    output.len = OUTPUT_BUFFER_SIZE;
+    output_flush();
+    output_write(data + OUTPUT_BUFFER_SIZE, len - OUTPUT_BUFFER_SIZE);
+    return;
+  }
+  memcpy(output.data + output.len, data, len);
+  output.len += len;
 }
 
-void msg_capacity_bad() {
-  printf("Invalid capacity value\n");
+void output_str(const char *str)
+{
+  output_write(str, strlen(str));
 }
 
-void print_command_help()
+void output_char(char ch)
 {
-  printf("Here are the possible commands:\n"
-	 "A <city name>     - Add an active empty flight schedule for\n"
-	 "                    <city name>\n"
-	 "L                 - List cities which have an active schedule\n"
-	 "l <city name>     - List the flights for <city name>\n"
-	 "a <city name>\n"
-         "<time> <capacity> - Add a flight for <city name> @ <time> time\n"
-	 "                    with <capacity> seats\n"  
-	 "r <city name>\n"
-         "<time>            - Remove a flight form <city name> whose time is\n"
-	 "                    <time>\n"
-	 "s <city name>\n"
-	 "<time>            - Attempt to schedule seat on flight to \n"
-	 "                    <city name> at <time> or next closest time on\n"
-	 "                    which their is an available seat\n"
-	 "u <city name>\n"
-	 "<time>            - unschedule a seat from flight to <city name>\n"
-	 "                    at <time>\n"
-	 "R <city name>     - Remove schedule for <city name>\n"
-	 "h                 - print this help message\n"
-	 "q                 - quit\n"
-);
+  if (output.len == OUTPUT_BUFFER_SIZE) {
+    output_flush();
+  }
+  output.data[output.len++] = ch;
 }
 
+/* Formats value in decimal, like printf("%d") */
+void output_int(int value)
+{
+  char digits[12];
+  int i = sizeof(digits);
+  unsigned int u = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
 
-/****************************************************************
- * Resets a flight schedule                                     *
- ****************************************************************/
-void flight_schedule_reset(struct flight_schedule *fs) {
-    fs->destination[0] = 0;
-    for (int i=0; i<MAX_FLIGHTS_PER_CITY; i++) {
-      fs->flights[i].time = TIME_NULL;
-      fs->flights[i].available = 0;
-      fs->flights[i].capacity = 0;
+  do {
+    digits[--i] = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (value < 0) {
+    digits[--i] = '-';
+  }
+  output_write(digits + i, sizeof(digits) - i);
+}
+
+
+/******************************************************************************
+ * Server mode                                                                *
+ *                                                                            *
+ * --server PATH answers the same commands as stdin for any number of         *
+ * clients on a Unix domain socket, in one thread driven by epoll.  A request *
+ * is a command line, plus the line of numbers for the commands that take     *
+ * one (a r s u b B c I w X), or the destination and numbers lines of the     *
+ * connection and service commands (g G k K v V y Y), and its answer ends     *
+ * with a line holding just ".".                                              *
+ *                                                                            *
+ * Clients can't name just any file: S, O and X are refused unless the       *
+ * server has a --files directory, and then take a name in it.  Only the      *
+ * router that started a shard is trusted with paths of its own.             *
+ ******************************************************************************/
+
+/* Listens on path and serves clients until killed.  Returns false if it
+   can't listen. */
+bool server_run(const char *path)
+{
+#ifdef __linux__
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  int listener = server_listen(path);
+  if (listener < 0) return false;
+
+  int ep = epoll_create1(0);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL}; // NULL is the listener
+  if (ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, listener, &ev) != 0) {
+    close(listener);
+    return false;
+  }
+
+  while (true) {
+    int timeout = -1;
+#if FLIGHT_STATS
+    if (stats_interval != 0) { // wake up for the periodic dump when idle
+      uint64_t now = monotonic_ns();
+      timeout = (stats_next_dump > now) ? (stats_next_dump - now) / 1000000 + 1 : 0;
+    }
+#endif
+    int n = epoll_wait(ep, events, SERVER_MAX_EVENTS, timeout);
+#if FLIGHT_STATS
+    stats_tick();
+#endif
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    // run what came in, collecting the clients that have answers
+    struct server_client *ready = NULL;
+    for (int i = 0; i < n; i++) {
+      struct server_client *client = events[i].data.ptr;
+      if (client == NULL) {
+        server_accept(ep, listener);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        server_read(client, server_run_requests);
+      }
+      if (!client->ready) {
+        client->ready = true;
+        client->next_ready = ready;
+        ready = client;
+      }
     }
-    fs->next = NULL;
-    fs->prev = NULL;
+
+    // the answers of this round can only go out once their changes are
+    // durable, all of them share one journal write
+    journal_commit();
+    while (ready != NULL) {
+      struct server_client *client = ready;
+      ready = client->next_ready;
+      client->ready = false;
+      server_send(ep, client);
+    }
+  }
+
+  close(ep);
+  close(listener);
+  return true;
+#else
+  (void)path;
+  return false; // needs epoll
+#endif
 }
 
-/******************************************************************
-* Initializes the flight_schedule array that will hold any flight *
-* schedules created by the user. This is called in main for you.  *
- *****************************************************************/
+/* Creates the listening socket at path, replacing a stale socket left
+   there by an earlier server.  Returns -1 if it can't. */
+int server_listen(const char *path)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SERVER_BACKLOG) != 0 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
 
-void flight_schedule_initialize(struct flight_schedule array[], int n)
+/* Accepts all waiting connections */
+void server_accept(int ep, int listener)
 {
-  flight_schedules_active = NULL;
-  flight_schedules_free = NULL;
+#ifdef __linux__
+  int fd;
 
-  // takes care of empty array case
-  if (n==0) return;
+  while ((fd = accept(listener, NULL, NULL)) >= 0) {
+    struct server_client *client = calloc(1, sizeof(*client));
+    struct epoll_event ev = {.events = EPOLLIN};
 
-  // Loop through the Array connecting them
-  // as a linear doubly linked list
-  array[0].prev = NULL;
-  for (int i=0; i<n-1; i++) {
-    flight_schedule_reset(&array[i]);
-    array[i].next = &array[i+1];
-    array[i+1].prev = &array[i];
+    ev.data.ptr = client;
+    if (client == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 || // not kept open by shards
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      free(client);
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+    if (server_router > 0) {
+      struct ucred peer;
+      socklen_t len = sizeof(peer);
+      client->trusted = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &len) == 0 &&
+                        peer.pid == server_router;
+    }
   }
-  // Takes care of last node.  
-  flight_schedule_reset(&array[n-1]); // reset clears all fields
-  array[n-1].next = NULL;
-  array[n-1].prev = &array[n-2];
-  flight_schedules_free = &array[0];
+#else
+  (void)ep;
+  (void)listener;
+#endif
 }
 
-/***********************************************************
- * time_get: read a time from the user
-   Time in this program is a minute number 0-((24*60)-1)=1439
-   -1 is used to indicate the NULL empty time 
-   This function should read in a time value and check its 
-   validity.  If it is not valid eg. not -1 or not 0-1439
-   It should print "Invalid Time" and return false.
-   othewise it should return the value in the integer pointed
-   to by time_ptr.
- ***********************************************************/
-bool time_get(int *time_ptr) {
-  if (scanf("%d", time_ptr)==1) {
-    return (TIME_NULL == *time_ptr || 
-	    (*time_ptr >= TIME_MIN && *time_ptr <= TIME_MAX));
-  } 
-  msg_time_bad();
-  return false;
+/* Checks the file a server client named in an S, O or X command, client
+   NULL for stdin or a batch file, which can name any.  A client other
+   than a shard's router can only name a file in the --files directory,
+   without a directory of its own, and path becomes its path there.
+   Returns false, leaving path alone, if the client can't use it. */
+bool server_file(const struct server_client *client, char *path)
+{
+  char name[MAX_PATH_LEN+1];
+
+  if (client == NULL || client->trusted) return true;
+  if (server_files == NULL || path[0] == '\0' || path[0] == '.' ||
+      strchr(path, '/') != NULL ||
+      strlen(server_files) + 1 + strlen(path) > MAX_PATH_LEN) {
+    return false;
+  }
+  strcpy(name, path);
+  snprintf(path, MAX_PATH_LEN+1, "%s/%s", server_files, name);
+  return true;
 }
 
-/***********************************************************
- * flight_capacity_get: read the capacity of a flight from the user
-   This function should read in a capacity value and check its 
-   validity.  If it is not greater than 0, it should print 
-   "Invalid capacity value" and return false. Othewise it should 
-   return the value in the integer pointed to by cap_ptr.
- ***********************************************************/
-bool flight_capacity_get(int *cap_ptr) {
-  if (scanf("%d", cap_ptr)==1) {
-    return *cap_ptr > 0;
+/* Reads everything the client has sent and runs the complete requests
+   with run */
+void server_read(struct server_client *client, void (*run)(struct server_client *client))
+{
+  while (!client->hung_up && !client->quit) {
+    if (client->in_len == SERVER_INPUT_SIZE) {
+      run(client); // make room
+      if (client->in_len == SERVER_INPUT_SIZE) {
+        client->hung_up = true; // a request that long is not one of ours
+        break;
+      }
+    }
+
+    ssize_t n = read(client->fd, client->in + client->in_len,
+                     SERVER_INPUT_SIZE - client->in_len);
+    if (n > 0) {
+      client->in_len += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      client->hung_up = true; // the requests it sent still get answers
+    }
   }
-  msg_capacity_bad();
-  return false;
+  run(client);
+}
+
+/* Returns the length of the first request in [p, end) if all of its lines
+   are there, or 0 */
+size_t server_request_length(const char *p, const char *end)
+{
+  const char *q = p;
+
+  while (q < end && (*q == ' ' || (*q >= '\t' && *q <= '\r'))) {
+    q++;
+  }
+  if (q == end) return 0;
+
+  int lines = 1;
+  if (*q != '\0' && strchr("gGkKvVyY", *q) != NULL) {
+    lines = 3;
+  } else if (*q != '\0' && strchr("arsubBcWIwX", *q) != NULL) {
+    lines = 2;
+  }
+  while (lines-- > 0) {
+    const char *nl = memchr(q, '\n', end - q);
+    if (nl == NULL) return 0;
+    q = nl + 1;
+  }
+  return q - p;
+}
+
+/* Runs the complete requests a client has sent, queuing their answers.
+   Each request is parsed like a batch file holding just it, so its
+   commands can't read into the next one. */
+void server_run_requests(struct server_client *client)
+{
+  size_t done = 0, len;
+  char command;
+
+  output.client = client;
+  while (!client->quit &&
+         (len = server_request_length(client->in + done, client->in + client->in_len)) > 0) {
+    batch.base = client->in;
+    batch.pos = client->in + done;
+    batch.end = client->in + done + len;
+    while (command_get(&command)) {
+      if (!command_run(command)) {
+        client->quit = true;
+        break;
+      }
+    }
+    output_str(".\n");
+    done += len;
+  }
+  batch.base = NULL;
+  batch.pos = batch.end = NULL;
+  output_flush();
+  output.client = NULL;
+
+  memmove(client->in, client->in + done, client->in_len - done);
+  client->in_len -= done;
+}
+
+/* Adds len bytes to the answers waiting to be sent to a client */
+void server_queue(struct server_client *client, const char *data, size_t len)
+{
+  if (client->out_len + len > client->out_max) {
+    size_t max = client->out_max ? client->out_max : OUTPUT_BUFFER_SIZE;
+    while (max < client->out_len + len) {
+      max *= 2;
+    }
+    char *bigger = realloc(client->out, max);
+    if (bigger == NULL) {
+      output.client = NULL; // report it on stdout
+      output_str("ERROR: Out of memory for client answers.\n");
+      exit(EXIT_FAILURE);
+    }
+    client->out = bigger;
+    client->out_max = max;
+  }
+  memcpy(client->out + client->out_len, data, len);
+  client->out_len += len;
+}
+
+/* Sends as much of the queued answers as the socket takes.  While it is
+   full the client is not read either, so a client that does not read its
+   answers can't make them pile up.  Closes the client once it is done. */
+void server_send(int ep, struct server_client *client)
+{
+  while (client->out_sent < client->out_len) {
+    ssize_t n = send(client->fd, client->out + client->out_sent,
+                     client->out_len - client->out_sent, MSG_NOSIGNAL);
+    if (n > 0) {
+      client->out_sent += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      server_watch(ep, client, true);
+      return;
+    } else {
+      server_close(ep, client); // gone
+      return;
+    }
+  }
+  client->out_len = client->out_sent = 0;
+  if ((client->quit || client->hung_up) && client->first_request != NULL) {
+#ifdef __linux__
+    // a router client: wait for the shards to answer, it has nothing to say
+    epoll_ctl(ep, EPOLL_CTL_DEL, client->fd, NULL);
+#endif
+  } else if (client->quit || client->hung_up) {
+    server_close(ep, client);
+  } else {
+    server_watch(ep, client, false);
+  }
+}
+
+/* Waits for room to send to the client (out) or for its requests */
+void server_watch(int ep, struct server_client *client, bool out)
+{
+#ifdef __linux__
+  if (client->blocked != out) {
+    struct epoll_event ev = {.events = out ? EPOLLOUT : EPOLLIN};
+    ev.data.ptr = client;
+    epoll_ctl(ep, EPOLL_CTL_MOD, client->fd, &ev);
+    client->blocked = out;
+  }
+#else
+  (void)ep;
+  (void)client;
+  (void)out;
+#endif
 }
 
-void flight_schedule_sort_flights_by_time(struct flight_schedule *fs) 
+/* Disconnects a client */
+void server_close(int ep, struct server_client *client)
+{
+  router_close(client);
+#ifdef __linux__
+  epoll_ctl(ep, EPOLL_CTL_DEL, client->fd, NULL);
+#else
+  (void)ep;
+#endif
+  close(client->fd);
+  free(client->out);
+  free(client);
+}
+
+
+/******************************************************************************
+ * Load test client                                                           *
+ *                                                                            *
+ * --load-test PATH books and frees seats on LOAD_TEST_CITY through a server  *
+ * and prints the 50th, 99th and 99.9th percentile of the time to answer.     *
+ * With --cities K the bookings are spread over LoadTest0 to LoadTest<K-1>,   *
+ * and --scaling MAX runs it against routers with 1, 2, 4 ... MAX shards.     *
+ ******************************************************************************/
+
+/* Reads the count following option argv[arg-1] */
+int load_test_size(int argc, char *argv[], int arg)
+{
+  long value = (arg < argc) ? strtol(argv[arg], NULL, 10) : 0;
+
+  if (value <= 0 || value > INT_MAX) {
+    output_str("ERROR: Bad load test size specified.\n");
+    exit(EXIT_FAILURE);
+  }
+  return value;
+}
+
+/* Sets up the cities on the server, runs the clients and prints the
+   latencies.  Returns false if the server can't be used. */
+bool load_test_run(struct load_test *load)
+{
+  bool ok = load_test_setup(load);
+  if (!ok) return false;
+
+  pthread_t *threads = malloc(load->clients * sizeof(pthread_t));
+  struct load_test *runs = malloc(load->clients * sizeof(struct load_test));
+  uint64_t *latency = malloc((size_t)load->clients * load->requests * sizeof(uint64_t));
+  if (threads == NULL || runs == NULL || latency == NULL) {
+    output_str("ERROR: Out of memory for the load test.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t start = monotonic_ns();
+  int started = 0;
+  for (int i = 0; i < load->clients; i++) {
+    runs[i] = *load;
+    runs[i].latency = latency + (size_t)i * load->requests;
+    if (pthread_create(&threads[i], NULL, load_test_client, &runs[i]) != 0) break;
+    started++;
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+    ok = ok && runs[i].ok;
+  }
+  uint64_t elapsed = monotonic_ns() - start;
+  ok = ok && started == load->clients;
+
+  if (ok) {
+    size_t n = (size_t)load->clients * load->requests;
+    char line[256];
+
+    qsort(latency, n, sizeof(uint64_t), load_test_compare);
+    snprintf(line, sizeof(line),
+             "%zu requests, %d clients, pipeline %d: %.0f requests/s\n"
+             "p50 %.1f us  p99 %.1f us  p999 %.1f us\n",
+             n, load->clients, load->pipeline, n / (elapsed / 1e9),
+             latency[n * 50 / 100] / 1e3, latency[n * 99 / 100] / 1e3,
+             latency[n * 999 / 1000] / 1e3);
+    output_str(line);
+  }
+  free(latency);
+  free(runs);
+  free(threads);
+  return ok;
+}
+
+/* Adds the cities of the load test, each with a flight every hour with
+   more seats than can be booked.  Returns false if the server can't be
+   used. */
+bool load_test_setup(struct load_test *load)
+{
+  char setup[64 * 32];
+  char answers[4096];
+  city_t city;
+  int fd = load_test_connect(load->path);
+  bool ok = fd >= 0;
+
+  for (int i = 0; ok && i < load->cities; i++) {
+    size_t len = 0;
+    load_test_city(load, i, city);
+    len += snprintf(setup + len, sizeof(setup) - len, "A %s\n", city);
+    for (int t = 0; t <= TIME_MAX; t += 60) {
+      len += snprintf(setup + len, sizeof(setup) - len, "a %s\n%d %d\n",
+                      city, t, MAX_FLIGHT_CAPACITY);
+    }
+    ok = load_test_send(fd, setup, len);
+    bool line_start = true;
+    for (int done = 0; ok && done < 1 + (TIME_MAX + 60) / 60; ) {
+      ssize_t got = read(fd, answers, sizeof(answers));
+      if (got <= 0) {
+        ok = false;
+      } else {
+        done += load_test_answers(answers, got, &line_start);
+      }
+    }
+  }
+  if (fd >= 0) close(fd);
+  return ok;
+}
+
+/* Name of city i of the load test, LOAD_TEST_CITY if there is just one */
+void load_test_city(const struct load_test *load, int i, city_t city)
+{
+  if (load->cities == 1) {
+    strcpy(city, LOAD_TEST_CITY);
+  } else {
+    snprintf(city, sizeof(city_t), "%s%d", LOAD_TEST_CITY, i);
+  }
+}
+
+/* Runs the load test against routers with 1, 2, 4 ... shards up to
+   load->scaling, started on load->path one after the other, printing the
+   results of each */
+bool load_test_scale(struct load_test *load)
+{
+  bool ok = true;
+
+  for (int shards = 1; ok && shards <= load->scaling; shards *= 2) {
+    char count[16];
+    const char *argv[8] = {router.self, "--router", load->path, "--shards", count};
+    int n = 5;
+
+    snprintf(count, sizeof(count), "%d", shards);
+    if (load->journal != NULL) {
+      argv[n++] = "--journal";
+      argv[n++] = load->journal;
+    }
+    argv[n] = NULL;
+    pid_t pid = fork();
+    if (pid == 0) {
+      execv("/proc/self/exe", (char **)argv);
+      execvp(router.self, (char **)argv);
+      _exit(EXIT_FAILURE);
+    }
+
+    // wait for the router to listen, a stale socket refuses until it does
+    int fd = -1;
+    for (int tries = 0; pid > 0 && fd < 0 && tries < SHARD_START_TRIES; tries++) {
+      if (waitpid(pid, NULL, WNOHANG) != 0) break;
+      fd = load_test_connect(load->path);
+      if (fd < 0) {
+        nanosleep(&(struct timespec){0, 10000000}, NULL);
+      }
+    }
+    ok = fd >= 0;
+    if (ok) {
+      close(fd);
+      output_int(shards);
+      output_str(shards == 1 ? " shard:\n" : " shards:\n");
+      ok = load_test_run(load);
+    }
+    if (pid > 0) {
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+    }
+  }
+  return ok;
+}
+
+/* One connection of the load test.  Alternately books a seat on a flight
+   and frees it again, so every request does the same work, keeping
+   pipeline of them in flight. */
+void * load_test_client(void *arg)
+{
+  struct load_test *load = arg;
+  uint64_t *sent = malloc(load->pipeline * sizeof(uint64_t)); // by request % pipeline
+  char requests[64 * 48];
+  char answers[4096];
+  city_t city;
+  int n_sent = 0, n_done = 0;
+  bool line_start = true; // the next answer byte starts a line
+  int fd = load_test_connect(load->path);
+
+  load->ok = fd >= 0 && sent != NULL;
+  while (load->ok && n_done < load->requests) {
+    size_t len = 0;
+    while (n_sent < load->requests && n_sent - n_done < load->pipeline &&
+           len + 48 <= sizeof(requests)) {
+      int pair = n_sent / 2; // a booking and its freeing
+      int t = (pair / load->cities % 24) * 60;
+      load_test_city(load, pair % load->cities, city);
+      len += snprintf(requests + len, sizeof(requests) - len, "%c %s\n%d\n",
+                      (n_sent % 2) ? 'u' : 's', city, t);
+      sent[n_sent % load->pipeline] = monotonic_ns();
+      n_sent++;
+    }
+    if (len > 0 && !load_test_send(fd, requests, len)) {
+      load->ok = false;
+      break;
+    }
+
+    ssize_t got = read(fd, answers, sizeof(answers));
+    if (got <= 0) {
+      load->ok = false;
+      break;
+    }
+    uint64_t now = monotonic_ns();
+    for (int i = load_test_answers(answers, got, &line_start); i > 0; i--) {
+      load->latency[n_done] = now - sent[n_done % load->pipeline];
+      n_done++;
+    }
+  }
+
+  if (fd >= 0) close(fd);
+  free(sent);
+  return NULL;
+}
+
+/* Counts the answers ended in n bytes read from the server.  *line_start
+   tells whether the bytes start a line, and is updated for the next ones. */
+int load_test_answers(const char *data, ssize_t n, bool *line_start)
+{
+  int answers = 0;
+
+  for (ssize_t i = 0; i < n; i++) {
+    answers += *line_start && data[i] == '.';
+    *line_start = data[i] == '\n';
+  }
+  return answers;
+}
+
+/* Connects to the server at path, returns -1 if it can't */
+int load_test_connect(const char *path)
+{
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+/* Sends all of data, returns false if the server is gone */
+bool load_test_send(int fd, const char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* Orders latencies for qsort */
+int load_test_compare(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+
+/******************************************************************************
+ * Workloads and benchmark                                                    *
+ *                                                                            *
+ * A workload is a reproducible random stream of operations on the cities    *
+ * "City0" to "City<n-1>", its destinations following a Zipf distribution.   *
+ * --generate prints it as commands; --bench runs it against the engine      *
+ * functions in this process and prints ops/s, latency percentiles for each  *
+ * kind of operation, and memory.                                             *
+ *                                                                            *
+ * --bench NAME runs one of the benches below instead, each timing one part   *
+ * of the program against what it replaced or at several sizes.  They build  *
+ * their own state and ignore --journal and --snapshot, as does --stress,     *
+ * which books from many threads at once and checks no seat goes missing.    *
+ ******************************************************************************/
+
+/* Reads the --mix percentages add,book,unbook,remove,churn */
+void workload_mix(struct workload *w, const char *text)
+{
+  int total = 0;
+
+  for (int k = 0; k < WORKLOAD_KINDS; k++) {
+    char *end;
+    long percent = strtol(text, &end, 10);
+    if (end == text || percent < 0 || percent > 100 ||
+        *end != (k < WORKLOAD_KINDS - 1 ? ',' : '\0')) {
+      output_str("ERROR: Bad workload mix specified.\n");
+      exit(EXIT_FAILURE);
+    }
+    w->mix[k] = percent;
+    total += percent;
+    text = end + 1;
+  }
+  if (total != 100) {
+    output_str("ERROR: Bad workload mix specified.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Next number of the workload's random sequence (splitmix64) */
+uint64_t workload_random(struct workload *w)
+{
+  uint64_t z = (w->seed += 0x9e3779b97f4a7c15ull);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/* Makes the operations of a workload.  Destination i is picked with
+   probability proportional to 1/(i+1)^zipf.  Unbooking and removing use
+   one of the last WORKLOAD_TIMES times added to the city, so most of them
+   find a flight.  Returns NULL if out of memory. */
+struct workload_op * workload_make(struct workload *w)
+{
+  struct workload_op *ops = malloc(w->ops * sizeof(struct workload_op));
+  double *cdf = malloc(w->cities * sizeof(double));
+  flight_time_t *times = malloc((size_t)w->cities * WORKLOAD_TIMES * sizeof(flight_time_t));
+  long *n_times = calloc(w->cities, sizeof(long));
+
+  if (ops != NULL && cdf != NULL && times != NULL && n_times != NULL) {
+    double sum = 0;
+    for (int i = 0; i < w->cities; i++) {
+      sum += pow(i + 1, -w->zipf);
+      cdf[i] = sum;
+    }
+
+    for (long n = 0; n < w->ops; n++) {
+      struct workload_op *op = &ops[n];
+      double u = (workload_random(w) >> 11) * (sum / 9007199254740992.0); // [0, sum)
+      int lo = 0, hi = w->cities - 1;
+      while (lo < hi) { // first city whose cdf is over u
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] <= u) lo = mid + 1; else hi = mid;
+      }
+
+      int pick = workload_random(w) % 100, kind = 0;
+      while (pick >= w->mix[kind]) {
+        pick -= w->mix[kind++];
+      }
+
+      flight_time_t *recent = times + (size_t)lo * WORKLOAD_TIMES;
+      op->kind = kind;
+      op->city = lo;
+      op->time = workload_random(w) % (TIME_MAX + 1);
+      op->capacity = 1 + workload_random(w) % WORKLOAD_CAPACITY;
+      if (kind == WORKLOAD_ADD) {
+        recent[n_times[lo]++ % WORKLOAD_TIMES] = op->time;
+      } else if ((kind == WORKLOAD_UNBOOK || kind == WORKLOAD_REMOVE) && n_times[lo] > 0) {
+        long have = n_times[lo] < WORKLOAD_TIMES ? n_times[lo] : WORKLOAD_TIMES;
+        op->time = recent[workload_random(w) % have];
+      } else if (kind == WORKLOAD_CHURN) {
+        n_times[lo] = 0;
+      }
+    }
+  } else {
+    free(ops);
+    ops = NULL;
+  }
+  free(n_times);
+  free(times);
+  free(cdf);
+  return ops;
+}
+
+/* Prints a workload as commands: the cities, the operations, then q */
+bool workload_generate(struct workload *w)
+{
+  struct workload_op *ops = workload_make(w);
+  if (ops == NULL) return false;
+
+  for (int i = 0; i < w->cities; i++) {
+    output_str("A City");
+    output_int(i);
+    output_char('\n');
+  }
+  for (long n = 0; n < w->ops; n++) {
+    const struct workload_op *op = &ops[n];
+    output_char(WORKLOAD_COMMANDS[op->kind]);
+    output_str(" City");
+    output_int(op->city);
+    output_char('\n');
+    if (op->kind == WORKLOAD_CHURN) {
+      // and straight back, without flights
+      output_str("A City");
+      output_int(op->city);
+    } else {
+      output_int(op->time);
+      if (op->kind == WORKLOAD_ADD) {
+        output_char(' ');
+        output_int(op->capacity);
+      }
+    }
+    output_char('\n');
+  }
+  output_str("q\n");
+  free(ops);
+  return true;
+}
+
+/* Runs a workload against the engine, timing every operation, and prints
+   what it measured.  Everything is allocated and touched before the run
+   so the growth of the resident set is the engine's own. */
+bool workload_bench(struct workload *w)
+{
+  struct workload_op *ops = workload_make(w);
+  city_id_t *ids = malloc(w->cities * sizeof(city_id_t));
+  uint64_t *latency = malloc(w->ops * sizeof(uint64_t));
+  uint64_t *by_kind = malloc(w->ops * sizeof(uint64_t));
+  long counts[WORKLOAD_KINDS] = {0};
+  long first[WORKLOAD_KINDS + 1] = {0};
+  char line[256];
+
+  bool ok = ops != NULL && ids != NULL && latency != NULL && by_kind != NULL;
+  if (ok) {
+    memset(latency, 0, w->ops * sizeof(uint64_t));
+    memset(by_kind, 0, w->ops * sizeof(uint64_t));
+    for (int i = 0; i < w->cities; i++) {
+      snprintf(line, sizeof(line), "City%d", i);
+      ids[i] = city_intern(line);
+      flight_engine_add(ids[i]);
+    }
+    long rss_before = workload_max_rss();
+
+    uint64_t start = monotonic_ns();
+    for (long n = 0; n < w->ops; n++) {
+      const struct workload_op *op = &ops[n];
+      city_id_t city = ids[op->city];
+      uint64_t t = monotonic_ns();
+      switch (op->kind) {
+      case WORKLOAD_ADD:
+        flight_engine_add_flight(city, op->time, op->capacity);
+        break;
+      case WORKLOAD_BOOK:
+        flight_engine_book(city, op->time, NULL);
+        break;
+      case WORKLOAD_UNBOOK:
+        flight_engine_unbook(city, op->time);
+        break;
+      case WORKLOAD_REMOVE:
+        flight_engine_remove_flight(city, op->time);
+        break;
+      case WORKLOAD_CHURN:
+        flight_engine_remove(city);
+        flight_engine_add(city);
+        break;
+      }
+      latency[n] = monotonic_ns() - t;
+    }
+    uint64_t elapsed = monotonic_ns() - start;
+    long rss_after = workload_max_rss();
+
+    // gather the latencies of each kind together and sort them
+    for (long n = 0; n < w->ops; n++) {
+      counts[ops[n].kind]++;
+    }
+    for (int k = 0; k < WORKLOAD_KINDS; k++) {
+      first[k+1] = first[k] + counts[k];
+    }
+    for (long n = 0; n < w->ops; n++) {
+      by_kind[first[ops[n].kind]++] = latency[n];
+    }
+    for (int k = WORKLOAD_KINDS; k > 0; k--) { // back to the first of each
+      first[k] = first[k-1];
+    }
+    first[0] = 0;
+
+    snprintf(line, sizeof(line),
+             "%ld ops, %d cities, zipf %.2f: %.0f ops/s\n"
+             "max resident %ld KiB, %ld KiB before the run\n",
+             w->ops, w->cities, w->zipf, w->ops / (elapsed / 1e9),
+             rss_after, rss_before);
+    output_str(line);
+    for (int k = 0; k < WORKLOAD_KINDS; k++) {
+      long n = counts[k];
+      uint64_t *kind = by_kind + first[k];
+      if (n == 0) continue;
+      qsort(kind, n, sizeof(uint64_t), load_test_compare);
+      snprintf(line, sizeof(line),
+               "%-7s %9ld  p50 %.2f us  p99 %.2f us  p999 %.2f us\n",
+               workload_names[k], n, kind[n * 50 / 100] / 1e3,
+               kind[n * 99 / 100] / 1e3, kind[n * 999 / 1000] / 1e3);
+      output_str(line);
+    }
+    for (int i = 0; i < w->cities; i++) {
+      city_release(ids[i]);
+    }
+  }
+  free(by_kind);
+  free(latency);
+  free(ids);
+  free(ops);
+  return ok;
+}
+
+/* Largest resident set of the process so far, KiB */
+long workload_max_rss(void)
+{
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// The benchmarks --bench NAME runs
+const struct bench benches[] = {
+  {"lookup", bench_lookup},     // destination hash index against a list walk
+  {"parse", bench_parse},       // commands/s through --batch and through stdin
+  {"pool", bench_pool},         // schedule allocate/free pairs/s from many threads
+  {"startup", bench_startup},   // loading a snapshot against replaying commands
+  {"journal", bench_journal},   // bookings/s at several group commit sizes
+  {"search", bench_search},     // booking latency by flights per city and kernel
+  {"batch", bench_batch},       // batch booking against one booking at a time
+  {"interning", bench_interning}, // city ids against city_t names, time and memory
+};
+
+// Commands the parse benchmark runs first, with numbers that do not fit an
+// int: scanf("%d") saturates them to a long and then cuts that down, so
+// the first 'b' books 1000 seats and the one after asks for -1
+const char bench_numbers[] =
+  "A Overflow\n"
+  "a Overflow\n4294967896 2000\n"                // at 600
+  "b Overflow\n600 42949673960\n"
+  "b Overflow\n600 99999999999999999999999\n"
+  "c Overflow\n600 -42949673960\n"
+  "c Overflow\n+600 -99999999999999999999999\n"
+  "b Overflow\n-4294966696 000000000000000000000000000007\n"
+  "l Overflow\n"
+  "R Overflow\n";
+
+/* The benchmark called name, NULL if there is none */
+const struct bench * bench_find(const char *name)
+{
+  for (size_t k = 0; k < sizeof(benches) / sizeof(benches[0]); k++) {
+    if (strcmp(benches[k].name, name) == 0) return &benches[k];
+  }
+  return NULL;
+}
+
+/* Removes every schedule, so a benchmark can start over */
+void bench_clear(void)
+{
+  while (flight_schedules_active != NULL) {
+    flight_engine_remove(flight_schedules_active->city);
+  }
+}
+
+/* Times finding a destination by name through the hash index against
+   walking the active list comparing names, as flight_schedule_find did,
+   with 1k, 10k and 100k cities */
+bool bench_lookup(struct workload *w)
+{
+  const int sizes[] = {1000, 10000, 100000};
+  const int max = 100000;
+  city_t *names = malloc(max * sizeof(city_t));
+  char line[256];
+  int have = 0;
+
+  if (names == NULL) return false;
+  for (int k = 0; k < 3; k++) {
+    for (; have < sizes[k]; have++) {
+      snprintf(names[have], sizeof(city_t), "City%d", have);
+      city_id_t city = city_intern(names[have]);
+      flight_engine_add(city);
+      city_release(city); // the schedule holds it
+    }
+
+    long found = 0;
+    uint64_t start = monotonic_ns();
+    for (long n = 0; n < BENCH_LOOKUPS; n++) {
+      found += flight_engine_exists(city_lookup(names[workload_random(w) % have]));
+    }
+    double hashed = (monotonic_ns() - start) / (double)BENCH_LOOKUPS;
+
+    long walks = BENCH_WALKS / have;
+    start = monotonic_ns();
+    for (long n = 0; n < walks; n++) {
+      found += bench_walk(names[workload_random(w) % have]) != NULL;
+    }
+    double walked = (monotonic_ns() - start) / (double)walks;
+
+    if (found != BENCH_LOOKUPS + walks) {
+      free(names);
+      return false;
+    }
+    snprintf(line, sizeof(line),
+             "%6d cities: hash index %.0f ns, list walk %.0f ns per lookup\n",
+             have, hashed, walked);
+    output_str(line);
+  }
+  bench_clear();
+  free(names);
+  return true;
+}
+
+/* Finds the schedule of a city by walking the active list and comparing
+   names, NULL if there is none */
+struct flight_schedule * bench_walk(const char *name)
+{
+  struct flight_schedule *fs;
+
+  pthread_rwlock_rdlock(&flight_schedules_lock);
+  for (fs = flight_schedules_active; fs != NULL; fs = flight_schedule_link(fs->next)) {
+    if (strcmp(city_name(fs->city), name) == 0) break;
+  }
+  pthread_rwlock_unlock(&flight_schedules_lock);
+  return fs;
+}
+
+/* Times running the commands of a workload (as --generate prints them)
+   read by the --batch parser and by the stdio one, both from no
+   schedules, in commands per second.  The workload is followed by
+   commands with numbers too long for an int, and the two parsers have
+   to give the same output for all of it. */
+bool bench_parse(struct workload *w)
+{
+  char path[MAX_PATH_LEN], answers[2][MAX_PATH_LEN], line[256];
+
+  bench_path(path, sizeof(path), "commands");
+  bench_path(answers[0], sizeof(answers[0]), "stdin");
+  bench_path(answers[1], sizeof(answers[1]), "batch");
+  int out = bench_redirect(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600));
+  if (out < 0) return false;
+  output_str(bench_numbers);
+  bool ok = workload_generate(w);
+  close(bench_redirect(out));
+
+  for (int batched = 1; ok && batched >= 0; batched--) {
+    uint64_t elapsed;
+    long n = bench_commands(path, batched, answers[batched], &elapsed);
+    ok = n >= 0;
+    if (ok) {
+      snprintf(line, sizeof(line), "%-5s %ld commands: %.0f commands/s\n",
+               batched ? "batch" : "stdin", n, n / (elapsed / 1e9));
+      output_str(line);
+    }
+    bench_clear();
+  }
+  if (ok && !bench_same(answers[0], answers[1])) {
+    output_str("The batch and stdin parsers gave different answers.\n");
+    ok = false;
+  }
+  remove(path);
+  remove(answers[0]);
+  remove(answers[1]);
+  return ok;
+}
+
+/* True if the files at paths a and b hold the same bytes */
+bool bench_same(const char *a, const char *b)
+{
+  FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+  bool same = fa != NULL && fb != NULL;
+  int ca, cb;
+
+  // both have to end together: one that is the start of the other is not
+  // the same
+  do {
+    ca = same ? getc(fa) : EOF;
+    cb = same ? getc(fb) : EOF;
+  } while (ca == cb && ca != EOF);
+  same = same && ca == cb;
+  if (fa != NULL) fclose(fa);
+  if (fb != NULL) fclose(fb);
+  return same;
+}
+
+/* Times allocating and freeing schedules from 1, 2, 4, ... threads, up to
+   the number of CPUs and at least 4, --ops pairs in all each time.  Each
+   is timed on the lock-free pool and with every call under one lock, as
+   the free list it replaced was. */
+bool bench_pool(struct workload *w)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int most = cpus > 4 ? cpus : 4;
+  struct bench_pool_thread *t = calloc(most, sizeof(*t));
+  char line[256];
+  bool ok = t != NULL;
+
+  for (int threads = 1; ok && threads <= most; threads *= 2) {
+    double rate[2];
+    for (int locked = 0; ok && locked < 2; locked++) {
+      int started = 0;
+      uint64_t start = monotonic_ns();
+      for (; started < threads; started++) {
+        t[started].pairs = w->ops / threads;
+        t[started].locked = locked;
+        ok = pthread_create(&t[started].thread, NULL, bench_pool_run, &t[started]) == 0;
+        if (!ok) break;
+      }
+      for (int k = 0; k < started; k++) {
+        pthread_join(t[k].thread, NULL);
+        ok = ok && t[k].pairs == 0;
+      }
+      rate[locked] = (w->ops / threads) * threads / ((monotonic_ns() - start) / 1e9);
+    }
+    if (ok) {
+      snprintf(line, sizeof(line),
+               "%3d threads: lock-free %.0f pairs/s, one lock %.0f pairs/s\n",
+               threads, rate[0], rate[1]);
+      output_str(line);
+    }
+    if (threads < most && threads * 2 > most) threads = most / 2; // end on most
+  }
+  free(t);
+  return ok;
+}
+
+/* A thread of the pool benchmark: allocates BENCH_HELD schedules and
+   frees them again until it has made its pairs, counting them down to
+   0.  Stops early if the pool runs out. */
+void * bench_pool_run(void *arg)
+{
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  struct bench_pool_thread *t = arg;
+  struct flight_schedule *held[BENCH_HELD];
+
+  while (t->pairs > 0) {
+    int n = t->pairs < BENCH_HELD ? t->pairs : BENCH_HELD;
+    for (int k = 0; k < n; k++) {
+      if (t->locked) pthread_mutex_lock(&lock);
+      held[k] = flight_schedule_allocate();
+      if (t->locked) pthread_mutex_unlock(&lock);
+      if (held[k] == NULL) n = k;
+    }
+    for (int k = 0; k < n; k++) {
+      if (t->locked) pthread_mutex_lock(&lock);
+      flight_schedule_free(held[k]);
+      if (t->locked) pthread_mutex_unlock(&lock);
+    }
+    if (n == 0) break;
+    t->pairs -= n;
+  }
+  return NULL;
+}
+
+/* Times getting --cities cities with BENCH_FLIGHTS flights each, one
+   seat of each booked, back after a restart: by replaying the commands
+   that made them through the --batch parser, and by loading a snapshot of
+   them, which it also times saving */
+bool bench_startup(struct workload *w)
+{
+  char commands[MAX_PATH_LEN], snapshot[MAX_PATH_LEN], line[256];
+  struct stat st;
+
+  bench_path(commands, sizeof(commands), "commands");
+  bench_path(snapshot, sizeof(snapshot), "snap");
+  int out = bench_redirect(open(commands, O_WRONLY | O_CREAT | O_TRUNC, 0600));
+  if (out < 0) return false;
+  for (int i = 0; i < w->cities; i++) {
+    snprintf(line, sizeof(line), "A City%d\n", i);
+    output_str(line);
+    for (int k = 0; k < BENCH_FLIGHTS; k++) {
+      flight_time_t time = k * (TIME_MAX + 1) / BENCH_FLIGHTS;
+      snprintf(line, sizeof(line), "a City%d\n%d %d\n", i, time,
+               1 + (int)(workload_random(w) % WORKLOAD_CAPACITY));
+      output_str(line);
+      snprintf(line, sizeof(line), "s City%d\n%d\n", i, time);
+      output_str(line);
+    }
+  }
+  output_str("q\n");
+  close(bench_redirect(out));
+
+  uint64_t replayed, saved, loaded;
+  long n = bench_commands(commands, true, NULL, &replayed);
+  uint64_t start = monotonic_ns();
+  bool ok = n >= 0 && flight_engine_save(snapshot);
+  saved = monotonic_ns() - start;
+  bench_clear();
+  start = monotonic_ns();
+  ok = ok && flight_engine_load(snapshot) && stat(snapshot, &st) == 0;
+  loaded = monotonic_ns() - start;
+
+  // every city came back with its flights, one seat of each booked
+  for (int i = 0; ok && i < w->cities; i++) {
+    struct flight flights[BENCH_FLIGHTS + 1];
+    snprintf(line, sizeof(line), "City%d", i);
+    ok = flight_engine_flights(city_lookup(line), flights, BENCH_FLIGHTS + 1) ==
+           BENCH_FLIGHTS &&
+         flights[0].available == flights[0].capacity - 1;
+  }
+
+  if (ok) {
+    snprintf(line, sizeof(line),
+             "%d cities, %d flights: replaying %ld commands %.1f ms\n"
+             "snapshot of %ld KiB: saving %.1f ms, loading %.1f ms\n",
+             w->cities, w->cities * BENCH_FLIGHTS, n, replayed / 1e6,
+             (long)st.st_size / 1024, saved / 1e6, loaded / 1e6);
+    output_str(line);
+  }
+  bench_clear();
+  remove(commands);
+  remove(snapshot);
+  return ok;
+}
+
+/* Times booking and giving back a seat, in turn so the flight never
+   fills, with no journal and then journaled in groups of 1, 8, 64 and
+   512 records, up to --ops bookings or BENCH_GROUP_OPS per record of a
+   group each time.  The time includes committing the last group.  The
+   journal goes in $TMPDIR, which should be on the disk to be measured. */
+bool bench_journal(struct workload *w)
+{
+  const int groups[] = {0, 1, 8, 64, 512};
+  int group_commit = journal.group_commit;
+  char path[MAX_PATH_LEN], line[256];
+  city_id_t city = city_intern("City0");
+  bool ok = flight_engine_add(city) == FLIGHT_OK &&
+            flight_engine_add_flight(city, 0, MAX_FLIGHT_CAPACITY) == FLIGHT_OK;
+
+  bench_path(path, sizeof(path), "journal");
+  for (int k = 0; ok && k < 5; k++) {
+    long n = groups[k] > 0 ? (long)BENCH_GROUP_OPS * groups[k] : w->ops;
+    if (n > w->ops) n = w->ops;
+    if (groups[k] > 0) {
+      journal.group_commit = groups[k];
+      remove(path);
+      ok = journal_open(path);
+    }
+
+    uint64_t start = monotonic_ns();
+    for (long i = 0; ok && i < n; i++) {
+      ok = (i % 2 == 0 ? flight_engine_book_seats(city, 0, 1, false, NULL)
+                       : flight_engine_unbook_seats(city, 0, 1)) == FLIGHT_OK;
+    }
+    journal_close();
+    uint64_t elapsed = monotonic_ns() - start;
+
+    if (ok && groups[k] > 0) {
+      snprintf(line, sizeof(line), "group of %3d: %.0f bookings/s\n", groups[k],
+               n / (elapsed / 1e9));
+      output_str(line);
+    } else if (ok) {
+      snprintf(line, sizeof(line), "no journal:   %.0f bookings/s\n", n / (elapsed / 1e9));
+      output_str(line);
+    }
+  }
+  journal.group_commit = group_commit;
+  remove(path);
+  bench_clear();
+  city_release(city);
+  return ok;
+}
+
+/* Times booking a seat on the first flight at or after a random time
+   with 8, 64 and 512 flights in the city, with each version of
+   flight_count_before this CPU can run, --ops bookings each time.  They
+   are timed BENCH_CHUNK at a time and given back in between, untimed, so
+   no flight fills. */
+bool bench_search(struct workload *w)
+{
+  int (*kernels[3])(const packed_time_t *times, int n, flight_time_t time);
+  const char *names[3];
+  const int sizes[] = {8, 64, 512};
+  int (*chosen)(const packed_time_t *times, int n, flight_time_t time) = flight_count_before;
+  flight_time_t booked[BENCH_CHUNK];
+  city_id_t city = city_intern("City0");
+  char line[256];
+  bool ok = true;
+
+  int n_kernels = 0;
+  names[n_kernels] = "scalar";
+  kernels[n_kernels++] = flight_count_before_scalar;
+#ifdef FLIGHT_SIMD_X86
+  if (__builtin_cpu_supports("sse2")) {
+    names[n_kernels] = "sse2";
+    kernels[n_kernels++] = flight_count_before_sse2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    names[n_kernels] = "avx2";
+    kernels[n_kernels++] = flight_count_before_avx2;
+  }
+#endif
+
+  for (int k = 0; ok && k < 3; k++) {
+    bench_clear();
+    ok = flight_engine_add(city) == FLIGHT_OK;
+    for (int i = 0; ok && i < sizes[k]; i++) {
+      ok = flight_engine_add_flight(city, i * (TIME_MAX + 1) / sizes[k],
+                                    MAX_FLIGHT_CAPACITY) == FLIGHT_OK;
+    }
+    flight_time_t last = (sizes[k] - 1) * (TIME_MAX + 1) / sizes[k];
+
+    int written = snprintf(line, sizeof(line), "%3d flights:", sizes[k]);
+    for (int v = 0; ok && v < n_kernels; v++) {
+      uint64_t elapsed = 0;
+      flight_count_before = kernels[v];
+      for (long done = 0; ok && done < w->ops; done += BENCH_CHUNK) {
+        int n = w->ops - done < BENCH_CHUNK ? w->ops - done : BENCH_CHUNK;
+        uint64_t start = monotonic_ns();
+        for (int i = 0; ok && i < n; i++) {
+          ok = flight_engine_book_seats(city, workload_random(w) % (last + 1), 1, false,
+                                        &booked[i]) == FLIGHT_OK;
+        }
+        elapsed += monotonic_ns() - start;
+        for (int i = 0; ok && i < n; i++) {
+          ok = flight_engine_unbook_seats(city, booked[i], 1) == FLIGHT_OK;
+        }
+      }
+      written += snprintf(line + written, sizeof(line) - written, "  %s %.0f ns",
+                          names[v], elapsed / (double)w->ops);
+    }
+    if (ok) {
+      output_str(line);
+      output_str(" per booking\n");
+    }
+  }
+  flight_count_before = chosen;
+  bench_clear();
+  city_release(city);
+  return ok;
+}
+
+/* Times --ops bookings of a seat on --cities cities picked as the
+   workload picks them, most on a few hubs, each city with BENCH_FLIGHTS
+   flights of MAX_FLIGHT_CAPACITY seats: one at a time, as the s command
+   books, then in batches of BENCH_BATCH, from the same fresh schedules.
+   Both have to book the same requests. */
+bool bench_batch(struct workload *w)
+{
+  struct workload_op *ops = workload_make(w);
+  struct flight_booking *requests = malloc(w->ops * sizeof(struct flight_booking));
+  uint8_t *status = malloc(w->ops);
+  city_id_t *ids = malloc(w->cities * sizeof(city_id_t));
+  long booked[2] = {0, 0};
+  double rate[2];
+  char line[256];
+  bool ok = ops != NULL && requests != NULL && status != NULL && ids != NULL;
+
+  int have = 0; // ids interned, to give back
+  for (; ok && have < w->cities; have++) {
+    snprintf(line, sizeof(line), "City%d", have);
+    ids[have] = city_intern(line);
+    ok = ids[have] != CITY_NONE;
+  }
+  for (long n = 0; ok && n < w->ops; n++) {
+    requests[n] = (struct flight_booking){.city = ids[ops[n].city], .time = ops[n].time,
+                                          .count = 1, .spill = false};
+  }
+
+  for (int batched = 0; ok && batched < 2; batched++) {
+    bench_clear();
+    for (int i = 0; ok && i < w->cities; i++) {
+      ok = flight_engine_add(ids[i]) == FLIGHT_OK;
+      for (int k = 0; ok && k < BENCH_FLIGHTS; k++) {
+        ok = flight_engine_add_flight(ids[i], k * (TIME_MAX + 1) / BENCH_FLIGHTS,
+                                      MAX_FLIGHT_CAPACITY) == FLIGHT_OK;
+      }
+    }
+
+    uint64_t start = monotonic_ns();
+    for (long n = 0; ok && n < w->ops; n += BENCH_BATCH) {
+      int size = w->ops - n < BENCH_BATCH ? w->ops - n : BENCH_BATCH;
+      if (batched) {
+        booked[1] += flight_engine_book_batch(&requests[n], size, &status[n]);
+        continue;
+      }
+      for (int i = 0; i < size; i++) {
+        const struct flight_booking *r = &requests[n+i];
+        booked[0] += flight_engine_book_seats(r->city, r->time, r->count, r->spill,
+                                              NULL) == FLIGHT_OK;
+      }
+    }
+    rate[batched] = w->ops / ((monotonic_ns() - start) / 1e9);
+  }
+
+  if (ok && booked[0] == booked[1]) {
+    snprintf(line, sizeof(line),
+             "%ld bookings, %d cities, zipf %.2f, %ld booked\n"
+             "one at a time: %.0f bookings/s\n"
+             "batches of %d: %.0f bookings/s\n",
+             w->ops, w->cities, w->zipf, booked[0], rate[0], BENCH_BATCH, rate[1]);
+    output_str(line);
+  }
+  bench_clear();
+  for (int i = 0; i < have; i++) {
+    city_release(ids[i]);
+  }
+  free(ids);
+  free(status);
+  free(requests);
+  free(ops);
+  return ok && booked[0] == booked[1];
+}
+
+/* Times finding the schedule of one of --cities cities by its id, by its
+   name through the interning table, and by comparing its name with the
+   name of every schedule, as when schedules held a city_t.  Then prints
+   the memory a schedule and its name take both ways. */
+bool bench_interning(struct workload *w)
+{
+  city_t *names = malloc(w->cities * sizeof(city_t));
+  city_id_t *ids = malloc(w->cities * sizeof(city_id_t));
+  double ns[3];
+  char line[256];
+  bool ok = names != NULL && ids != NULL;
+
+  int have = 0; // ids interned, to give back
+  for (; ok && have < w->cities; have++) {
+    snprintf(names[have], sizeof(city_t), "City%d", have);
+    ids[have] = city_intern(names[have]);
+    ok = flight_engine_add(ids[have]) == FLIGHT_OK;
+  }
+
+  long found = 0, walks = BENCH_WALKS / w->cities;
+  for (int how = 0; ok && how < 3; how++) {
+    long n = how < 2 ? BENCH_LOOKUPS : walks;
+    uint64_t start = monotonic_ns();
+    for (long k = 0; k < n; k++) {
+      int i = workload_random(w) % w->cities;
+      switch (how) {
+      case 0: found += flight_engine_exists(ids[i]); break;
+      case 1: found += flight_engine_exists(city_lookup(names[i])); break;
+      case 2: found += bench_walk(names[i]) != NULL; break;
+      }
+    }
+    ns[how] = (monotonic_ns() - start) / (double)n;
+  }
+  ok = ok && found == 2 * BENCH_LOOKUPS + walks;
+
+  if (ok) {
+    // a city_t in the schedule in place of its id, and the interned name
+    // with its share of the hash index
+    size_t schedule = sizeof(struct flight_schedule);
+    size_t named = schedule - sizeof(city_id_t) + sizeof(city_t);
+    double table = sizeof(struct city_entry) + cities.slots * sizeof(struct city_slot) / (double)cities.n;
+    snprintf(line, sizeof(line),
+             "%d cities: by id %.0f ns, interned name %.0f ns, name walk %.0f ns"
+             " per lookup\n"
+             "schedule %zu bytes + %.0f bytes of name table, %zu bytes with a city_t\n",
+             w->cities, ns[0], ns[1], ns[2], schedule, table, named);
+    output_str(line);
+  }
+  bench_clear();
+  for (int i = 0; i < have; i++) {
+    city_release(ids[i]);
+  }
+  free(ids);
+  free(names);
+  return ok;
+}
+
+/* Runs the commands in the file at path up to q, read by the --batch
+   parser or as stdin, writing what they print to the file at answers, or
+   throwing it away if answers is NULL.  Returns how many
+   were run, -1 if the file can't be read, and the time taken in
+   *elapsed.  Reading it as stdin leaves stdin at its end. */
+long bench_commands(const char *path, bool batched, const char *answers,
+                    uint64_t *elapsed)
+{
+  char command;
+  long n = 0;
+
+  if (batched ? !batch_open(path) : freopen(path, "r", stdin) == NULL) return -1;
+  int out = bench_redirect(answers != NULL
+                           ? open(answers, O_WRONLY | O_CREAT | O_TRUNC, 0600)
+                           : open("/dev/null", O_WRONLY));
+  if (out < 0) {
+    batch_close();
+    return -1;
+  }
+  output.interactive = false;
+  journal.typed = false;
+
+  uint64_t start = monotonic_ns();
+  while (command_get(&command) && command_run(command)) {
+    n++;
+  }
+  output_flush();
+  *elapsed = monotonic_ns() - start;
+
+  close(bench_redirect(out));
+  batch_close();
+  return n;
+}
+
+/* Books and unbooks seats on the --cities cities from 1, 2, ... threads
+   threads at once, --ops operations in all each time, and prints how many
+   a second they made.  Meanwhile STRESS_CHURNERS threads add and remove
+   schedules and flights of other cities and book on them, and
+   STRESS_READERS threads look them up and list them.  After each round
+   the seats of every flight have to add up and the indexes may not have
+   any city without a schedule, see stress_round.  Returns false if they
+   don't. */
+bool stress_run(struct workload *w, int threads)
+{
+  city_id_t *ids = malloc(w->cities * sizeof(city_id_t));
+  char line[256];
+  bool ok = ids != NULL;
+
+  int have = 0; // ids interned, to give back
+  for (; ok && have < w->cities; have++) {
+    snprintf(line, sizeof(line), "City%d", have);
+    ids[have] = city_intern(line);
+    ok = ids[have] != CITY_NONE;
+  }
+  for (int n = 1; ok && n <= threads; n++) {
+    double rate;
+    long changes, reads;
+    ok = stress_round(w, ids, n, &rate, &changes, &reads);
+    if (ok) {
+      snprintf(line, sizeof(line), "%3d threads: %.0f ops/s, %ld changes, %ld reads, "
+               "seats add up\n", n, rate, changes, reads);
+      output_str(line);
+    }
+  }
+  bench_clear();
+  for (int i = 0; i < have; i++) {
+    city_release(ids[i]);
+  }
+  free(ids);
+  return ok;
+}
+
+/* Runs one round of the stress test with threads threads booking on fresh
+   schedules, putting the operations a second in *rate, and the churning
+   and reading threads beside them until they are done, putting what those
+   made in *changes and *reads.  Then checks every flight: the seats taken
+   (capacity - available + overbooked) are the ones booked, plus the ones
+   that waited and are not waiting any more, less the ones given back, and
+   never more than capacity and margin.  The churned cities have to have
+   just the schedules and flights left to them, and the sorted order and
+   the departure index just the cities with schedules, see
+   stress_churn_check and stress_index_check. */
+bool stress_round(struct workload *w, const city_id_t *ids, int threads, double *rate,
+                  long *changes, long *reads)
+{
+  struct stress_thread *t = calloc(threads, sizeof(*t));
+  struct stress_churn *c = calloc(STRESS_CHURNERS, sizeof(*c));
+  struct stress_reader r[STRESS_READERS] = {0};
+  _Atomic bool stop = false;
+  size_t flights = (size_t)w->cities * STRESS_FLIGHTS;
+  bool ok = t != NULL && c != NULL;
+
+  bench_clear();
+  for (int i = 0; ok && i < w->cities; i++) {
+    ok = flight_engine_add(ids[i]) == FLIGHT_OK;
+    for (int f = 0; ok && f < STRESS_FLIGHTS; f++) {
+      ok = flight_engine_add_flight(ids[i], f * (TIME_MAX + 1) / STRESS_FLIGHTS,
+                                    STRESS_CAPACITY) == FLIGHT_OK;
+    }
+  }
+  for (int k = 0; ok && k < threads; k++) {
+    t[k].ids = ids;
+    t[k].cities = w->cities;
+    t[k].ops = w->ops / threads;
+    t[k].random.seed = w->seed + k * 0x632be59bd9b4e019ull;
+    t[k].booked = calloc(flights, sizeof(long));
+    t[k].waited = calloc(flights, sizeof(long));
+    t[k].unbooked = calloc(flights, sizeof(long));
+    ok = t[k].booked != NULL && t[k].waited != NULL && t[k].unbooked != NULL;
+  }
+  for (int k = 0; ok && k < STRESS_CHURNERS; k++) {
+    c[k].first = k * STRESS_CHURN_CITIES;
+    c[k].random.seed = w->seed + (MAX_STRESS_THREADS + k) * 0x632be59bd9b4e019ull;
+    c[k].stop = &stop;
+    for (int i = 0; i < STRESS_CHURN_CITIES; i++) {
+      c[k].ids[i] = CITY_NONE;
+    }
+  }
+  for (int k = 0; ok && k < STRESS_READERS; k++) {
+    r[k].ids = ids;
+    r[k].cities = w->cities;
+    r[k].random.seed = w->seed + (MAX_STRESS_THREADS + STRESS_CHURNERS + k) *
+                                 0x632be59bd9b4e019ull;
+    r[k].stop = &stop;
+  }
+
+  int started = 0, churning = 0, reading = 0;
+  for (; ok && churning < STRESS_CHURNERS; churning++) {
+    ok = pthread_create(&c[churning].thread, NULL, stress_churn_run, &c[churning]) == 0;
+  }
+  for (; ok && reading < STRESS_READERS; reading++) {
+    ok = pthread_create(&r[reading].thread, NULL, stress_reader_run, &r[reading]) == 0;
+  }
+  uint64_t start = monotonic_ns();
+  for (; ok && started < threads; started++) {
+    ok = pthread_create(&t[started].thread, NULL, stress_thread_run, &t[started]) == 0;
+  }
+  for (int k = 0; k < started; k++) {
+    pthread_join(t[k].thread, NULL);
+  }
+  *rate = (w->ops / threads) * threads / ((monotonic_ns() - start) / 1e9);
+  atomic_store(&stop, true);
+  *changes = *reads = 0;
+  for (int k = 0; k < churning; k++) {
+    pthread_join(c[k].thread, NULL);
+    *changes += c[k].changes;
+    if (c[k].failed) {
+      output_str("A churning thread was answered as it could not be.\n");
+      ok = false;
+    }
+  }
+  for (int k = 0; k < reading; k++) {
+    pthread_join(r[k].thread, NULL);
+    *reads += r[k].reads;
+    if (r[k].failed) {
+      output_str("A reading thread read what never was.\n");
+      ok = false;
+    }
+  }
+
+  for (size_t j = 0; ok && j < flights; j++) {
+    struct flight f[STRESS_FLIGHTS];
+    city_id_t city = ids[j / STRESS_FLIGHTS];
+    long expected = 0;
+
+    flight_engine_flights(city, f, STRESS_FLIGHTS);
+    for (int k = 0; k < threads; k++) {
+      expected += t[k].booked[j] + t[k].waited[j] - t[k].unbooked[j];
+    }
+    ok = stress_flight(city, &f[j % STRESS_FLIGHTS], expected);
+  }
+  size_t schedules = w->cities;
+  for (int k = 0; ok && k < STRESS_CHURNERS; k++) {
+    ok = stress_churn_check(&c[k]);
+    for (int i = 0; i < STRESS_CHURN_CITIES; i++) {
+      schedules += c[k].ids[i] != CITY_NONE;
+    }
+  }
+  ok = ok && stress_index_check(schedules);
+
+  for (int k = 0; t != NULL && k < threads; k++) {
+    free(t[k].booked);
+    free(t[k].waited);
+    free(t[k].unbooked);
+  }
+  free(t);
+  free(c);
+  return ok;
+}
+
+/* Checks the seats of a flight of city: the ones taken are seats, booked
+   or waited less given back, less the ones still waiting, and no more
+   than capacity and margin.  Prints what is wrong if they aren't. */
+bool stress_flight(city_id_t city, const struct flight *flight, long seats)
+{
+  int waiting[MAX_WAITLIST], overbooked = 0;
+  char line[256];
+
+  int n = flight_engine_waitlist(city, flight->time, &overbooked, waiting, MAX_WAITLIST);
+  for (int k = 0; k < n; k++) {
+    seats -= waiting[k];
+  }
+  long taken = flight->capacity - flight->available + overbooked;
+  if (taken != seats || flight->available > flight->capacity ||
+      overbooked > waitlist_margin(flight->capacity)) {
+    snprintf(line, sizeof(line), "%s at %d: %ld seats taken, %ld booked\n",
+             city_name(city), flight->time, taken, seats);
+    output_str(line);
+    return false;
+  }
+  return true;
+}
+
+/* A thread of the stress test: books (three times in five) or gives back
+   1 to STRESS_SEATS seats on a random flight, ops times, counting the
+   seats that were */
+void * stress_thread_run(void *arg)
+{
+  struct stress_thread *t = arg;
+
+  for (long n = 0; n < t->ops; n++) {
+    uint64_t r = workload_random(&t->random);
+    int city = r % t->cities;
+    int flight = (r >> 32) % STRESS_FLIGHTS;
+    int count = 1 + (r >> 40) % STRESS_SEATS;
+    flight_time_t time = flight * (TIME_MAX + 1) / STRESS_FLIGHTS;
+    size_t j = (size_t)city * STRESS_FLIGHTS + flight;
+
+    if ((r >> 48) % 5 < 3) {
+      switch (flight_engine_book_seats(t->ids[city], time, count, false, NULL)) {
+      case FLIGHT_OK:
+        t->booked[j] += count;
+        break;
+      case FLIGHT_WAITLISTED:
+        t->waited[j] += count;
+        break;
+      default:
+        break;
+      }
+    } else if (flight_engine_unbook_seats(t->ids[city], time, count) == FLIGHT_OK) {
+      t->unbooked[j] += count;
+    }
+  }
+  return NULL;
+}
+
+/* A churning thread of the stress test: until it is stopped, adds the
+   schedule of one of its cities that has none, interning its name and
+   letting the schedule hold the id alone, or for one that has it removes
+   it (one time in eight), adds or removes a flight, or books or gives
+   back seats on it, keeping what each city should be left with.  Its
+   cities are its own, so every answer is known; it stops at the first
+   one that is not. */
+void * stress_churn_run(void *arg)
+{
+  struct stress_churn *c = arg;
+  city_t name;
+
+  while (!c->failed && !atomic_load(c->stop)) {
+    uint64_t r = workload_random(&c->random);
+    int city = r % STRESS_CHURN_CITIES;
+    int flight = (r >> 32) % STRESS_FLIGHTS;
+    int count = 1 + (r >> 40) % STRESS_SEATS;
+    int op = (r >> 48) % 8;
+    flight_time_t time = flight * (TIME_MAX + 1) / STRESS_FLIGHTS, booked;
+    size_t j = (size_t)city * STRESS_FLIGHTS + flight;
+    city_id_t id = c->ids[city];
+
+    if (id == CITY_NONE) {
+      snprintf(name, sizeof(name), "Churn%d", c->first + city);
+      id = city_intern(name);
+      c->failed = flight_engine_add(id) != FLIGHT_OK;
+      city_release(id); // the schedule's from now on
+      c->ids[city] = id;
+    } else if (op == 0) {
+      c->failed = flight_engine_remove(id) != FLIGHT_OK;
+      c->ids[city] = CITY_NONE;
+      for (int f = 0; f < STRESS_FLIGHTS; f++) {
+        c->capacity[city * STRESS_FLIGHTS + f] = 0;
+        c->seats[city * STRESS_FLIGHTS + f] = 0;
+      }
+    } else if (c->capacity[j] == 0) {
+      c->failed = flight_engine_add_flight(id, time, STRESS_CAPACITY) != FLIGHT_OK;
+      c->capacity[j] = STRESS_CAPACITY;
+    } else if (op == 1) {
+      c->failed = flight_engine_remove_flight(id, time) != FLIGHT_OK;
+      c->capacity[j] = 0;
+      c->seats[j] = 0;
+    } else if (op < 5) {
+      // the seats go on the flight at time, which it has
+      switch (flight_engine_book_seats(id, time, count, false, &booked)) {
+      case FLIGHT_OK:
+      case FLIGHT_WAITLISTED:
+        c->failed = booked != time;
+        c->seats[j] += count;
+        break;
+      default:
+        c->failed = true;
+        break;
+      }
+    } else {
+      switch (flight_engine_unbook_seats(id, time, count)) {
+      case FLIGHT_OK:
+        c->seats[j] -= count;
+        break;
+      case FLIGHT_ALL_EMPTY:
+        break;
+      default:
+        c->failed = true;
+        break;
+      }
+    }
+    c->changes++;
+  }
+  return NULL;
+}
+
+/* A reading thread of the stress test: until it is stopped, lists the
+   churned cities starting with a random digit, checking that they come in
+   name order; copies the flights of a random city, looked up by name,
+   checking that they are in time order with no more seats than capacity;
+   or lists the departures of STRESS_WINDOW minutes from a random one,
+   checking the same of them and that they all have seats left */
+void * stress_reader_run(void *arg)
+{
+  struct stress_reader *r = arg;
+  struct flight flights[STRESS_FLIGHTS];
+  city_t name;
+
+  while (!r->failed && !atomic_load(r->stop)) {
+    uint64_t random = workload_random(&r->random);
+    struct stress_listing l = {.time = TIME_NULL};
+
+    switch (random % 3) {
+    case 0:
+      snprintf(name, sizeof(name), "Churn%d", (int)((random >> 32) % 10));
+      flight_engine_for_each_city_prefix(name, stress_reader_city, &l);
+      break;
+    case 1: {
+      int city = (random >> 32) % (r->cities + STRESS_CHURNERS * STRESS_CHURN_CITIES);
+      if (city < r->cities) {
+        snprintf(name, sizeof(name), "City%d", city);
+      } else {
+        snprintf(name, sizeof(name), "Churn%d", city - r->cities);
+      }
+      int n = flight_engine_flights(city_lookup(name), flights, STRESS_FLIGHTS);
+      for (int i = 0; i < n; i++) {
+        l.failed |= flights[i].time < l.time || flights[i].available > flights[i].capacity;
+        l.time = flights[i].time;
+      }
+      l.failed |= city < r->cities && n != STRESS_FLIGHTS; // those keep theirs
+      break;
+    }
+    default: {
+      flight_time_t from = (random >> 32) % (TIME_MAX + 1);
+      flight_engine_for_each_departure(from, from + STRESS_WINDOW - 1,
+                                       stress_reader_departure, &l);
+      break;
+    }
+    }
+    r->failed = l.failed;
+    r->reads++;
+  }
+  return NULL;
+}
+
+/* Checks that a city listed by a stress test reader comes after the one
+   before it by name */
+void stress_reader_city(city_id_t city, void *arg)
+{
+  struct stress_listing *l = arg;
+
+  l->failed |= strcmp(l->last, city_name(city)) >= 0;
+  strcpy(l->last, city_name(city));
+}
+
+/* Checks that a departure listed by a stress test reader comes no earlier
+   than the one before it and has seats left, no more than its capacity */
+bool stress_reader_departure(const struct departure *d, void *arg)
+{
+  struct stress_listing *l = arg;
+
+  l->failed |= d->flight.time < l->time || d->flight.available < 1 ||
+               d->flight.available > d->flight.capacity;
+  l->time = d->flight.time;
+  return true;
+}
+
+/* Checks that the cities of a churning thread were left as it left them:
+   the ones it removed have no schedule, and their names no id or one that
+   nothing holds; the others still have their names and are held by their
+   schedule alone, which has just the flights it left with their seats.
+   Prints what is wrong if they weren't. */
+bool stress_churn_check(const struct stress_churn *c)
+{
+  struct flight flights[STRESS_FLIGHTS + 1];
+  city_t name;
+  char line[256];
+
+  for (int city = 0; city < STRESS_CHURN_CITIES; city++) {
+    city_id_t id = c->ids[city];
+    snprintf(name, sizeof(name), "Churn%d", c->first + city);
+    if (id == CITY_NONE) {
+      id = city_lookup(name);
+      if (id != CITY_NONE && (flight_engine_exists(id) ||
+                              atomic_load(&city_entry(id)->refs) != 0)) {
+        snprintf(line, sizeof(line), "%s was removed but its id %u is held\n", name, id);
+        output_str(line);
+        return false;
+      }
+      continue;
+    }
+    if (strcmp(city_name(id), name) != 0 || atomic_load(&city_entry(id)->refs) != 1) {
+      snprintf(line, sizeof(line), "%s has the id %u of %s, held %u times\n", name, id,
+               city_name(id), atomic_load(&city_entry(id)->refs));
+      output_str(line);
+      return false;
+    }
+
+    int n = flight_engine_flights(id, flights, STRESS_FLIGHTS + 1), i = 0;
+    for (int f = 0; f < STRESS_FLIGHTS; f++) {
+      size_t j = (size_t)city * STRESS_FLIGHTS + f;
+      flight_time_t time = f * (TIME_MAX + 1) / STRESS_FLIGHTS;
+      if (c->capacity[j] == 0) continue;
+      if (i >= n || flights[i].time != time || flights[i].capacity != c->capacity[j]) {
+        snprintf(line, sizeof(line), "%s lost its flight at %d\n", name, time);
+        output_str(line);
+        return false;
+      }
+      if (!stress_flight(id, &flights[i++], c->seats[j])) return false;
+    }
+    if (i != n) {
+      snprintf(line, sizeof(line), "%s has %d flights, not %d\n", name, n, i);
+      output_str(line);
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Checks that the sorted order has every one of schedules schedules once,
+   in name order, and nothing else, and that every city of the departure
+   index has a schedule with as many flights with seats left in the minute
+   as the index counts, and every such minute of a schedule is in the
+   index.  Prints what is wrong if they aren't.  No other thread may
+   change the schedules meanwhile. */
+bool stress_index_check(size_t schedules)
+{
+  size_t listed = 0, minutes = 0, indexed = 0;
+  const char *last = "";
+  char line[256];
+  bool ok = true;
+
+  for (struct city_order_node *node = city_order_head[0]; ok && node != NULL;
+       node = node->next[0]) {
+    ok = flight_schedule_find(node->city) != NULL && strcmp(last, city_name(node->city)) < 0;
+    last = city_name(node->city);
+    listed++;
+  }
+  if (!ok || listed != schedules) {
+    snprintf(line, sizeof(line), "The sorted order has %zu cities of %zu, or a stale one\n",
+             listed, schedules);
+    output_str(line);
+    return false;
+  }
+
+  for (struct flight_schedule *fs = flight_schedules_active; fs != NULL;
+       fs = flight_schedule_link(fs->next)) {
+    struct flight_lanes lanes = flight_schedule_lanes(fs);
+    for (int i = 0, next; i < fs->n_flights; i = next) {
+      bool seats = false;
+      for (next = i; next < fs->n_flights && lanes.time[next] == lanes.time[i]; next++) {
+        seats |= lanes.available[next] > 0;
+      }
+      minutes += seats;
+    }
+  }
+  for (int bucket = 0; ok && bucket < DEPARTURE_BUCKETS; bucket++) {
+    const struct departure_bucket *b = &departures[bucket];
+    for (uint32_t k = 0; ok && k < b->max; k++) {
+      city_id_t city = b->slots[k].city;
+      if (city == CITY_NONE) continue;
+      struct flight_schedule *fs = flight_schedule_find(city);
+      uint32_t count = 0;
+      for (int i = (fs != NULL) ? flight_schedule_lower_bound(fs, bucket + TIME_NULL) : 0;
+           fs != NULL && i < fs->n_flights &&
+           flight_schedule_lanes(fs).time[i] == bucket + TIME_NULL; i++) {
+        count += flight_schedule_lanes(fs).available[i] > 0;
+      }
+      ok = count > 0 && count == b->slots[k].count;
+      indexed++;
+    }
+  }
+  if (!ok || indexed != minutes) {
+    snprintf(line, sizeof(line), "The departure index has %zu minutes of %zu, or a stale "
+             "one\n", indexed, minutes);
+    output_str(line);
+    return false;
+  }
+  return true;
+}
+
+/* Puts the name of a scratch file of a benchmark in path, in $TMPDIR */
+void bench_path(char *path, size_t size, const char *what)
+{
+  const char *dir = getenv("TMPDIR");
+  snprintf(path, size, "%s/flight-bench-%ld.%s", dir != NULL ? dir : "/tmp",
+           (long)getpid(), what);
+}
+
+/* Sends the output from now on to the file open on fd, closing fd, and
+   returns a descriptor of where it went before.  Returns -1, leaving the
+   output where it was, if fd is not open or that fails. */
+int bench_redirect(int fd)
+{
+  output_flush();
+  int old = (fd < 0) ? -1 : dup(STDOUT_FILENO);
+  if (old >= 0 && dup2(fd, STDOUT_FILENO) < 0) {
+    close(old);
+    old = -1;
+  }
+  if (fd >= 0) close(fd);
+  return old;
+}
+
+
+/******************************************************************************
+ * Statistics                                                                 *
+ *                                                                            *
+ * Counts and latency histograms per command letter, how many slots city name *
+ * lookups probe, and the busiest destinations.  Printed by the T command and *
+ * every --stats-interval seconds on stderr.                                  *
+ ******************************************************************************/
+
+/* Monotonic time in nanoseconds */
+uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+#if FLIGHT_STATS
+/* Slot of command_stats for a command letter */
+int stats_slot(char command)
+{
+  const char *p = (command != '\0') ? strchr(STATS_COMMANDS, command) : NULL;
+  return (p != NULL) ? p - STATS_COMMANDS : (int)sizeof(STATS_COMMANDS) - 1;
+}
+
+/* Histogram bucket of a latency, see struct command_stats */
+int stats_bucket(uint64_t ns)
+{
+  if (ns >= ((uint64_t)1 << STATS_MAX_BITS)) {
+    ns = ((uint64_t)1 << STATS_MAX_BITS) - 1;
+  }
+  if (ns < STATS_SUB_BUCKETS) return ns;
+
+  int shift = 63 - __builtin_clzll(ns) - 4; // keep the top 5 bits, 16..31
+  return (shift + 1) * STATS_SUB_BUCKETS + (int)(ns >> shift) - STATS_SUB_BUCKETS;
+}
+
+/* Highest latency that falls in a bucket */
+uint64_t stats_bucket_top(int bucket)
+{
+  if (bucket < STATS_SUB_BUCKETS) return bucket;
+
+  int shift = bucket / STATS_SUB_BUCKETS - 1;
+  uint64_t low = (uint64_t)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << shift;
+  return low + ((uint64_t)1 << shift) - 1;
+}
+
+/* Latency that fraction of the commands took at most */
+uint64_t stats_percentile(const struct command_stats *stats, double fraction)
+{
+  uint64_t rank = (uint64_t)(fraction * stats->count + 0.5), seen = 0;
+
+  if (rank < 1) rank = 1;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += stats->histogram[i];
+    if (seen >= rank) {
+      uint64_t top = stats_bucket_top(i);
+      return top < stats->max_ns ? top : stats->max_ns;
+    }
+  }
+  return stats->max_ns;
+}
+
+/* Adds a command that took ns nanoseconds */
+void stats_record(char command, uint64_t ns)
+{
+  struct command_stats *stats = &command_stats[stats_slot(command)];
+
+  stats->count++;
+  stats->total_ns += ns;
+  if (ns > stats->max_ns) stats->max_ns = ns;
+  stats->histogram[stats_bucket(ns)]++;
+}
+
+/* Adds a city name lookup that looked at probes slots */
+void stats_probed(int probes)
+{
+  if (probes >= STATS_PROBE_BUCKETS) probes = STATS_PROBE_BUCKETS - 1;
+  atomic_fetch_add_explicit(&stats_probes[probes], 1, memory_order_relaxed);
+}
+
+/* Writes the statistics report into text, returns its length */
+size_t stats_format(char *text, size_t max)
+{
+  size_t len = 0;
+
+  stats_append(text, max, &len, "Command   count      mean us   p50 us    p99 us    p999 us   max us\n");
+  for (int i = 0; i < (int)sizeof(STATS_COMMANDS); i++) {
+    const struct command_stats *stats = &command_stats[i];
+    char name[4] = {STATS_COMMANDS[i], '\0'};
+    if (stats->count == 0) continue;
+    stats_append(text, max, &len, "%-9s %-10llu %-9.2f %-9.2f %-9.2f %-9.2f %.2f\n",
+                 (name[0] != '\0') ? name : "bad",
+                 (unsigned long long)stats->count, stats->total_ns / 1e3 / stats->count,
+                 stats_percentile(stats, 0.50) / 1e3, stats_percentile(stats, 0.99) / 1e3,
+                 stats_percentile(stats, 0.999) / 1e3, stats->max_ns / 1e3);
+  }
+
+  uint64_t lookups = 0, probes = 0;
+  for (int i = 1; i < STATS_PROBE_BUCKETS; i++) {
+    uint64_t n = atomic_load_explicit(&stats_probes[i], memory_order_relaxed);
+    lookups += n;
+    probes += n * i;
+  }
+  stats_append(text, max, &len, "City lookups %llu, slots probed per lookup %.2f:",
+               (unsigned long long)lookups, lookups ? (double)probes / lookups : 0.0);
+  for (int i = 1; i < STATS_PROBE_BUCKETS; i++) {
+    uint64_t n = atomic_load_explicit(&stats_probes[i], memory_order_relaxed);
+    if (n != 0) {
+      stats_append(text, max, &len, " %d%s:%llu", i, (i == STATS_PROBE_BUCKETS - 1) ? "+" : "",
+                   (unsigned long long)n);
+    }
+  }
+  stats_append(text, max, &len, "\n");
+
+  // the busiest active destinations, kept sorted by insertion
+  struct flight_schedule *hot[STATS_HOT_CITIES];
+  uint64_t hits[STATS_HOT_CITIES];
+  int n_hot = 0;
+
+  pthread_rwlock_rdlock(&flight_schedules_lock);
+  for (struct flight_schedule *fs = flight_schedules_active; fs != NULL;
+       fs = flight_schedule_link(fs->next)) {
+    pthread_mutex_lock(&fs->lock);
+    uint64_t h = fs->hits;
+    pthread_mutex_unlock(&fs->lock);
+
+    int i = (n_hot < STATS_HOT_CITIES) ? n_hot++ : STATS_HOT_CITIES;
+    for (; i > 0 && hits[i-1] < h; i--) {
+      if (i < STATS_HOT_CITIES) {
+        hot[i] = hot[i-1];
+        hits[i] = hits[i-1];
+      }
+    }
+    if (i < STATS_HOT_CITIES) {
+      hot[i] = fs;
+      hits[i] = h;
+    }
+  }
+  stats_append(text, max, &len, "Busiest destinations:");
+  for (int i = 0; i < n_hot; i++) {
+    stats_append(text, max, &len, " %s:%llu", city_name(hot[i]->city), (unsigned long long)hits[i]);
+  }
+  stats_append(text, max, &len, "\n");
+  pthread_rwlock_unlock(&flight_schedules_lock);
+
+  return len;
+}
+
+/* Appends printf style to the report in text, which has room for max bytes
+   and len in use; what does not fit is dropped */
+void stats_append(char *text, size_t max, size_t *len, const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  int n = vsnprintf(text + *len, max - *len, format, args);
+  va_end(args);
+  if (n > 0) {
+    *len = (*len + n < max) ? *len + n : max - 1;
+  }
+}
+
+/* Prints the statistics report, the T command */
+void stats_print(void)
+{
+  char text[STATS_TEXT_SIZE];
+
+  stats_format(text, sizeof(text));
+  output_str(text);
+}
+
+/* Dumps the statistics report to stderr if the time for it has come */
+void stats_tick(void)
+{
+  if (stats_interval == 0) return;
+
+  uint64_t now = monotonic_ns();
+  if (now < stats_next_dump) return;
+  stats_next_dump = now + stats_interval;
+
+  char text[STATS_TEXT_SIZE];
+  size_t len = stats_format(text, sizeof(text));
+  if (write(STDERR_FILENO, text, len) < 0) {
+    stats_interval = 0; // stderr is gone, stop trying
+  }
+}
+#endif
+
+
+/****************************************************************
+ * Message functions so that your messages match what we expect *
+ ****************************************************************/
+void msg_city_bad(char *city) {
+  output_str("No schedule for ");
+  output_str(city);
+  output_char('\n');
+}
+
+void msg_city_exists(char *city) {
+  output_str("There is a schedule of ");
+  output_str(city);
+  output_str(" already.\n");
+}
+
+void msg_schedule_no_free(void) {
+  output_str("Sorry no more free schedules.\n");
+}
+
+void msg_view_no_free(void) {
+  output_str("Sorry there is no memory left for the listing.\n");
+}
+
+void msg_city_flights(const char *city) {
+  output_str("The flights for ");
+  output_str(city);
+  output_str(" are:");
+}
+
+void msg_flight_info(int time, int avail, int capacity) {
+  output_str(" (");
+  output_int(time);
+  output_str(", ");
+  output_int(avail);
+  output_str(", ");
+  output_int(capacity);
+  output_char(')');
+}
+
+void msg_city_max_flights_reached(char *city) {
+  output_str("Sorry we cannot add more flights on this city.\n");
+}
+
+void msg_flight_bad_time(void) {
+  output_str("Sorry there's no flight scheduled on this time.\n");
+}
+
+void msg_flight_no_seats(void) {
+    output_str("Sorry there's no more seats available!\n");
+}
+
+void msg_flight_waitlisted(int time) {
+  output_str("Sorry there's no more seats available, waitlisted for the flight at ");
+  output_int(time);
+  output_str(".\n");
+}
+
+void msg_waitlist(char *city, int time, int overbooked) {
+  output_str("The waitlist for ");
+  output_str(city);
+  output_str(" at ");
+  output_int(time);
+  output_str(" with ");
+  output_int(overbooked);
+  output_str(" seats overbooked is:");
+}
+
+void msg_waitlist_entry(int seats) {
+  output_char(' ');
+  output_int(seats);
+}
+
+void msg_flight_all_seats_empty(void) {
+  output_str("All the seats on this flights are empty!\n");
+}
+
+void msg_time_bad() {
+  output_str("Invalid time value\n");
+}
+
+void msg_capacity_bad() {
+  output_str("Invalid capacity value\n");
+}
+
+void msg_seat_count_bad(void) {
+  output_str("Invalid seat count value\n");
+}
+
+void msg_count_bad(void) {
+  output_str("Invalid count value\n");
+}
+
+void msg_departures(int from, int to) {
+  output_str("The departures from ");
+  output_int(from);
+  output_str(" to ");
+  output_int(to);
+  output_str(" are:");
+}
+
+void msg_next_departures(int count, int from) {
+  output_str("The next ");
+  output_int(count);
+  output_str(" departures from ");
+  output_int(from);
+  output_str(" are:");
+}
+
+void msg_departure_info(int time, const char *city, int avail) {
+  output_str(" (");
+  output_int(time);
+  output_str(", ");
+  output_str(city);
+  output_str(", ");
+  output_int(avail);
+  output_char(')');
+}
+
+void msg_connection_bad(void) {
+  output_str("Invalid connection\n");
+}
+
+void msg_connections(char *city) {
+  output_str("The connections from ");
+  output_str(city);
+  output_str(" are:");
+}
+
+void msg_connection_info(int departure, const char *city, int arrival, int avail,
+                         int capacity) {
+  output_str(" (");
+  output_int(departure);
+  output_str(", ");
+  output_str(city);
+  output_str(", ");
+  output_int(arrival);
+  output_str(", ");
+  output_int(avail);
+  output_str(", ");
+  output_int(capacity);
+  output_char(')');
+}
+
+void msg_itinerary(char *city) {
+  output_str("The itinerary to ");
+  output_str(city);
+  output_str(" is:");
+}
+
+void msg_itinerary_leg(int departure, const char *city, int arrival) {
+  output_str(" (");
+  output_int(departure);
+  output_str(", ");
+  output_str(city);
+  output_str(", ");
+  output_int(arrival);
+  output_char(')');
+}
+
+void msg_itinerary_none(char *city) {
+  output_str("Sorry there's no way to ");
+  output_str(city);
+  output_str(" in time.\n");
+}
+
+void msg_date_bad(void) {
+  output_str("Invalid date value\n");
+}
+
+void msg_weekdays_bad(void) {
+  output_str("Invalid weekdays value\n");
+}
+
+void msg_calendar_bad(void) {
+  output_str("Invalid calendar\n");
+}
+
+void msg_services(char *city, int date) {
+  output_str("The services from ");
+  output_str(city);
+  output_str(" on ");
+  output_int(date);
+  output_str(" are:");
+}
+
+void msg_snapshot_save_failed(char *path) {
+  output_str("Sorry the snapshot could not be saved to ");
+  output_str(path);
+  output_str(".\n");
+}
+
+void msg_snapshot_load_failed(char *path) {
+  output_str("Sorry the snapshot could not be loaded from ");
+  output_str(path);
+  output_str(".\n");
+}
+
+void msg_snapshot_export_failed(char *path) {
+  output_str("Sorry the cities could not be moved to ");
+  output_str(path);
+  output_str(".\n");
+}
+
+void msg_file_refused(void) {
+  if (server_files == NULL) {
+    output_str("Sorry this server does not let clients use files.\n");
+  } else {
+    output_str("Sorry clients can only name a file in the server's file directory.\n");
+  }
+}
+
+void msg_shard_bad(void) {
+  output_str("Invalid shard value\n");
+}
+
+void msg_not_on_shards(void) {
+  output_str("Sorry that can not be done on a sharded inventory.\n");
+}
+
+void msg_shards_full(void) {
+  output_str("Sorry no more shards can be added.\n");
+}
+
+void msg_shard_added(int shard, int shards) {
+  output_str("Added shard ");
+  output_int(shard);
+  output_str(", ");
+  output_int(shards);
+  output_str(" shards now.\n");
+}
+
+void print_command_help()
+{
+  output_str("Here are the possible commands:\n"
+	 "A <city name>     - Add an active empty flight schedule for\n"
+	 "                    <city name>\n"
+	 "L                 - List cities which have an active schedule\n"
+	 "P <prefix>        - List those of them whose name starts with\n"
+	 "                    <prefix>\n"
+	 "l <city name>     - List the flights for <city name>\n"
+	 "F                 - List the flights of every city, all as they\n"
+	 "                    were when the listing started\n"
+	 "a <city name>\n"
+         "<time> <capacity> - Add a flight for <city name> @ <time> time\n"
+	 "                    with <capacity> seats\n"  
+	 "r <city name>\n"
+         "<time>            - Remove a flight form <city name> whose time is\n"
+	 "                    <time>\n"
+	 "s <city name>\n"
+	 "<time>            - Attempt to schedule seat on flight to \n"
+	 "                    <city name> at <time> or next closest time on\n"
+	 "                    which their is an available seat, or wait\n"
+	 "                    for one on it\n"
+	 "u <city name>\n"
+	 "<time>            - unschedule a seat from flight to <city name>\n"
+	 "                    at <time>\n"
+	 "b <city name>\n"
+	 "<time> <seats>    - Attempt to schedule <seats> seats together on\n"
+	 "                    the flight that s would pick, or wait for them\n"
+	 "B <city name>\n"
+	 "<time> <seats>    - Like b, but seats left over go on the next\n"
+	 "                    flights after it\n"
+	 "c <city name>\n"
+	 "<time> <seats>    - unschedule <seats> seats from flight to\n"
+	 "                    <city name> at <time>\n"
+	 "W <city name>\n"
+	 "<time>            - List the seats waiting for the flight to\n"
+	 "                    <city name> at <time>, in order\n"
+	 "D <from> <to>     - List the flights with seats left of all cities\n"
+	 "                    leaving from <from> to <to>\n"
+	 "N <time> <count>  - List the next <count> flights with seats left\n"
+	 "                    of all cities leaving at or after <time>\n"
+	 "g <origin>\n"
+	 "<destination>\n"
+	 "<dep> <arr> <cap> - Add a connection from <origin> to <destination>\n"
+	 "                    leaving at <dep> and arriving at <arr> with\n"
+	 "                    <cap> seats\n"
+	 "G <origin>\n"
+	 "<destination>\n"
+	 "<dep>             - Remove the connection from <origin> to\n"
+	 "                    <destination> leaving at <dep>\n"
+	 "k <origin>\n"
+	 "<destination>\n"
+	 "<dep> <seats>     - Attempt to schedule <seats> seats on the\n"
+	 "                    connection from <origin> to <destination>\n"
+	 "                    leaving at <dep>\n"
+	 "K <origin>\n"
+	 "<destination>\n"
+	 "<dep> <seats>     - unschedule <seats> seats from that connection\n"
+	 "i <origin>        - List the connections from <origin>\n"
+	 "I <destination>\n"
+	 "<time> <deadline> - Find the flights from home arriving first at\n"
+	 "                    <destination>, leaving at or after <time> and\n"
+	 "                    arriving by <deadline>, with seats left\n"
+	 "v <origin>\n"
+	 "<destination>\n"
+	 "<dep> <arr> <cap> <first> <last> <weekdays>\n"
+	 "                  - Add a service from <origin> to <destination>\n"
+	 "                    leaving at <dep> and arriving at <arr> with\n"
+	 "                    <cap> seats each day from date <first> to date\n"
+	 "                    <last> (YYYYMMDD) on <weekdays>, seven 0 or 1\n"
+	 "                    digits from Monday to Sunday\n"
+	 "V <origin>\n"
+	 "<destination>\n"
+	 "<dep> <date>      - Remove the service from <origin> to\n"
+	 "                    <destination> leaving at <dep> on <date>\n"
+	 "y <origin>\n"
+	 "<destination>\n"
+	 "<dep> <date> <seats>\n"
+	 "                  - Attempt to schedule <seats> seats on that\n"
+	 "                    service on <date>\n"
+	 "Y <origin>\n"
+	 "<destination>\n"
+	 "<dep> <date> <seats>\n"
+	 "                  - unschedule <seats> seats from that service on\n"
+	 "                    <date>\n"
+	 "w <origin>\n"
+	 "<date>            - List the services from <origin> on <date>\n"
+	 "R <city name>     - Remove schedule for <city name>\n"
+	 "S <file>          - Save all schedules to snapshot <file>\n"
+	 "O <file>          - Replace all schedules with those saved in\n"
+	 "                    snapshot <file>\n"
+	 "X <file>\n"
+	 "<shards>          - Move the cities a shard added to make <shards>\n"
+	 "                    would take to snapshot <file>\n"
+	 "                    A server (--server, --router) refuses S, O\n"
+	 "                    and X unless started with --files <dir>, and\n"
+	 "                    then <file> is a name in <dir>\n"
+	 "E                 - Add a shard to a sharded inventory (--router)\n"
+#if FLIGHT_STATS
+	 "T                 - print statistics of the commands run so far\n"
+#endif
+	 "h                 - print this help message\n"
+	 "q                 - quit\n"
+);
+}
+
+
+/****************************************************************
+ * Resets a flight schedule                                     *
+ ****************************************************************/
+void flight_schedule_reset(struct flight_schedule *fs) {
+    fs->city = CITY_NONE;
+#if FLIGHT_STATS
+    fs->hits = 0;
+#endif
+    fs->n_flights = 0;
+    fs->max_flights = INLINE_FLIGHTS_PER_CITY;
+    for (int i=0; i<INLINE_FLIGHTS_PER_CITY; i++) {
+      fs->flights.local.time[i] = TIME_NULL;
+      fs->flights.local.available[i] = 0;
+      fs->flights.local.capacity[i] = 0;
+    }
+    fs->next = 0;
+    fs->prev = 0;
+    fs->waitlists = NULL;
+}
+
+/****************************************************************
+ * Flight storage: returns the flight lanes of a schedule,      *
+ * inline or spilled to a pool block                            *
+ ****************************************************************/
+struct flight_lanes flight_schedule_lanes(struct flight_schedule *fs) {
+  struct flight_lanes lanes;
+
+  if (fs->max_flights > INLINE_FLIGHTS_PER_CITY) {
+    lanes.time = fs->flights.spill;
+    lanes.available = (packed_seats_t *)(lanes.time + fs->max_flights);
+    lanes.capacity = lanes.available + fs->max_flights;
+  } else {
+    lanes.time = fs->flights.local.time;
+    lanes.available = fs->flights.local.available;
+    lanes.capacity = fs->flights.local.capacity;
+  }
+  return lanes;
+}
+
+/****************************************************************
+ * Copies up to max flights of a schedule, in time order, out   *
+ * of its lanes.  Returns how many were copied.                 *
+ ****************************************************************/
+int flight_schedule_copy(struct flight_schedule *fs, struct flight *flights, int max) {
+  int n = fs->n_flights < max ? fs->n_flights : max;
+  struct flight_lanes lanes = flight_schedule_lanes(fs);
+
+  for (int i = 0; i < n; i++) {
+    flights[i].time = lanes.time[i];
+    flights[i].available = lanes.available[i];
+    flights[i].capacity = lanes.capacity[i];
+  }
+  return n;
+}
+
+/****************************************************************
+ * Makes sure there is room for one more flight in the schedule *
+ * by moving its flights to a pool array twice as big.          *
+ * Returns false if the city has MAX_FLIGHTS_PER_CITY flights   *
+ * or no memory is left.                                        *
+ ****************************************************************/
+bool flight_schedule_reserve_flight(struct flight_schedule *fs) {
+  return flight_schedule_reserve_flights(fs, fs->n_flights + 1);
+}
+
+/****************************************************************
+ * Makes sure the schedule has room for count flights in all,   *
+ * taking a big enough pool array if the current one is not.    *
+ * Returns false if count is over MAX_FLIGHTS_PER_CITY or no    *
+ * memory is left.                                              *
+ ****************************************************************/
+bool flight_schedule_reserve_flights(struct flight_schedule *fs, int count) {
+  if (count <= fs->max_flights) return true;
+  if (count > MAX_FLIGHTS_PER_CITY) return false;
+
+  int n = MIN_SPILL_FLIGHTS;
+  while (n < count) n *= 2;
+
+  void *array = flight_array_get(n);
+  if (array == NULL) return false;
+
+  struct flight_lanes from = flight_schedule_lanes(fs);
+  packed_time_t *time = array;
+  packed_seats_t *available = (packed_seats_t *)(time + n);
+  memcpy(time, from.time, fs->n_flights * sizeof(packed_time_t));
+  memcpy(available, from.available, fs->n_flights * sizeof(packed_seats_t));
+  memcpy(available + n, from.capacity, fs->n_flights * sizeof(packed_seats_t));
+  for (int i = fs->n_flights; i < n; i++) {
+    time[i] = TIME_PAD;
+  }
+  flight_schedule_release_flights(fs);
+  fs->flights.spill = array;
+  fs->max_flights = n;
+  return true;
+}
+
+/****************************************************************
+ * Puts a flight at position i of the lanes, shifting the ones  *
+ * from i on up.  There must be room for it.                    *
+ ****************************************************************/
+void flight_schedule_insert_flight(struct flight_schedule *fs, int i, flight_time_t time,
+                                   int available, int capacity) {
+  struct flight_lanes lanes = flight_schedule_lanes(fs);
+  int move = fs->n_flights - i;
+
+  memmove(&lanes.time[i+1], &lanes.time[i], move * sizeof(packed_time_t));
+  memmove(&lanes.available[i+1], &lanes.available[i], move * sizeof(packed_seats_t));
+  memmove(&lanes.capacity[i+1], &lanes.capacity[i], move * sizeof(packed_seats_t));
+  lanes.time[i] = time;
+  lanes.available[i] = available;
+  lanes.capacity[i] = capacity;
+  fs->n_flights++;
+  if (available > 0) {
+    departure_open(fs->city, time);
+  }
+}
+
+/****************************************************************
+ * Takes the flight at position i out of the lanes, closing the *
+ * gap so the flights stay sorted                               *
+ ****************************************************************/
+void flight_schedule_delete_flight(struct flight_schedule *fs, int i) {
+  struct flight_lanes lanes = flight_schedule_lanes(fs);
+  if (lanes.available[i] > 0) {
+    departure_close(fs->city, lanes.time[i]);
+  }
+  int move = --fs->n_flights - i;
+
+  memmove(&lanes.time[i], &lanes.time[i+1], move * sizeof(packed_time_t));
+  memmove(&lanes.available[i], &lanes.available[i+1], move * sizeof(packed_seats_t));
+  memmove(&lanes.capacity[i], &lanes.capacity[i+1], move * sizeof(packed_seats_t));
+  if (fs->max_flights > INLINE_FLIGHTS_PER_CITY) {
+    lanes.time[fs->n_flights] = TIME_PAD;
+  }
+}
+
+/****************************************************************
+ * Sets the seats left on the flight at position i, telling the *
+ * departure index when it fills up or gets seats again         *
+ ****************************************************************/
+void flight_schedule_set_available(struct flight_schedule *fs, int i, int available) {
+  struct flight_lanes lanes = flight_schedule_lanes(fs);
+
+  if (available > 0 && lanes.available[i] == 0) {
+    departure_open(fs->city, lanes.time[i]);
+  } else if (available == 0 && lanes.available[i] > 0) {
+    departure_close(fs->city, lanes.time[i]);
+  }
+  lanes.available[i] = available;
+}
+
+/****************************************************************
+ * Gives a spilled flight array back to the pool and goes back  *
+ * to the inline flights.  The flights themselves are dropped.  *
+ ****************************************************************/
+void flight_schedule_release_flights(struct flight_schedule *fs) {
+  if (fs->max_flights > INLINE_FLIGHTS_PER_CITY) {
+    flight_array_put(fs->flights.spill, fs->max_flights);
+  }
+  fs->max_flights = INLINE_FLIGHTS_PER_CITY;
+}
+
+/****************************************************************
+ * Size class of an array of n flights, n is a power of 2       *
+ ****************************************************************/
+int flight_array_class(int n) {
+  int k = 0;
+  while ((MIN_SPILL_FLIGHTS << k) < n) k++;
+  return k;
+}
+
+/****************************************************************
+ * Takes a block for n flights (3 lanes of n 16 bit fields)     *
+ * from the pool, allocates a new one if there is none.  n is a *
+ * power of 2 from MIN_SPILL_FLIGHTS to MAX_FLIGHTS_PER_CITY.   *
+ * Blocks are aligned for 256 bit vector loads.                 *
+ ****************************************************************/
+void * flight_array_get(int n) {
+  int k = flight_array_class(n);
+
+  pthread_mutex_lock(&flight_arrays_lock);
+  void *array = flight_arrays_free[k];
+  if (array != NULL) {
+    memcpy(&flight_arrays_free[k], array, sizeof(void *)); // pop
+  }
+  pthread_mutex_unlock(&flight_arrays_lock);
+
+  if (array == NULL) {
+    return aligned_alloc(32, n * (sizeof(packed_time_t) + 2 * sizeof(packed_seats_t)));
+  }
+  return array;
+}
+
+/****************************************************************
+ * Puts a block of n flights back in the pool for reuse         *
+ ****************************************************************/
+void flight_array_put(void *array, int n) {
+  int k = flight_array_class(n);
+
+  pthread_mutex_lock(&flight_arrays_lock);
+  memcpy(array, &flight_arrays_free[k], sizeof(void *)); // push
+  flight_arrays_free[k] = array;
+  pthread_mutex_unlock(&flight_arrays_lock);
+}
+
+/******************************************************************
+* Initializes the pool that will hold any flight schedules        *
+* created by the user. This is called in main for you.            *
+* Only the first chunk of n schedules is allocated here, and none *
+* of them are touched until used; the rest comes from             *
+* flight_schedule_grow.                                           *
+ *****************************************************************/
+
+void flight_schedule_initialize(long n)
+{
+  flight_schedules_active = NULL;
+
+  // n is only a hint of how many schedules there will be: a bigger first
+  // chunk would be allocated whole whether they come or not
+  if (n > MAX_SCHEDULE_CHUNK) n = MAX_SCHEDULE_CHUNK;
+
+  // size the city name index for the first chunk, it grows as needed
+  city_table_initialize(n);
+  flight_simd_initialize();
+  departure_initialize();
+
+  atomic_store(&flight_schedules_pool.free_head, 0);
+  atomic_store(&flight_schedules_pool.carved, 0);
+  flight_schedules_pool.first = n;
+  for (int k = 0; k < MAX_SCHEDULE_CHUNKS; k++) {
+    atomic_store(&flight_schedules_pool.chunks[k], NULL);
+  }
+  if (n < 1) return;
+  flight_schedule_grow(0);
+}
+
+/******************************************************************
+* Returns the number of schedules chunk k of the pool holds.      *
+ *****************************************************************/
+
+long flight_schedule_chunk_size(int k)
+{
+  long size = flight_schedules_pool.first;
+
+  while (k-- > 0 && size < MAX_SCHEDULE_CHUNK) {
+    size *= 2;
+  }
+  return size < MAX_SCHEDULE_CHUNK ? size : MAX_SCHEDULE_CHUNK;
+}
+
+/******************************************************************
+* Returns the chunk of the pool holding schedule id, and its      *
+* position within that chunk in *offset.                          *
+ *****************************************************************/
+
+int flight_schedule_chunk_of(uint32_t id, long *offset)
+{
+  uint64_t start = 0, size = flight_schedules_pool.first;
+  int k = 0;
+
+  // through the chunks that double
+  while (size < MAX_SCHEDULE_CHUNK && id >= start + size) {
+    start += size;
+    size = (2*size < MAX_SCHEDULE_CHUNK) ? 2*size : MAX_SCHEDULE_CHUNK;
+    k++;
+  }
+  // and straight to the one of the largest that has it
+  *offset = (id - start) % size;
+  return k + (id - start) / size;
+}
+
+/******************************************************************
+* Returns the schedule with the given id.  Its chunk must exist.  *
+ *****************************************************************/
+
+struct flight_schedule * flight_schedule_at(uint32_t id)
+{
+  long offset;
+  int k = flight_schedule_chunk_of(id, &offset);
+
+  return &atomic_load(&flight_schedules_pool.chunks[k])[offset];
+}
+
+/******************************************************************
+* Returns the view state of a schedule, see struct               *
+* flight_view_state.                                              *
+ *****************************************************************/
+
+struct flight_view_state * flight_schedule_views(const struct flight_schedule *fs)
+{
+  long offset;
+  int k = flight_schedule_chunk_of(fs->id, &offset);
+
+  return &flight_schedules_pool.view_chunks[k][offset];
+}
+
+/******************************************************************
+* Follows a next or prev link of the active list, id+1 of the     *
+* schedule it leads to or 0 for none.  Returns NULL for none.     *
+ *****************************************************************/
+
+struct flight_schedule * flight_schedule_link(uint32_t link)
+{
+  return link == 0 ? NULL : flight_schedule_at(link - 1);
+}
+
+/******************************************************************
+* Allocates chunk k of the pool unless another thread did it      *
+* already.  Returns false if out of memory.                       *
+ *****************************************************************/
+
+bool flight_schedule_grow(int k)
+{
+  struct flight_schedule_pool *pool = &flight_schedules_pool;
+  bool ok = true;
+
+  pthread_mutex_lock(&pool->grow_lock);
+  if (atomic_load(&pool->chunks[k]) == NULL) {
+    long size = flight_schedule_chunk_size(k);
+    struct flight_schedule *chunk = malloc(size * sizeof(struct flight_schedule));
+    struct flight_view_state *views = malloc(size * sizeof(struct flight_view_state));
+    if (chunk == NULL || views == NULL) {
+      free(chunk);
+      free(views);
+      ok = false;
+    } else {
+      pool->view_chunks[k] = views; // before anyone can reach its schedules
+      atomic_store(&pool->chunks[k], chunk);
+    }
+  }
+  pthread_mutex_unlock(&pool->grow_lock);
+  return ok;
+}
+
+/***********************************************************
+ * time_get: read a time from the user
+   Time in this program is a minute number 0-((24*60)-1)=1439
+   -1 is used to indicate the NULL empty time 
+   This function should read in a time value and check its 
+   validity.  If it is not valid eg. not -1 or not 0-1439
+   It should print "Invalid Time" and return false.
+   othewise it should return the value in the integer pointed
+   to by time_ptr.
+ ***********************************************************/
+bool time_get(int *time_ptr) {
+  if (int_get(time_ptr)) {
+    return (TIME_NULL == *time_ptr || 
+	    (*time_ptr >= TIME_MIN && *time_ptr <= TIME_MAX));
+  } 
+  msg_time_bad();
+  return false;
+}
+
+/***********************************************************
+ * flight_capacity_get: read the capacity of a flight from the user
+   This function should read in a capacity value and check its 
+   validity.  If it is not greater than 0, it should print 
+   "Invalid capacity value" and return false. Othewise it should 
+   return the value in the integer pointed to by cap_ptr.
+   Capacities over MAX_FLIGHT_CAPACITY don't fit a flight.
+ ***********************************************************/
+bool flight_capacity_get(int *cap_ptr) {
+  if (int_get(cap_ptr) && *cap_ptr <= MAX_FLIGHT_CAPACITY) {
+    return *cap_ptr > 0;
+  }
+  msg_capacity_bad();
+  return false;
+}
+
+/***********************************************************
+ * seat_count_get: read the number of seats of a booking
+   from the user.  Prints "Invalid seat count value" and
+   returns false if it is not a number greater than 0.
+ ***********************************************************/
+bool seat_count_get(int *count_ptr) {
+  if (int_get(count_ptr) && *count_ptr > 0) {
+    return true;
+  }
+  msg_seat_count_bad();
+  return false;
+}
+
+/***********************************************************
+ * date_get: read a date, written YYYYMMDD, from the user.
+   Prints "Invalid date value" and returns false if it is
+   not a real date from 1970-01-01 to day DAY_MAX.
+   Otherwise it returns the day number of the date, days
+   since 1970-01-01, in the integer pointed to by day_ptr.
+ ***********************************************************/
+bool date_get(int *day_ptr) {
+  int date;
+
+  if (int_get(&date) && date >= 19700101 && date <= 99991231) {
+    *day_ptr = date_day(date / 10000, date / 100 % 100, date % 100);
+    if (*day_ptr <= DAY_MAX && date_of_day(*day_ptr) == date) {
+      return true;
+    }
+  }
+  msg_date_bad();
+  return false;
+}
+
+/***********************************************************
+ * weekdays_get: read the days of the week a service
+   operates on, seven 0 or 1 digits from Monday to Sunday
+   (leading zeros may be left out).  Prints "Invalid
+   weekdays value" and returns false if it is not.
+   Otherwise it returns the days as bits, Monday in bit 0,
+   in the integer pointed to by weekdays_ptr.
+ ***********************************************************/
+bool weekdays_get(int *weekdays_ptr) {
+  int digits;
+
+  if (int_get(&digits) && digits >= 0 && digits <= 1111111) {
+    *weekdays_ptr = 0;
+    for (int bit = 6; bit >= 0 && digits % 10 <= 1; bit--, digits /= 10) {
+      *weekdays_ptr |= (digits % 10) << bit;
+    }
+    if (digits == 0) {
+      return true;
+    }
+  }
+  msg_weekdays_bad();
+  return false;
+}
+
+/***********************************************************
+ * flight_schedule_lower_bound: search of the sorted
+   flights of a schedule.  Returns the index of the first
+   flight departing at or after time, or n_flights if every
+   flight leaves before it.
+   Binary search narrows it down to FLIGHT_SEARCH_BLOCK
+   flights, which the vector kernel then counts in one pass
+   over the padded time lane.
+ ***********************************************************/
+int flight_schedule_lower_bound(struct flight_schedule *fs, flight_time_t time)
+{
+  packed_time_t *times = flight_schedule_lanes(fs).time;
+  int lo = 0, hi = fs->n_flights;
+  int block = (fs->max_flights > INLINE_FLIGHTS_PER_CITY) ? FLIGHT_SEARCH_BLOCK : 0;
+
+  while (hi - lo > block) {
+    int mid = lo + (hi - lo) / 2;
+    if (times[mid] < time) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (block == 0) return lo;
+
+  // everything before lo is earlier and everything from hi on is not, so
+  // count the earlier ones in whole vectors around [lo, hi)
+  int base = lo & ~(MIN_SPILL_FLIGHTS - 1);
+  int end = (hi + MIN_SPILL_FLIGHTS - 1) & ~(MIN_SPILL_FLIGHTS - 1);
+  return base + flight_count_before(times + base, end - base, time);
+}
+
+/***********************************************************
+ * flight_simd_initialize: picks the fastest version of
+   flight_count_before this CPU can run
+ ***********************************************************/
+void flight_simd_initialize(void)
+{
+  flight_count_before = flight_count_before_scalar;
+#ifdef FLIGHT_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    flight_count_before = flight_count_before_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    flight_count_before = flight_count_before_sse2;
+  }
+#endif
+}
+
+/***********************************************************
+ * flight_count_before: number of the n times that are before
+   time.  n is a multiple of MIN_SPILL_FLIGHTS.
+ ***********************************************************/
+int flight_count_before_scalar(const packed_time_t *times, int n, flight_time_t time)
+{
+  int count = 0;
+
+  for (int i = 0; i < n; i++) {
+    count += times[i] < time;
+  }
+  return count;
+}
+
+#ifdef FLIGHT_SIMD_X86
+__attribute__((target("sse2")))
+int flight_count_before_sse2(const packed_time_t *times, int n, flight_time_t time)
+{
+  __m128i t = _mm_set1_epi16(time);
+  __m128i count = _mm_setzero_si128();
+
+  for (int i = 0; i < n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(times + i));
+    count = _mm_sub_epi16(count, _mm_cmpgt_epi16(t, v)); // true is -1
+  }
+  count = _mm_madd_epi16(count, _mm_set1_epi16(1)); // pairs summed to 32 bits
+  count = _mm_add_epi32(count, _mm_shuffle_epi32(count, 0x4e));
+  count = _mm_add_epi32(count, _mm_shuffle_epi32(count, 0xb1));
+  return _mm_cvtsi128_si32(count);
+}
+
+__attribute__((target("avx2")))
+int flight_count_before_avx2(const packed_time_t *times, int n, flight_time_t time)
+{
+  __m256i t = _mm256_set1_epi16(time);
+  __m256i count = _mm256_setzero_si256();
+
+  for (int i = 0; i < n; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(times + i));
+    count = _mm256_sub_epi16(count, _mm256_cmpgt_epi16(t, v)); // true is -1
+  }
+  count = _mm256_madd_epi16(count, _mm256_set1_epi16(1)); // pairs summed to 32 bits
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(count),
+                              _mm256_extracti128_si256(count, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+  return _mm_cvtsi128_si32(sum);
+}
+#endif
+/*code added here*/
+
+/*Takes a schedule off the free stack, or the next unused one from the
+chunks of the pool if the stack is empty.  Safe to call from any thread
+without holding a lock.
+Returns the reset schedule, or NULL if there is no memory left. */
+struct flight_schedule * flight_schedule_allocate(void)
+{ 
+  struct flight_schedule_pool *pool = &flight_schedules_pool;
+  uint64_t head = atomic_load(&pool->free_head);
+
+  // pop: swing the head to the next free schedule with a new tag
+  while ((uint32_t)head != 0) {
+    struct flight_schedule *fs = flight_schedule_at((uint32_t)head - 1);
+    uint64_t next = (((head >> 32) + 1) << 32) | atomic_load(&fs->free_next);
+    if (atomic_compare_exchange_weak(&pool->free_head, &head, next)) {
+      return fs;
+    }
+  }
+
+  // nothing to reuse, hand out a schedule never used before
+  uint64_t id = atomic_fetch_add(&pool->carved, 1);
+  if (id > MAX_SCHEDULE_ID) {
+    return NULL;
+  }
+  long offset;
+  int k = flight_schedule_chunk_of(id, &offset);
+  if (atomic_load(&pool->chunks[k]) == NULL && !flight_schedule_grow(k)) {
+    return NULL; // out of memory
+  }
+
+  struct flight_schedule *fs = &atomic_load(&pool->chunks[k])[offset];
+  flight_schedule_reset(fs); // reset clears all fields
+  pthread_mutex_init(&fs->lock, NULL);
+  fs->id = id;
+  atomic_init(&fs->free_next, 0);
+  struct flight_view_state *vs = flight_schedule_views(fs);
+  vs->stamp = atomic_load(&views.epoch); // no view has it yet
+  vs->versions = NULL;
+  return fs;
+}
+
+/*Takes as input a flight schedule struct that is not on the active list,
+  resets it, pushes it on the free stack and gives back its hold on its
+  city.  Safe to call from any thread without holding a lock.
+  return nothing */
+void flight_schedule_free(struct flight_schedule *fs)
+{ 
+  if(fs == NULL){
+    return;
+  }
+  city_id_t city = fs->city;
+
+  // its flights leave the departure index, the spilled ones go back to
+  // the pool
+  struct flight_lanes lanes = flight_schedule_lanes(fs);
+  for (int i = 0; i < fs->n_flights; i++) {
+    if (lanes.available[i] > 0) {
+      departure_close(fs->city, lanes.time[i]);
+    }
+  }
+  flight_schedule_release_flights(fs);
+  waitlist_clear(fs);
+  flight_schedule_reset(fs);
+
+  // push: fs becomes the head with a new tag
+  struct flight_schedule_pool *pool = &flight_schedules_pool;
+  uint64_t head = atomic_load(&pool->free_head);
+  uint64_t next;
+  do {
+    atomic_store(&fs->free_next, (uint32_t)head);
+    next = (((head >> 32) + 1) << 32) | (fs->id + 1);
+  } while (!atomic_compare_exchange_weak(&pool->free_head, &head, next));
+  city_release(city);
+}
+
+/*Places a schedule at the front of the active list and makes it the one of
+  its city.  The caller links the city into the sorted order and must hold
+  flight_schedules_lock exclusive. */
+void flight_schedule_activate(struct flight_schedule *fs)
+{
+  if(fs->city >= flight_schedules_by_city_max){ // a city id not seen yet
+    size_t max = flight_schedules_by_city_max ? 2*flight_schedules_by_city_max : MIN_INDEX_SLOTS;
+    while(max <= fs->city){
+      max *= 2;
+    }
+    struct flight_schedule **bigger = realloc(flight_schedules_by_city, max * sizeof(*bigger));
+    if(bigger == NULL){
+      output_str("ERROR: Out of memory for the destination index.\n");
+      exit(EXIT_FAILURE);
+    }
+    for(size_t i = flight_schedules_by_city_max; i < max; i++){
+      bigger[i] = NULL;
+    }
+    flight_schedules_by_city = bigger;
+    flight_schedules_by_city_max = max;
+  }
+  flight_schedules_by_city[fs->city] = fs; // make the new city findable
+
+  fs->prev = 0;
+  fs->next = 0;
+  if(flight_schedules_active != NULL){
+    fs->next = flight_schedules_active->id + 1;
+    flight_schedules_active->prev = fs->id + 1;
+  }
+  flight_schedules_active = fs;
+}
+
+/*Takes a schedule off the active list and leaves its city without one.
+  The caller must hold flight_schedules_lock exclusive. */
+void flight_schedule_deactivate(struct flight_schedule *fs)
+{
+  flight_schedules_by_city[fs->city] = NULL;
+  city_order_remove(fs->city);
+
+  struct flight_schedule *prev = flight_schedule_link(fs->prev);
+  struct flight_schedule *next = flight_schedule_link(fs->next);
+
+  if(prev == NULL){ // first node in active list
+    flight_schedules_active = next;
+  }
+  else{
+    prev->next = fs->next;
+  }
+  if(next != NULL){
+    next->prev = fs->prev;
+  }
+  fs->next = 0;
+  fs->prev = 0;
+}
+
+
+/*Takes as input a city and adds a flight schedule for this given city.
+  Does not return anything.
+  Command line syntax: "A Toronto\n"*/
+void flight_schedule_add(city_t city)
+{ 
+  city_id_t id = city_intern(city); // its id from now on
+
+  if(id == CITY_NONE){
+    msg_schedule_no_free();
+    return;
+  }
+  switch(flight_engine_add(id)){
+  case FLIGHT_CITY_EXISTS:
+    msg_city_exists(city); //c
+    break;
+  case FLIGHT_NO_FREE:
+    msg_schedule_no_free();
+    break;
+  default:
+    break;
+  }
+  city_release(id); // the schedule holds it now if it was added
+}
+  
+
+
+/*Takes as input a city and removes the flight schedule for this city, if it exists.
+ Does not return anything*/
+void flight_schedule_remove(city_t city)
+{
+  if(flight_engine_remove(city_lookup(city)) == FLIGHT_NO_CITY){
+    msg_city_bad(city);// c *msg no schedule for city*/
+  }
+}
+
+/*Prints one city of the listAll output*/
+void flight_schedule_list_city(city_id_t city, void *arg)
+{
+  (void)arg;
+  output_str(city_name(city));// print the char if it doesn't reach end
+  output_char('\n');
+}
+
+/*Lists all of the existing flight schedules, sorted by city name.*/
+void flight_schedule_listAll(void)
+{
+  flight_schedule_list_view("");
+}
+
+/*Lists the existing flight schedules whose city name starts with prefix,
+  sorted by city name.*/
+void flight_schedule_listPrefix(city_t prefix)
+{
+  flight_schedule_list_view(prefix);
+}
+
+/*Lists the cities whose name starts with prefix from a read view, so no
+  lock is held while they are printed*/
+void flight_schedule_list_view(const char *prefix)
+{
+  struct flight_view *view = flight_engine_view_open(prefix, false);
+  if (view == NULL) {
+    msg_view_no_free();
+    return;
+  }
+  for (size_t i = 0; i < view->n; i++) {
+    flight_schedule_list_city(view->cities[i].city, NULL);
+  }
+  flight_engine_view_close(view);
+}
+
+/*Lists the flights with seats left of all cities leaving between two
+  times, both included, in time order.
+  This function should call time get to take in the two times.*/
+void flight_schedule_departures(void)
+{
+  flight_time_t from, to;
+
+  if (time_get(&from) && time_get(&to)) {
+    msg_departures(from, to);
+    int count = INT_MAX;
+    flight_engine_for_each_departure(from, to, flight_schedule_list_departure, &count);
+    output_char('\n');
+  }
+}
+
+/*Lists the first count flights with seats left of all cities leaving at
+  or after a time.
+  This function should call time get to take in the time, then the count.*/
+void flight_schedule_next_departures(void)
+{
+  flight_time_t from;
+  int count;
+
+  if (!time_get(&from)) return;
+  if (!int_get(&count) || count <= 0) {
+    msg_count_bad();
+    return;
+  }
+  msg_next_departures(count, from);
+  flight_engine_for_each_departure(from, TIME_MAX, flight_schedule_list_departure, &count);
+  output_char('\n');
+}
+
+/*Prints one flight of a departure list, arg points to the number of them
+  still to print*/
+bool flight_schedule_list_departure(const struct departure *d, void *arg)
+{
+  int *left = arg;
+
+  msg_departure_info(d->flight.time, city_name(d->city), d->flight.available);
+  return --*left > 0;
+}
+
+/*Lists all of the flights of a given city*/
+void flight_schedule_list(city_t city)
+{
+  struct flight flights[MAX_FLIGHTS_PER_CITY];
+  int n = flight_engine_flights(city_lookup(city), flights, MAX_FLIGHTS_PER_CITY); // copy of the flights
+  if(n < 0){
+    msg_city_bad(city);  //no city in list
+    return;
+  }
+    
+    flight_schedule_print(city, flights, n);
+}
+
+/*Lists the flights of every city, sorted by city name, all as they were
+  when the listing started.  They are read from a read view: bookings go
+  on meanwhile and the ones made after it started are not shown.*/
+void flight_schedule_list_inventory(void)
+{
+  struct flight flights[MAX_FLIGHTS_PER_CITY];
+  struct flight_view *view = flight_engine_view_open("", true);
+  if (view == NULL) {
+    msg_view_no_free();
+    return;
+  }
+  for (size_t i = 0; i < view->n; i++) {
+    int n = flight_engine_view_flights(view, i, flights, MAX_FLIGHTS_PER_CITY);
+    flight_schedule_print(city_name(view->cities[i].city), flights, n);
+  }
+  flight_engine_view_close(view);
+}
+
+/*Prints the flights of a city as the l command lists them*/
+void flight_schedule_print(const char *city, const struct flight *flights, int n)
+{
+    msg_city_flights(city); //c
+   
+    for (int i=0; i<n; i++) {
+      msg_flight_info(flights[i].time, flights[i].available, flights[i].capacity); // use for loop to print each flight's attributes //c
+    }
+    output_char('\n');
+}
+
+/*Takes as input a city and adds a given flight for this city.
+  This function should call time get and flight capacity get to take in the time and capacity for the
+newly added flight.
+  Does not return anything.*/
+void flight_schedule_add_flight(city_t city)
+{
+  flight_time_t time;
+  int capacity;
+  city_id_t id = city_lookup(city);
+ 
+
+  if(!flight_engine_exists(id)){
+    msg_city_bad(city);  
+    return;
+  }
+
+  if ((time_get(&time)) && (flight_capacity_get(&capacity)))
+  { // if such city is added in schedule and we have valid input
+    switch(flight_engine_add_flight(id, time, capacity)){
+    case FLIGHT_NO_CITY: // removed by another thread meanwhile
+      msg_city_bad(city);
+      break;
+    case FLIGHT_MAX_FLIGHTS:
+      msg_city_max_flights_reached(city);
+      break;
+    default:
+      break;
+    }
+  } 
+}
+ 
+
+/*Takes as input a city and removes the given flight for this city.
+ This function should call time get to determine which flight should be removed.
+ Does not return anything.*/
+void flight_schedule_remove_flight(city_t city)
+{
+  flight_time_t time; 
+  city_id_t id = city_lookup(city);
+
+  if ((flight_engine_exists(id)) && (time_get(&time))) { 
+    switch(flight_engine_remove_flight(id, time)){
+    case FLIGHT_NO_CITY:
+      msg_city_bad(city);
+      break;
+    case FLIGHT_BAD_TIME:
+      msg_flight_bad_time();//c
+      break;
+    default:
+      break;
+    }
+  }
+  else{ // if such city is not added in schedule
+    msg_city_bad(city);
+  }
+}
+
+/*The user can specify any time and your program should schedule the next available flight from
+the given time.
+- Be sure to adjust the available seats accordingly.
+- Does not return anything.*/
+void flight_schedule_schedule_seat(city_t city)
+{
+  flight_time_t time; 
+  city_id_t id = city_lookup(city);
+
+  if(!flight_engine_exists(id)){ // no such city found
+    msg_city_bad(city);
+    return;
+  }
+
+  if (time_get(&time)){ // city found, valid inputs
+    switch(flight_engine_book(id, time, &time)){
+    case FLIGHT_NO_CITY:
+      msg_city_bad(city);
+      break;
+    case FLIGHT_NO_SEATS:
+      msg_flight_no_seats(); //c no seats or no this or next flight schedule time available 
+      break;
+    case FLIGHT_WAITLISTED:
+      msg_flight_waitlisted(time);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+
+/*Takes as input a city and unschedules a seat on a given flight for this city.
+- The user must specify the exact time for the flight that they are unscheduling.
+- Be sure to adjust the available seats accordingly.
+- Does not return anything*/
+void flight_schedule_unschedule_seat(city_t city)
+{
+  flight_time_t time; 
+  city_id_t id = city_lookup(city);
+
+  if(!flight_engine_exists(id)){
+    msg_city_bad(city);
+    return;
+  }
+
+  if (time_get(&time)){ //city found and valid time input
+    switch(flight_engine_unbook(id, time)){
+    case FLIGHT_NO_CITY:
+      msg_city_bad(city);
+      break;
+    case FLIGHT_ALL_EMPTY:
+      msg_flight_all_seats_empty(); //c //msg input exceed capability
+      break;
+    case FLIGHT_BAD_TIME:
+      msg_flight_bad_time(); //no this or next flight schedule time available
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+/*Schedules a number of seats for a party on the flight schedule_seat would
+  pick, or waitlists them if it has not that many left.  With spill the
+  seats it can't take go on the flights after it in time order instead,
+  still all or none.*/
+void flight_schedule_schedule_seats(city_t city, bool spill)
+{
+  flight_time_t time;
+  int count;
+  city_id_t id = city_lookup(city);
+
+  if(!flight_engine_exists(id)){
+    msg_city_bad(city);
+    return;
+  }
+
+  if (time_get(&time) && seat_count_get(&count)){
+    switch(flight_engine_book_seats(id, time, count, spill, &time)){
+    case FLIGHT_NO_CITY:
+      msg_city_bad(city);
+      break;
+    case FLIGHT_NO_SEATS:
+      msg_flight_no_seats();
+      break;
+    case FLIGHT_WAITLISTED:
+      msg_flight_waitlisted(time);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+/*Unschedules a number of seats on the flight at exactly the given time,
+  or none if fewer than that are booked.*/
+void flight_schedule_unschedule_seats(city_t city)
+{
+  flight_time_t time;
+  int count;
+  city_id_t id = city_lookup(city);
+
+  if(!flight_engine_exists(id)){
+    msg_city_bad(city);
+    return;
+  }
+
+  if (time_get(&time) && seat_count_get(&count)){
+    switch(flight_engine_unbook_seats(id, time, count)){
+    case FLIGHT_NO_CITY:
+      msg_city_bad(city);
+      break;
+    case FLIGHT_ALL_EMPTY:
+      msg_flight_all_seats_empty();
+      break;
+    case FLIGHT_BAD_TIME:
+      msg_flight_bad_time();
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+
+/*Adds a connection from origin to destination, two cities away from home.
+  This function should call time get twice and flight capacity get to take
+  in its departure, arrival and capacity.*/
+void flight_schedule_add_connection(city_t origin, city_t destination)
+{
+  flight_time_t departure, arrival;
+  int capacity;
+
+  if (!time_get(&departure) || !time_get(&arrival) || !flight_capacity_get(&capacity)) {
+    return;
+  }
+  city_id_t from = city_intern(origin), to = city_intern(destination);
+  switch(flight_engine_add_connection(from, to, departure, arrival, capacity)){
+  case FLIGHT_NO_CITY:
+  case FLIGHT_NO_FREE:
+    msg_schedule_no_free();
+    break;
+  case FLIGHT_BAD_CONNECTION:
+    msg_connection_bad();
+    break;
+  default:
+    break;
+  }
+  city_release(from); // the connection holds them now if it was added
+  city_release(to);
+}
+
+/*Removes the (first) connection from origin to destination leaving at the
+  time read by time get.*/
+void flight_schedule_remove_connection(city_t origin, city_t destination)
+{
+  flight_time_t departure;
+
+  if (time_get(&departure) &&
+      flight_engine_remove_connection(city_lookup(origin), city_lookup(destination),
+                                      departure) != FLIGHT_OK) {
+    msg_flight_bad_time();
+  }
+}
+
+/*Schedules a number of seats on the connection from origin to destination
+  leaving at exactly the given time, or with unbook gives them back, all or
+  none.*/
+void flight_schedule_book_connection(city_t origin, city_t destination, bool unbook)
+{
+  flight_time_t departure;
+  int count;
+  enum flight_status status;
+
+  if (!time_get(&departure) || !seat_count_get(&count)) {
+    return;
+  }
+  if (unbook) {
+    status = flight_engine_unbook_connection(city_lookup(origin), city_lookup(destination),
+                                             departure, count);
+  } else {
+    status = flight_engine_book_connection(city_lookup(origin), city_lookup(destination),
+                                           departure, count);
+  }
+  switch(status){
+  case FLIGHT_NO_CITY:
+  case FLIGHT_BAD_TIME:
+    msg_flight_bad_time();
+    break;
+  case FLIGHT_NO_SEATS:
+    msg_flight_no_seats();
+    break;
+  case FLIGHT_ALL_EMPTY:
+    msg_flight_all_seats_empty();
+    break;
+  default:
+    break;
+  }
+}
+
+/*Lists the connections leaving a city, in departure order*/
+void flight_schedule_list_connections(city_t origin)
+{
+  msg_connections(origin);
+  flight_engine_for_each_connection(city_lookup(origin), flight_schedule_list_connection, NULL);
+  output_char('\n');
+}
+
+/*Prints one connection of a connection list*/
+void flight_schedule_list_connection(const struct connection *c, void *arg)
+{
+  (void)arg;
+  msg_connection_info(c->departure, city_name(c->destination), c->arrival, c->available,
+                      c->capacity);
+}
+
+/*Prints the flights that get a traveller from home to destination the
+  earliest, leaving at or after a time and arriving by a deadline.
+  This function should call time get to take in the two times.*/
+void flight_schedule_itinerary(city_t destination)
+{
+  flight_time_t time, deadline;
+  struct itinerary_leg *legs = NULL;
+  int max = 0;
+
+  if (!time_get(&time) || !time_get(&deadline)) {
+    return;
+  }
+  int n = flight_engine_itinerary(city_lookup(destination), time, deadline, &legs, &max);
+  if (n == 0) {
+    msg_itinerary_none(destination);
+  } else {
+    msg_itinerary(destination);
+    for (int i = 0; i < n; i++) {
+      msg_itinerary_leg(legs[i].departure, city_name(legs[i].destination), legs[i].arrival);
+    }
+    output_char('\n');
+  }
+  free(legs);
+}
+
+/*Adds a service from origin to destination.  This function should call
+  time get twice and flight capacity get to take in its departure, arrival
+  and capacity, then date get twice and weekdays get for its calendar.*/
+void flight_schedule_add_service(city_t origin, city_t destination)
+{
+  flight_time_t departure, arrival;
+  int capacity, first_day, last_day, weekdays;
+
+  if (!time_get(&departure) || !time_get(&arrival) || !flight_capacity_get(&capacity) ||
+      !date_get(&first_day) || !date_get(&last_day) || !weekdays_get(&weekdays)) {
+    return;
+  }
+  city_id_t from = city_intern(origin), to = city_intern(destination);
+  switch(flight_engine_add_service(from, to, departure, arrival, capacity, first_day,
+                                   last_day, weekdays)){
+  case FLIGHT_NO_CITY:
+  case FLIGHT_NO_FREE:
+    msg_schedule_no_free();
+    break;
+  case FLIGHT_BAD_CONNECTION:
+    msg_connection_bad();
+    break;
+  case FLIGHT_BAD_CALENDAR:
+    msg_calendar_bad();
+    break;
+  default:
+    break;
+  }
+  city_release(from); // the service holds them now if it was added
+  city_release(to);
+}
+
+/*Removes the (first) service from origin to destination leaving at the
+  time read by time get on the date read by date get, with its whole
+  calendar.*/
+void flight_schedule_remove_service(city_t origin, city_t destination)
+{
+  flight_time_t departure;
+  int day;
+
+  if (time_get(&departure) && date_get(&day) &&
+      flight_engine_remove_service(city_lookup(origin), city_lookup(destination),
+                                   departure, day) != FLIGHT_OK) {
+    msg_flight_bad_time();
+  }
+}
+
+/*Schedules a number of seats on the flight of a service on one date, or
+  with unbook gives them back, all or none.*/
+void flight_schedule_book_service(city_t origin, city_t destination, bool unbook)
+{
+  flight_time_t departure;
+  int day, count;
+  enum flight_status status;
+
+  if (!time_get(&departure) || !date_get(&day) || !seat_count_get(&count)) {
+    return;
+  }
+  if (unbook) {
+    status = flight_engine_unbook_service(city_lookup(origin), city_lookup(destination),
+                                          departure, day, count);
+  } else {
+    status = flight_engine_book_service(city_lookup(origin), city_lookup(destination),
+                                        departure, day, count);
+  }
+  switch(status){
+  case FLIGHT_NO_CITY:
+  case FLIGHT_BAD_TIME:
+    msg_flight_bad_time();
+    break;
+  case FLIGHT_NO_SEATS:
+    msg_flight_no_seats();
+    break;
+  case FLIGHT_ALL_EMPTY:
+    msg_flight_all_seats_empty();
+    break;
+  case FLIGHT_NO_FREE:
+    msg_schedule_no_free();
+    break;
+  default:
+    break;
+  }
+}
+
+/*Lists the services leaving a city on the date read by date get, in
+  departure order, with the seats left that day*/
+void flight_schedule_list_services(city_t origin)
+{
+  int day;
+
+  if (date_get(&day)) {
+    msg_services(origin, date_of_day(day));
+    flight_engine_for_each_service(city_lookup(origin), day, flight_schedule_list_service, NULL);
+    output_char('\n');
+  }
+}
+
+/*Prints one service of a service list*/
+void flight_schedule_list_service(const struct service *sv, int available, void *arg)
+{
+  (void)arg;
+  msg_connection_info(sv->departure, city_name(sv->destination), sv->arrival, available,
+                      sv->capacity);
+}
+
+/*Lists the seats of the bookings waiting on the flight to a city at
+  exactly the given time, first come first, and the seats booked over its
+  capacity.*/
+void flight_schedule_list_waitlist(city_t city)
+{
+  flight_time_t time;
+  int overbooked;
+  int seats[MAX_WAITLIST];
+  city_id_t id = city_lookup(city);
+
+  if(!flight_engine_exists(id)){
+    msg_city_bad(city);
+    return;
+  }
+
+  if (time_get(&time)){
+    int n = flight_engine_waitlist(id, time, &overbooked, seats, MAX_WAITLIST);
+    if (n < 0) {
+      msg_flight_bad_time();
+      return;
+    }
+    msg_waitlist(city, time, overbooked);
+    for (int i = 0; i < n; i++) {
+      msg_waitlist_entry(seats[i]);
+    }
+    output_char('\n');
+  }
+}
+
+
+/******************************************************************************
+ * Seat reservation engine                                                    *
+ *                                                                            *
+ * The same operations as the commands, but taking their arguments directly   *
+ * and returning a flight_status instead of printing.  They can be called     *
+ * from any number of threads at once, see flight_schedules_lock.             *
+ ******************************************************************************/
+
+/* Finds the schedule of a city and locks it for changing its flights.
+   Returns NULL if there is none.  Otherwise flight_schedules_lock stays
+   held shared until flight_engine_unlock_city. */
+struct flight_schedule * flight_engine_lock_city(city_id_t city)
+{
+  pthread_rwlock_rdlock(&flight_schedules_lock);
+  struct flight_schedule *fs = flight_schedule_find(city);
+  if (fs == NULL) {
+    pthread_rwlock_unlock(&flight_schedules_lock);
+    return NULL;
+  }
+  pthread_mutex_lock(&fs->lock);
+#if FLIGHT_STATS
+  fs->hits++;
+#endif
+  return fs;
+}
+
+/* Releases a schedule locked by flight_engine_lock_city */
+void flight_engine_unlock_city(struct flight_schedule *fs)
+{
+  pthread_mutex_unlock(&fs->lock);
+  pthread_rwlock_unlock(&flight_schedules_lock);
+}
+
+/* Returns true if city has a schedule */
+bool flight_engine_exists(city_id_t city)
+{
+  pthread_rwlock_rdlock(&flight_schedules_lock);
+  bool found = flight_schedule_find(city) != NULL;
+  pthread_rwlock_unlock(&flight_schedules_lock);
+  return found;
+}
+
+/* Adds an empty schedule for city.  The schedule is taken from the pool
+   and named before taking flight_schedules_lock, so the lock is only held
+   to link it in. */
+enum flight_status flight_engine_add(city_id_t city)
+{
+  if (city == CITY_NONE) return FLIGHT_NO_CITY;
+
+  struct flight_schedule *fs = flight_schedule_allocate();
+
+  if (fs == NULL) {
+    return flight_engine_exists(city) ? FLIGHT_CITY_EXISTS : FLIGHT_NO_FREE;
+  }
+  city_hold(city); // the schedule's, given back by flight_schedule_free
+  fs->city = city;
+
+  pthread_rwlock_wrlock(&flight_schedules_lock);
+  bool exists = flight_schedule_find(city) != NULL;
+  if (!exists) {
+    flight_schedule_activate(fs);
+    city_order_insert(city);
+    journal_log('A', city, 0, 0);
+  }
+  pthread_rwlock_unlock(&flight_schedules_lock);
+
+  if (exists) {
+    flight_schedule_free(fs);
+    return FLIGHT_CITY_EXISTS;
+  }
+  return FLIGHT_OK;
+}
+
+/* Removes the schedule of city with all its flights.  Once it is off the
+   active list no other thread can reach it, but for the views opened
+   before, which only read the flights it keeps for them, so it goes back
+   to the pool after dropping flight_schedules_lock. */
+enum flight_status flight_engine_remove(city_id_t city)
+{
+  pthread_rwlock_wrlock(&flight_schedules_lock);
+  struct flight_schedule *fs = flight_schedule_find(city);
+  if (fs != NULL) {
+    pthread_mutex_lock(&fs->lock); // views read it without flight_schedules_lock
+    view_preserve(fs);
+    pthread_mutex_unlock(&fs->lock);
+    flight_schedule_deactivate(fs);
+    journal_log('R', city, 0, 0);
+  }
+  pthread_rwlock_unlock(&flight_schedules_lock);
+
+  if (fs == NULL) return FLIGHT_NO_CITY;
+  flight_schedule_free(fs);
+  return FLIGHT_OK;
+}
+
+/* Calls visit for the destination of every schedule, in name order.
+   Schedules can't be added or removed until it returns. */
+void flight_engine_for_each_city(void (*visit)(city_id_t city, void *arg), void *arg)
+{
+  flight_engine_for_each_city_range(NULL, NULL, visit, arg);
+}
+
+/* Calls visit, in name order, for the destinations from the name from up
+   to but not including the name to.  Either may be NULL for no limit. */
+void flight_engine_for_each_city_range(const char *from, const char *to,
+                                       void (*visit)(city_id_t city, void *arg), void *arg)
+{
+  pthread_rwlock_rdlock(&flight_schedules_lock);
+  struct city_order_node *node;
+  for (node = (from != NULL) ? city_order_seek(from, NULL) : city_order_head[0];
+       node != NULL && (to == NULL || strcmp(city_name(node->city), to) < 0);
+       node = node->next[0]) {
+    visit(node->city, arg);
+  }
+  pthread_rwlock_unlock(&flight_schedules_lock);
+}
+
+/* Calls visit, in name order, for the destinations starting with prefix */
+void flight_engine_for_each_city_prefix(const char *prefix,
+                                        void (*visit)(city_id_t city, void *arg), void *arg)
+{
+  size_t len = strlen(prefix);
+
+  pthread_rwlock_rdlock(&flight_schedules_lock);
+  for (struct city_order_node *node = city_order_seek(prefix, NULL);
+       node != NULL && strncmp(city_name(node->city), prefix, len) == 0;
+       node = node->next[0]) {
+    visit(node->city, arg);
+  }
+  pthread_rwlock_unlock(&flight_schedules_lock);
+}
+
+/* Copies up to max of the flights of city, in time order, into flights.
+   Returns how many were copied, or -1 if city has no schedule. */
+int flight_engine_flights(city_id_t city, struct flight *flights, int max)
+{
+  struct flight_schedule *fs = flight_engine_lock_city(city);
+  if (fs == NULL) return -1;
+
+  int n = flight_schedule_copy(fs, flights, max);
+  flight_engine_unlock_city(fs);
+  return n;
+}
+
+/* Calls visit for every flight with seats left leaving from time from to
+   time to, both included, in time order and for the same minute in city
+   name order, until visit returns false.  The departure index gives the
+   cities of each minute, so the time taken depends on the flights found
+   rather than on the number of schedules.  Each schedule is locked while
+   its flights are visited; flights that fill up or get seats meanwhile
+   may be seen either way. */
+void flight_engine_for_each_departure(flight_time_t from, flight_time_t to,
+                                      bool (*visit)(const struct departure *d, void *arg),
+                                      void *arg)
+{
+  city_id_t *cities = NULL;
+  int max = 0;
+  bool more = true;
+
+  if (from < TIME_NULL) from = TIME_NULL;
+  if (to > TIME_MAX) to = TIME_MAX;
+  for (int b = departure_next(from - TIME_NULL); more && b <= to - TIME_NULL;
+       b = departure_next(b + 1)) {
+    int n = departure_cities(b, &cities, &max);
+    qsort(cities, n, sizeof(city_id_t), departure_compare);
+
+    struct departure d;
+    d.flight.time = b + TIME_NULL;
+    for (int c = 0; more && c < n; c++) {
+      struct flight_schedule *fs = flight_engine_lock_city(cities[c]);
+      if (fs == NULL) continue;
+
+      struct flight_lanes lanes = flight_schedule_lanes(fs);
+      d.city = cities[c];
+      for (int i = flight_schedule_lower_bound(fs, d.flight.time);
+           more && i < fs->n_flights && lanes.time[i] == d.flight.time; i++) {
+        if (lanes.available[i] == 0) continue;
+        d.flight.available = lanes.available[i];
+        d.flight.capacity = lanes.capacity[i];
+        more = visit(&d, arg);
+      }
+      flight_engine_unlock_city(fs);
+    }
+  }
+  free(cities);
+}
+
+/* Adds a flight at time with capacity seats, all available.  capacity
+   must be 1 to MAX_FLIGHT_CAPACITY. */
+enum flight_status flight_engine_add_flight(city_id_t city, flight_time_t time, int capacity)
+{
+  if (capacity < 1 || capacity > MAX_FLIGHT_CAPACITY) return FLIGHT_BAD_COUNT;
+
+  struct flight_schedule *fs = flight_engine_lock_city(city);
+  if (fs == NULL) return FLIGHT_NO_CITY;
+
+  if (!flight_schedule_reserve_flight(fs)) {
+    flight_engine_unlock_city(fs);
+    return FLIGHT_MAX_FLIGHTS;
+  }
+
+  // place it after any flights at the same time, shifting the later ones up
+  int i = flight_schedule_lower_bound(fs, time + 1);
+  view_preserve(fs);
+  flight_schedule_insert_flight(fs, i, time, capacity, capacity);
+  journal_log('a', city, time, capacity);
+
+  flight_engine_unlock_city(fs);
+  return FLIGHT_OK;
+}
+
+/* Removes the (first) flight of city leaving at time */
+enum flight_status flight_engine_remove_flight(city_id_t city, flight_time_t time)
+{
+  struct flight_schedule *fs = flight_engine_lock_city(city);
+  if (fs == NULL) return FLIGHT_NO_CITY;
+
+  enum flight_status status = FLIGHT_BAD_TIME;
+  int i = flight_schedule_lower_bound(fs, time);
+  if (i < fs->n_flights && flight_schedule_lanes(fs).time[i] == time) {
+    struct flight_waitlist **link = waitlist_find(fs, time);
+    view_preserve(fs);
+    if (waitlist_at(link, time) != NULL) {
+      waitlist_drop(link); // its bookings go with it
+    }
+    flight_schedule_delete_flight(fs, i);
+    journal_log('r', city, time, 0);
+    status = FLIGHT_OK;
+  }
+  flight_engine_unlock_city(fs);
+  return status;
+}
+
+/* Books a seat on the first flight of city leaving at or after time, if it
+   has one left, or puts it on the waitlist of that flight.  The time of
+   the flight booked or waited on goes in *booked unless booked is NULL. */
+enum flight_status flight_engine_book(city_id_t city, flight_time_t time, flight_time_t *booked)
+{
+  return flight_engine_book_seats(city, time, 1, false, booked);
+}
+
+/* Books count seats together on the first flight of city leaving at or
+   after time.  If it has fewer left they are booked over its capacity as
+   far as flight_overbook allows, otherwise the booking goes on its
+   waitlist (FLIGHT_WAITLISTED), see waitlist_book.  With spill the seats
+   it has not go on the flights after it in time order instead, passing
+   over the ones bookings wait on, or none if all of them together have
+   fewer left, and nothing waits; *booked is then the first flight
+   booked. */
+enum flight_status flight_engine_book_seats(city_id_t city, flight_time_t time, int count,
+                                            bool spill, flight_time_t *booked)
+{
+  if (count < 1) return FLIGHT_BAD_COUNT;
+
+  struct flight_schedule *fs = flight_engine_lock_city(city);
+  if (fs == NULL) return FLIGHT_NO_CITY;
+
+  enum flight_status status = flight_schedule_book_seats(fs, time, count, spill, booked);
+  flight_engine_unlock_city(fs);
+  return status;
+}
+
+/* Books a batch of n requests, storing the flight_status of requests[i] in
+   status[i].  The requests are grouped by schedule so each one is locked
+   once for all of its requests, which are then applied in the order
+   given.  Returns how many requests were booked. */
+int flight_engine_book_batch(const struct flight_booking *requests, int n, uint8_t *status)
+{
+  int booked = 0;
+
+  pthread_rwlock_rdlock(&flight_schedules_lock);
+  struct flight_booking_groups *g = flight_booking_groups(n);
+  if (g == NULL) { // without memory, one at a time
+    pthread_rwlock_unlock(&flight_schedules_lock);
+    for (int i = 0; i < n; i++) {
+      status[i] = flight_engine_book_seats(requests[i].city, requests[i].time,
+                                           requests[i].count, requests[i].spill, NULL);
+      booked += status[i] == FLIGHT_OK;
+    }
+    return booked;
+  }
+
+  // chain the requests of each schedule, noting the schedules in the
+  // order their first request comes
+  int n_schedules = 0;
+  for (int i = 0; i < n; i++) {
+    struct flight_schedule *fs = flight_schedule_find(requests[i].city);
+    if (fs == NULL) {
+      status[i] = FLIGHT_NO_CITY;
+      continue;
+    }
+    g->next[i] = -1;
+    if (g->first[fs->id] < 0) {
+      g->first[fs->id] = i;
+      g->schedules[n_schedules++] = fs;
+    } else {
+      g->next[g->last[fs->id]] = i;
+    }
+    g->last[fs->id] = i;
+  }
+
+  for (int k = 0; k < n_schedules; k++) {
+    struct flight_schedule *fs = g->schedules[k];
+    pthread_mutex_lock(&fs->lock);
+    for (int i = g->first[fs->id]; i >= 0; i = g->next[i]) {
+#if FLIGHT_STATS
+      fs->hits++;
+#endif
+      status[i] = (requests[i].count < 1) ? FLIGHT_BAD_COUNT :
+        flight_schedule_book_seats(fs, requests[i].time, requests[i].count,
+                                   requests[i].spill, NULL);
+      booked += status[i] == FLIGHT_OK;
+    }
+    pthread_mutex_unlock(&fs->lock);
+    g->first[fs->id] = -1;
+  }
+  pthread_rwlock_unlock(&flight_schedules_lock);
+  return booked;
+}
+
+pthread_key_t flight_booking_groups_of;   // the working space of each thread
+pthread_once_t flight_booking_groups_once = PTHREAD_ONCE_INIT;
+
+/* Returns the working space of the calling thread for a batch of n
+   requests, room for every schedule id handed out so far, NULL if there
+   is no memory for it.  It only grows, so it is allocated again just when
+   a batch is bigger or schedules were added.  The caller must hold
+   flight_schedules_lock. */
+struct flight_booking_groups * flight_booking_groups(int n)
+{
+  pthread_once(&flight_booking_groups_once, flight_booking_groups_key);
+  struct flight_booking_groups *g = pthread_getspecific(flight_booking_groups_of);
+  if (g == NULL) {
+    g = calloc(1, sizeof(*g));
+    if (g == NULL || pthread_setspecific(flight_booking_groups_of, g) != 0) {
+      free(g);
+      return NULL;
+    }
+  }
+
+  uint64_t ids = atomic_load(&flight_schedules_pool.carved);
+  if (ids > (uint64_t)MAX_SCHEDULE_ID + 1) ids = (uint64_t)MAX_SCHEDULE_ID + 1;
+  if (ids > g->max_ids) {
+    size_t max = g->max_ids ? g->max_ids : MIN_INDEX_SLOTS;
+    while (max < ids) {
+      max *= 2;
+    }
+    int32_t *first = realloc(g->first, max * sizeof(int32_t));
+    if (first != NULL) g->first = first;
+    int32_t *last = realloc(g->last, max * sizeof(int32_t));
+    if (last != NULL) g->last = last;
+    if (first == NULL || last == NULL) return NULL;
+    memset(&g->first[g->max_ids], -1, (max - g->max_ids) * sizeof(int32_t));
+    g->max_ids = max;
+  }
+  if (n > g->max_requests) {
+    int32_t *next = realloc(g->next, n * sizeof(int32_t));
+    if (next != NULL) g->next = next;
+    struct flight_schedule **schedules = realloc(g->schedules, n * sizeof(*schedules));
+    if (schedules != NULL) g->schedules = schedules;
+    if (next == NULL || schedules == NULL) return NULL;
+    g->max_requests = n;
+  }
+  return g;
+}
+
+/* Creates the key of the working space of each thread, freed as the
+   thread ends */
+void flight_booking_groups_key(void)
+{
+  pthread_key_create(&flight_booking_groups_of, flight_booking_groups_free);
+}
+
+/* Frees the working space of a thread that ends */
+void flight_booking_groups_free(void *groups)
+{
+  struct flight_booking_groups *g = groups;
+  free(g->first);
+  free(g->last);
+  free(g->next);
+  free(g->schedules);
+  free(g);
+}
+
+/* Books count seats on the first flight of a locked schedule leaving at or
+   after time, see flight_engine_book_seats.
+   The journal gets the time asked for rather than the flight booked:
+   replaying it from the same state books the same seats, or waits for
+   them, and a spilled booking is one record however many flights it
+   took. */
+enum flight_status flight_schedule_book_seats(struct flight_schedule *fs, flight_time_t time,
+                                              int count, bool spill, flight_time_t *booked)
+{
+  struct flight_lanes lanes = flight_schedule_lanes(fs);
+  int first = flight_schedule_lower_bound(fs, time); // the flight or the closest one after
+  int last = first;  // flights [first, last] take the seats
+  int left = count;  // seats not placed by flights before last
+
+  if (first >= fs->n_flights) return FLIGHT_NO_SEATS;
+  if (spill) {
+    // the seats of a flight with bookings waiting are theirs, so it counts
+    // as full
+    struct flight_waitlist *wl = fs->waitlists;
+    while (waitlist_waiting(&wl, lanes.time[first])) {
+      if (++first == fs->n_flights) return FLIGHT_NO_SEATS;
+    }
+    last = first;
+    while (waitlist_waiting(&wl, lanes.time[last]) || lanes.available[last] < left) {
+      if (!waitlist_waiting(&wl, lanes.time[last])) left -= lanes.available[last];
+      if (++last == fs->n_flights) return FLIGHT_NO_SEATS;
+    }
+  } else if (lanes.available[first] < count || fs->waitlists != NULL) {
+    // short of seats, or others may be waiting for them
+    enum flight_status status = waitlist_book(fs, first, count);
+    if (status != FLIGHT_NO_SEATS) {
+      if (booked != NULL) *booked = lanes.time[first];
+      journal_log('s', fs->city, time, count);
+    }
+    return status;
+  }
+
+  view_preserve(fs);
+  struct flight_waitlist *wl = fs->waitlists;
+  for (int i = first; i < last; i++) {
+    if (!waitlist_waiting(&wl, lanes.time[i])) flight_schedule_set_available(fs, i, 0);
+  }
+  flight_schedule_set_available(fs, last, lanes.available[last] - left);
+  if (booked != NULL) *booked = lanes.time[first];
+  journal_log(spill ? 'S' : 's', fs->city, time, count);
+  return FLIGHT_OK;
+}
+
+/* Gives back a seat on the flight of city leaving exactly at time */
+enum flight_status flight_engine_unbook(city_id_t city, flight_time_t time)
+{
+  return flight_engine_unbook_seats(city, time, 1);
+}
+
+/* Gives back count seats on the flight of city leaving exactly at time, or
+   none if fewer than count of its seats are booked.  Bookings waiting for
+   them get them, see waitlist_unbook. */
+enum flight_status flight_engine_unbook_seats(city_id_t city, flight_time_t time, int count)
+{
+  if (count < 1) return FLIGHT_BAD_COUNT;
+
+  struct flight_schedule *fs = flight_engine_lock_city(city);
+  if (fs == NULL) return FLIGHT_NO_CITY;
+
+  enum flight_status status = FLIGHT_BAD_TIME;
+  struct flight_lanes lanes = flight_schedule_lanes(fs);
+  int i = flight_schedule_lower_bound(fs, time);
+  if (i < fs->n_flights && lanes.time[i] == time) {
+    struct flight_waitlist *wl = waitlist_at(waitlist_find(fs, time), time);
+    int overbooked = (wl != NULL) ? wl->overbooked : 0;
+    if (lanes.capacity[i] - lanes.available[i] + overbooked >= count) {
+      view_preserve(fs);
+      if (wl == NULL) {
+        flight_schedule_set_available(fs, i, lanes.available[i] + count);
+      } else {
+        waitlist_unbook(fs, i, count);
+      }
+      journal_log('u', city, time, count);
+      status = FLIGHT_OK;
+    } else {
+      status = FLIGHT_ALL_EMPTY;
+    }
+  }
+  flight_engine_unlock_city(fs);
+  return status;
+}
+
+/* Copies the seats of the first max bookings waiting on the flight of city
+   leaving exactly at time, in the order they came, to seats and the seats
+   booked over its capacity to *overbooked.  Returns how many bookings
+   wait, or -1 if there is no such flight. */
+int flight_engine_waitlist(city_id_t city, flight_time_t time, int *overbooked,
+                           int *seats, int max)
+{
+  struct flight_schedule *fs = flight_engine_lock_city(city);
+  if (fs == NULL) return -1;
+
+  int n = -1;
+  int i = flight_schedule_lower_bound(fs, time);
+  if (i < fs->n_flights && flight_schedule_lanes(fs).time[i] == time) {
+    struct flight_waitlist *wl = waitlist_at(waitlist_find(fs, time), time);
+    *overbooked = 0;
+    n = 0;
+    if (wl != NULL) {
+      *overbooked = wl->overbooked;
+      n = wl->n;
+      for (int k = 0; k < n && k < max; k++) {
+        seats[k] = wl->seats[(wl->head + k) & (wl->max - 1)];
+      }
+    }
+  }
+  flight_engine_unlock_city(fs);
+  return n;
+}
+
+/* Adds a connection from origin to destination with capacity seats, all
+   available.  It has to leave from TIME_MIN on and arrive by TIME_MAX,
+   not before it leaves. */
+enum flight_status flight_engine_add_connection(city_id_t origin, city_id_t destination,
+                                                flight_time_t departure, flight_time_t arrival,
+                                                int capacity)
+{
+  if (origin == CITY_NONE || destination == CITY_NONE) return FLIGHT_NO_CITY;
+  if (capacity < 1 || capacity > MAX_FLIGHT_CAPACITY) return FLIGHT_BAD_COUNT;
+  if (origin == destination || departure < TIME_MIN || arrival < departure ||
+      arrival > TIME_MAX) {
+    return FLIGHT_BAD_CONNECTION;
+  }
+
+  struct connection c = {destination, departure, arrival, capacity, capacity};
+  pthread_rwlock_wrlock(&connections_lock);
+  bool ok = connection_insert(origin, &c);
+  if (ok) {
+    journal_log_connection('g', origin, destination, departure, arrival, capacity);
+  }
+  pthread_rwlock_unlock(&connections_lock);
+  return ok ? FLIGHT_OK : FLIGHT_NO_FREE;
+}
+
+/* Removes the (first) connection from origin to destination leaving at
+   departure */
+enum flight_status flight_engine_remove_connection(city_id_t origin, city_id_t destination,
+                                                   flight_time_t departure)
+{
+  enum flight_status status = FLIGHT_BAD_TIME;
+
+  pthread_rwlock_wrlock(&connections_lock);
+  struct connection_list *list = connection_list_of(origin);
+  int i = connection_find(list, destination, departure);
+  if (i >= 0) {
+    journal_log_connection('G', origin, destination, departure,
+                           list->connections[i].arrival, 0);
+    connection_delete(list, i);
+    status = FLIGHT_OK;
+  }
+  pthread_rwlock_unlock(&connections_lock);
+  return status;
+}
+
+/* Books count seats on the connection from origin to destination leaving
+   at departure, or none if it has fewer left */
+enum flight_status flight_engine_book_connection(city_id_t origin, city_id_t destination,
+                                                 flight_time_t departure, int count)
+{
+  if (count < 1) return FLIGHT_BAD_COUNT;
+
+  enum flight_status status = FLIGHT_BAD_TIME;
+
+  pthread_rwlock_wrlock(&connections_lock);
+  struct connection_list *list = connection_list_of(origin);
+  int i = connection_find(list, destination, departure);
+  if (i >= 0) {
+    struct connection *c = &list->connections[i];
+    if (c->available >= count) {
+      c->available -= count;
+      journal_log_connection('k', origin, destination, departure, c->arrival, count);
+      status = FLIGHT_OK;
+    } else {
+      status = FLIGHT_NO_SEATS;
+    }
+  }
+  pthread_rwlock_unlock(&connections_lock);
+  return status;
+}
+
+/* Gives back count seats on the connection from origin to destination
+   leaving at departure, or none if fewer than count of its seats are
+   booked */
+enum flight_status flight_engine_unbook_connection(city_id_t origin, city_id_t destination,
+                                                   flight_time_t departure, int count)
+{
+  if (count < 1) return FLIGHT_BAD_COUNT;
+
+  enum flight_status status = FLIGHT_BAD_TIME;
+
+  pthread_rwlock_wrlock(&connections_lock);
+  struct connection_list *list = connection_list_of(origin);
+  int i = connection_find(list, destination, departure);
+  if (i >= 0) {
+    struct connection *c = &list->connections[i];
+    if (c->capacity - c->available >= count) {
+      c->available += count;
+      journal_log_connection('K', origin, destination, departure, c->arrival, count);
+      status = FLIGHT_OK;
+    } else {
+      status = FLIGHT_ALL_EMPTY;
+    }
+  }
+  pthread_rwlock_unlock(&connections_lock);
+  return status;
+}
+
+/* Calls visit for every connection leaving origin, in departure order.
+   Connections can't change until it returns. */
+void flight_engine_for_each_connection(city_id_t origin,
+                                       void (*visit)(const struct connection *c, void *arg),
+                                       void *arg)
+{
+  pthread_rwlock_rdlock(&connections_lock);
+  struct connection_list *list = connection_list_of(origin);
+  for (uint32_t i = 0; list != NULL && i < list->n; i++) {
+    visit(&list->connections[i], arg);
+  }
+  pthread_rwlock_unlock(&connections_lock);
+}
+
+/* Finds the flights that get a traveller from home to destination the
+   earliest, leaving at or after time and arriving by deadline: a schedule
+   flight to some city, then any number of connections, each leaving
+   connection_minutes or more after the one before arrives.  Only flights
+   with seats left are taken.  Schedule flights are taken to arrive when
+   they leave, as the schedules have no flight times.
+   The search is Dijkstra's over arrival times.  The schedule flights come
+   in departure order from the departure index, minute by minute, and are
+   merged with the cities taken off the heap; from a city only the
+   connections after the earliest arrival there can be taken, a tail of
+   its list.  It stops as soon as nothing left can arrive before the
+   destination is reached, so the time taken depends on the part of the
+   network reached by then, not on all of it.
+   The legs found are copied, in order, to *legs, which is grown as needed
+   and holds *max of them.  Returns how many there are, 0 if there is no
+   way to get there in time. */
+int flight_engine_itinerary(city_id_t destination, flight_time_t time, flight_time_t deadline,
+                            struct itinerary_leg **legs, int *max)
+{
+  struct itinerary_search s = {NULL, NULL, NULL, 0, 0};
+  city_id_t *home = NULL;
+  int max_home = 0;
+
+  pthread_rwlock_rdlock(&cities.lock);
+  uint32_t n_cities = cities.n; // names interned later are not reached
+  pthread_rwlock_unlock(&cities.lock);
+
+  if (time < TIME_MIN) time = TIME_MIN;
+  if (deadline > TIME_MAX) deadline = TIME_MAX;
+  if (destination >= n_cities || time > deadline) return 0;
+
+  s.arrival = malloc(n_cities * sizeof(*s.arrival));
+  s.via = malloc(n_cities * sizeof(*s.via));
+  if (s.arrival == NULL || s.via == NULL) {
+    output_str("ERROR: Out of memory for the itinerary search.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t c = 0; c < n_cities; c++) {
+    s.arrival[c] = TIME_PAD;
+  }
+
+  pthread_rwlock_rdlock(&connections_lock);
+  int bucket = departure_next(time - TIME_NULL);
+  while (true) {
+    flight_time_t next_home = (bucket <= deadline - TIME_NULL) ? bucket + TIME_NULL : TIME_PAD;
+    flight_time_t next_city = (s.n_heap > 0) ? (flight_time_t)(s.heap[0] >> 32) : TIME_PAD;
+    if (next_home >= s.arrival[destination] && next_city >= s.arrival[destination]) {
+      break; // found, or no way at all when both are TIME_PAD
+    }
+
+    if (next_home <= next_city) {
+      // fly from home to the cities with seats left in this minute
+      int n = departure_cities(bucket, &home, &max_home);
+      for (int i = 0; i < n; i++) {
+        city_id_t c = home[i];
+        if (c < n_cities && next_home < s.arrival[c]) {
+          s.arrival[c] = next_home;
+          s.via[c] = (struct itinerary_leg){CITY_NONE, c, next_home, next_home};
+          itinerary_push(&s, next_home, c);
+        }
+      }
+      bucket = departure_next(bucket + 1);
+      continue;
+    }
+
+    uint64_t top = itinerary_pop(&s);
+    city_id_t from = (uint32_t)top;
+    if ((flight_time_t)(top >> 32) != s.arrival[from]) continue; // arrived earlier since
+
+    struct connection_list *list = connection_list_of(from);
+    if (list == NULL) continue;
+    for (int i = connection_lower_bound(list, s.arrival[from] + connection_minutes);
+         i < (int)list->n && list->connections[i].departure <= deadline; i++) {
+      const struct connection *c = &list->connections[i];
+      if (c->available == 0 || c->arrival > deadline || c->destination >= n_cities ||
+          c->arrival >= s.arrival[c->destination]) {
+        continue;
+      }
+      s.arrival[c->destination] = c->arrival;
+      s.via[c->destination] = (struct itinerary_leg){from, c->destination, c->departure,
+                                                     c->arrival};
+      itinerary_push(&s, c->arrival, c->destination);
+    }
+  }
+  pthread_rwlock_unlock(&connections_lock);
+
+  // walk back from the destination to the flight leaving home
+  int n = 0;
+  if (s.arrival[destination] != TIME_PAD) {
+    for (city_id_t c = destination; c != CITY_NONE; c = s.via[c].origin) {
+      n++;
+    }
+    if (n > *max) {
+      free(*legs);
+      *max = n;
+      *legs = malloc(n * sizeof(struct itinerary_leg));
+      if (*legs == NULL) {
+        output_str("ERROR: Out of memory for the itinerary search.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    int i = n;
+    for (city_id_t c = destination; c != CITY_NONE; c = s.via[c].origin) {
+      (*legs)[--i] = s.via[c];
+    }
+  }
+
+  free(home);
+  free(s.arrival);
+  free(s.via);
+  free(s.heap);
+  return n;
+}
+
+
+/* Adds a service from origin to destination with capacity seats on each
+   day it operates: the days from first_day to last_day that fall on the
+   weekdays set in weekdays (bit 0 Monday to bit 6 Sunday).  The times
+   are checked like those of a connection. */
+enum flight_status flight_engine_add_service(city_id_t origin, city_id_t destination,
+                                             flight_time_t departure, flight_time_t arrival,
+                                             int capacity, int first_day, int last_day,
+                                             int weekdays)
+{
+  if (origin == CITY_NONE || destination == CITY_NONE) return FLIGHT_NO_CITY;
+  if (capacity < 1 || capacity > MAX_FLIGHT_CAPACITY) return FLIGHT_BAD_COUNT;
+  if (origin == destination || departure < TIME_MIN || arrival < departure ||
+      arrival > TIME_MAX) {
+    return FLIGHT_BAD_CONNECTION;
+  }
+
+  struct service sv = {.destination = destination, .departure = departure,
+                       .arrival = arrival, .capacity = capacity};
+  if (!service_calendar(&sv, first_day, last_day, weekdays)) {
+    return sv.n_days == 0 ? FLIGHT_BAD_CALENDAR : FLIGHT_NO_FREE;
+  }
+
+  pthread_rwlock_wrlock(&services_lock);
+  bool ok = service_insert(origin, &sv);
+  if (ok) {
+    journal_log_service_add(origin, destination, departure, arrival, capacity,
+                            first_day, last_day, weekdays);
+  }
+  pthread_rwlock_unlock(&services_lock);
+
+  if (!ok) service_free(&sv);
+  return ok ? FLIGHT_OK : FLIGHT_NO_FREE;
+}
+
+/* Removes the (first) service from origin to destination leaving at
+   departure that operates on day, for all of its days */
+enum flight_status flight_engine_remove_service(city_id_t origin, city_id_t destination,
+                                                flight_time_t departure, int day)
+{
+  enum flight_status status = FLIGHT_BAD_TIME;
+
+  pthread_rwlock_wrlock(&services_lock);
+  struct service_list *list = service_list_of(origin);
+  int i = service_find(list, destination, departure, day);
+  if (i >= 0) {
+    service_delete(list, i);
+    journal_log_service('V', origin, destination, departure, day, 0);
+    status = FLIGHT_OK;
+  }
+  pthread_rwlock_unlock(&services_lock);
+  return status;
+}
+
+/* Books count seats on the flight of day of the service from origin to
+   destination leaving at departure, or none if it has fewer left.  The
+   first booking of a day is what starts tracking its seats. */
+enum flight_status flight_engine_book_service(city_id_t origin, city_id_t destination,
+                                              flight_time_t departure, int day, int count)
+{
+  if (count < 1) return FLIGHT_BAD_COUNT;
+
+  enum flight_status status = FLIGHT_BAD_TIME;
+
+  pthread_rwlock_wrlock(&services_lock);
+  struct service_list *list = service_list_of(origin);
+  int i = service_find(list, destination, departure, day);
+  if (i >= 0) {
+    struct service *sv = &list->services[i];
+    int d = service_date_lower_bound(sv, day);
+    bool found = d < sv->n_dates && sv->dates[d].day == day;
+    int booked = found ? sv->dates[d].booked : 0;
+
+    if (sv->capacity - booked < count) {
+      status = FLIGHT_NO_SEATS;
+    } else if (!found && !service_date_insert(sv, d, day)) {
+      status = FLIGHT_NO_FREE;
+    } else {
+      sv->dates[d].booked += count;
+      journal_log_service('y', origin, destination, departure, day, count);
+      status = FLIGHT_OK;
+    }
+  }
+  pthread_rwlock_unlock(&services_lock);
+  return status;
+}
+
+/* Gives back count seats on the flight of day of the service from origin
+   to destination leaving at departure, or none if fewer than count of its
+   seats are booked.  A day with no seats booked any more stops being
+   tracked. */
+enum flight_status flight_engine_unbook_service(city_id_t origin, city_id_t destination,
+                                                flight_time_t departure, int day, int count)
+{
+  if (count < 1) return FLIGHT_BAD_COUNT;
+
+  enum flight_status status = FLIGHT_BAD_TIME;
+
+  pthread_rwlock_wrlock(&services_lock);
+  struct service_list *list = service_list_of(origin);
+  int i = service_find(list, destination, departure, day);
+  if (i >= 0) {
+    struct service *sv = &list->services[i];
+    int d = service_date_lower_bound(sv, day);
+    if (d < sv->n_dates && sv->dates[d].day == day && sv->dates[d].booked >= count) {
+      sv->dates[d].booked -= count;
+      if (sv->dates[d].booked == 0) {
+        service_date_delete(sv, d);
+      }
+      journal_log_service('Y', origin, destination, departure, day, count);
+      status = FLIGHT_OK;
+    } else {
+      status = FLIGHT_ALL_EMPTY;
+    }
+  }
+  pthread_rwlock_unlock(&services_lock);
+  return status;
+}
+
+/* Calls visit for every service leaving origin that operates on day, in
+   departure order, with the seats it has left that day.  Services can't
+   change until it returns. */
+void flight_engine_for_each_service(city_id_t origin, int day,
+                                    void (*visit)(const struct service *sv, int available,
+                                                  void *arg),
+                                    void *arg)
+{
+  pthread_rwlock_rdlock(&services_lock);
+  struct service_list *list = service_list_of(origin);
+  for (uint32_t i = 0; list != NULL && i < list->n; i++) {
+    const struct service *sv = &list->services[i];
+    if (service_operates(sv, day)) {
+      visit(sv, sv->capacity - service_booked(sv, day), arg);
+    }
+  }
+  pthread_rwlock_unlock(&services_lock);
+}
+
+/* Opens a read view of the schedules whose city name starts with prefix,
+   "" for all, see struct flight_view.  With flights, their flights can
+   then be read as they were at this moment with flight_engine_view_flights
+   until the view is closed.  Without, it only holds the cities and costs
+   changes nothing.  flight_schedules_lock is held shared while the cities
+   are copied, so only adding and removing schedules wait for it.
+   Returns NULL if there is no memory for it. */
+struct flight_view * flight_engine_view_open(const char *prefix, bool flights)
+{
+  struct flight_view *view = malloc(sizeof(*view));
+  if (view == NULL) return NULL;
+  view->epoch = 0;
+  view->n = 0;
+  view->cities = NULL;
+
+  size_t len = strlen(prefix), max = 0;
+  bool ok = true;
+
+  pthread_rwlock_rdlock(&flight_schedules_lock);
+  for (struct city_order_node *node = city_order_seek(prefix, NULL);
+       ok && node != NULL && strncmp(city_name(node->city), prefix, len) == 0;
+       node = node->next[0]) {
+    if (view->n == max) {
+      max = max ? 2 * max : MIN_INDEX_SLOTS;
+      struct flight_view_city *bigger = realloc(view->cities, max * sizeof(*bigger));
+      if (bigger == NULL) {
+        ok = false;
+        break;
+      }
+      view->cities = bigger;
+    }
+    city_hold(node->city); // the name outlives the schedule in the view
+    view->cities[view->n].city = node->city;
+    view->cities[view->n].fs = flight_schedule_find(node->city);
+    view->n++;
+  }
+  // under the same lock, so the view has the cities of its epoch
+  if (ok && flights) {
+    ok = view_register(view);
+  }
+  pthread_rwlock_unlock(&flight_schedules_lock);
+
+  if (!ok) {
+    for (size_t i = 0; i < view->n; i++) {
+      city_release(view->cities[i].city);
+    }
+    free(view->cities);
+    free(view);
+    return NULL;
+  }
+  return view;
+}
+
+/* Closes a view opened by flight_engine_view_open and frees it */
+void flight_engine_view_close(struct flight_view *view)
+{
+  if (view->epoch != 0) {
+    view_unregister(view);
+  }
+  for (size_t i = 0; i < view->n; i++) {
+    city_release(view->cities[i].city);
+  }
+  free(view->cities);
+  free(view);
+}
+
+/* Copies up to max of the flights of schedule i of a view opened with
+   flights, in time order, as they were when the view was opened, into
+   flights.  Returns how many were copied.  Only the lock of the schedule
+   is taken, just for the copy. */
+int flight_engine_view_flights(const struct flight_view *view, size_t i,
+                               struct flight *flights, int max)
+{
+  struct flight_schedule *fs = view->cities[i].fs;
+  const struct flight_view_state *vs = flight_schedule_views(fs);
+  int n;
+
+  pthread_mutex_lock(&fs->lock);
+  if (vs->stamp < view->epoch) {
+    n = flight_schedule_copy(fs, flights, max); // not changed since
+  } else {
+    const struct flight_version *v = vs->versions;
+    while (v != NULL && v->from >= view->epoch) {
+      v = v->older;
+    }
+    assert(v != NULL && view->epoch <= v->to);
+    n = v->n_flights < max ? v->n_flights : max;
+    memcpy(flights, v->flights, n * sizeof(struct flight));
+  }
+  pthread_mutex_unlock(&fs->lock);
+  return n;
+}
+
+
+/******************************************************************************
+ * Snapshots                                                                  *
+ ******************************************************************************/
+
+/*Saves all schedules to a snapshot file, see struct snapshot_header*/
+void flight_schedule_save(char *path)
+{
+  if(!server_file(output.client, path)){
+    msg_file_refused();
+  } else if(!flight_engine_save(path)){
+    msg_snapshot_save_failed(path);
+  }
+}
+
+/*Replaces all schedules with the ones saved in a snapshot file.  If the
+  file can't be read or is not a valid snapshot nothing changes.*/
+void flight_schedule_load(char *path)
+{
+  if(!server_file(output.client, path)){
+    msg_file_refused();
+  } else if(!flight_engine_load(path)){
+    msg_snapshot_load_failed(path);
+  }
+}
+
+/*Moves the cities a shard added to the ones there are would take, with
+  the count of shards after it on the next line, to a snapshot file (see
+  flight_engine_export).  The router sends it to each shard as
+  "X file\n<shards>" when adding one.*/
+void flight_schedule_export(char *path)
+{
+  int shards = 0;
+
+  if (!int_get(&shards) || shards < 2 || shards > MAX_SHARDS) {
+    msg_shard_bad();
+    return;
+  }
+  if (!server_file(output.client, path)) {
+    msg_file_refused();
+    return;
+  }
+  struct shard_ring *ring = shard_ring_new(shards);
+  if(!flight_engine_export(path, shard_moves, ring)){
+    msg_snapshot_export_failed(path);
+  }
+  free(ring);
+}
+
+/* Writes every schedule and its flights, the connections and the services
+   to path.
+   The file is written under a temporary name and renamed over path when
+   complete, so path always holds a whole snapshot.  Bookings wait while it
+   is written, so the snapshot is consistent.  If path is the snapshot a
+   restart starts from, the journal is emptied once it is safely on disk.
+   Returns false if it can't be written. */
+bool flight_engine_save(const char *path)
+{
+  pthread_rwlock_wrlock(&flight_schedules_lock);
+  pthread_rwlock_rdlock(&connections_lock);
+  pthread_rwlock_rdlock(&services_lock);
+
+  bool ok = snapshot_write(path, NULL, NULL);
+  if (ok && journal_snapshot(path)) {
+    journal_reset(); // the snapshot has every change logged so far
+  }
+
+  pthread_rwlock_unlock(&services_lock);
+  pthread_rwlock_unlock(&connections_lock);
+  pthread_rwlock_unlock(&flight_schedules_lock);
+  return ok;
+}
+
+/* Writes the schedules of the cities that move, and the connections and
+   services leaving them, to a snapshot at path, then removes them here.
+   The removals are journaled like R, G and V commands, so a restart
+   replaying the journal does not bring them back.  Returns false, moving
+   nothing, if the snapshot can't be written. */
+bool flight_engine_export(const char *path, bool (*moves)(city_id_t city, void *arg),
+                          void *arg)
+{
+  pthread_rwlock_wrlock(&flight_schedules_lock);
+  pthread_rwlock_wrlock(&connections_lock);
+  pthread_rwlock_wrlock(&services_lock);
+
+  bool ok = snapshot_write(path, moves, arg);
+  if (ok) {
+    struct flight_schedule *fs = flight_schedules_active;
+    while (fs != NULL) {
+      struct flight_schedule *next = flight_schedule_link(fs->next);
+      if (moves(fs->city, arg)) {
+        pthread_mutex_lock(&fs->lock); // views read it without flight_schedules_lock
+        view_preserve(fs);
+        pthread_mutex_unlock(&fs->lock);
+        flight_schedule_deactivate(fs);
+        journal_log('R', fs->city, 0, 0);
+        flight_schedule_free(fs);
+      }
+      fs = next;
+    }
+
+    // from the front of each list, so replaying the journal removes the
+    // same ones
+    for (size_t origin = 0; origin < connections_by_city_max; origin++) {
+      struct connection_list *list = &connections_by_city[origin];
+      while (list->n > 0 && moves(origin, arg)) {
+        const struct connection *c = &list->connections[0];
+        journal_log_connection('G', origin, c->destination, c->departure, c->arrival, 0);
+        connection_delete(list, 0);
+      }
+    }
+    for (size_t origin = 0; origin < services_by_city_max; origin++) {
+      struct service_list *list = &services_by_city[origin];
+      while (list->n > 0 && moves(origin, arg)) {
+        const struct service *sv = &list->services[0];
+        journal_log_service('V', origin, sv->destination, sv->departure, sv->first_day, 0);
+        service_delete(list, 0);
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&services_lock);
+  pthread_rwlock_unlock(&connections_lock);
+  pthread_rwlock_unlock(&flight_schedules_lock);
+  return ok;
+}
+
+/* Writes the schedules of the cities keep is true for, or of all of them
+   if it is NULL, and the connections and services leaving them to path.
+   The file is written under a temporary name and renamed over path when
+   complete, so path always holds a whole snapshot.  The caller holds all
+   three locks, flight_schedules_lock exclusive.  Returns false if it can't
+   be written. */
+bool snapshot_write(const char *path, bool (*keep)(city_id_t city, void *arg), void *arg)
+{
+  char tmp[MAX_PATH_LEN+5];
+  struct snapshot_header header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0, 0};
+  struct flight_schedule *fs, *last = NULL;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *file = fopen(tmp, "wb");
+  if (file == NULL) return false;
+
+  for (fs = flight_schedules_active; fs != NULL; fs = flight_schedule_link(fs->next)) {
+    if (keep == NULL || keep(fs->city, arg)) {
+      header.n_schedules++;
+      header.n_flights += fs->n_flights;
+    }
+    last = fs;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+  // oldest first, so loading them in order gives back the same list
+  for (fs = last; ok && fs != NULL; fs = flight_schedule_link(fs->prev)) {
+    if (keep != NULL && !keep(fs->city, arg)) continue;
+    struct snapshot_schedule record;
+    memset(&record, 0, sizeof(record));
+    strcpy(record.destination, city_name(fs->city));
+    record.n_flights = fs->n_flights;
+    ok = fwrite(&record, sizeof(record), 1, file) == 1;
+  }
+  for (fs = last; ok && fs != NULL; fs = flight_schedule_link(fs->prev)) {
+    if (keep != NULL && !keep(fs->city, arg)) continue;
+    struct flight_lanes lanes = flight_schedule_lanes(fs);
+    for (int i = 0; ok && i < fs->n_flights; i++) {
+      struct snapshot_flight record = {lanes.time[i], lanes.available[i],
+                                       lanes.capacity[i]};
+      ok = fwrite(&record, sizeof(record), 1, file) == 1;
+    }
+  }
+
+  // the connections and services of the cities kept, counted first
+  uint64_t n_connections = 0, n_services = 0, n_words = 0, n_dates = 0;
+  for (size_t origin = 0; origin < connections_by_city_max; origin++) {
+    if (connections_by_city[origin].n > 0 && (keep == NULL || keep(origin, arg))) {
+      n_connections += connections_by_city[origin].n;
+    }
+  }
+  for (size_t origin = 0; origin < services_by_city_max; origin++) {
+    if (services_by_city[origin].n == 0 || (keep != NULL && !keep(origin, arg))) continue;
+    n_services += services_by_city[origin].n;
+    for (uint32_t i = 0; i < services_by_city[origin].n; i++) {
+      n_words += (services_by_city[origin].services[i].n_days + 63) / 64;
+      n_dates += services_by_city[origin].services[i].n_dates;
+    }
+  }
+
+  ok = ok && fwrite(&n_connections, sizeof(n_connections), 1, file) == 1;
+  for (size_t origin = 0; ok && origin < connections_by_city_max; origin++) {
+    struct connection_list *list = &connections_by_city[origin];
+    if (keep != NULL && list->n > 0 && !keep(origin, arg)) continue;
+    for (uint32_t i = 0; ok && i < list->n; i++) {
+      const struct connection *c = &list->connections[i];
+      struct snapshot_connection record;
+      memset(&record, 0, sizeof(record));
+      strcpy(record.origin, city_name(origin));
+      strcpy(record.destination, city_name(c->destination));
+      record.departure = c->departure;
+      record.arrival = c->arrival;
+      record.available = c->available;
+      record.capacity = c->capacity;
+      ok = fwrite(&record, sizeof(record), 1, file) == 1;
+    }
+  }
+
+  // the services, then all their calendars, then all their booked dates
+  ok = ok && fwrite(&n_services, sizeof(n_services), 1, file) == 1;
+  for (size_t origin = 0; ok && origin < services_by_city_max; origin++) {
+    if (keep != NULL && services_by_city[origin].n > 0 && !keep(origin, arg)) continue;
+    for (uint32_t i = 0; ok && i < services_by_city[origin].n; i++) {
+      const struct service *sv = &services_by_city[origin].services[i];
+      struct snapshot_service record;
+      memset(&record, 0, sizeof(record));
+      strcpy(record.origin, city_name(origin));
+      strcpy(record.destination, city_name(sv->destination));
+      record.departure = sv->departure;
+      record.arrival = sv->arrival;
+      record.capacity = sv->capacity;
+      record.first_day = sv->first_day;
+      record.n_days = sv->n_days;
+      record.n_dates = sv->n_dates;
+      ok = fwrite(&record, sizeof(record), 1, file) == 1;
+    }
+  }
+  ok = ok && fwrite(&n_words, sizeof(n_words), 1, file) == 1;
+  for (size_t origin = 0; ok && origin < services_by_city_max; origin++) {
+    if (keep != NULL && services_by_city[origin].n > 0 && !keep(origin, arg)) continue;
+    for (uint32_t i = 0; ok && i < services_by_city[origin].n; i++) {
+      const struct service *sv = &services_by_city[origin].services[i];
+      size_t words = (sv->n_days + 63) / 64;
+      ok = fwrite(service_words(sv), sizeof(uint64_t), words, file) == words;
+    }
+  }
+  ok = ok && fwrite(&n_dates, sizeof(n_dates), 1, file) == 1;
+  for (size_t origin = 0; ok && origin < services_by_city_max; origin++) {
+    if (keep != NULL && services_by_city[origin].n > 0 && !keep(origin, arg)) continue;
+    for (uint32_t i = 0; ok && i < services_by_city[origin].n; i++) {
+      const struct service *sv = &services_by_city[origin].services[i];
+      for (int d = 0; ok && d < sv->n_dates; d++) {
+        struct snapshot_date record = {sv->dates[d].day, sv->dates[d].booked};
+        ok = fwrite(&record, sizeof(record), 1, file) == 1;
+      }
+    }
+  }
+
+  // the waitlists of the schedules kept, then the seats of their bookings
+  uint64_t n_waitlists = 0, n_waiting = 0;
+  struct flight_waitlist *wl;
+  for (fs = last; fs != NULL; fs = flight_schedule_link(fs->prev)) {
+    if (keep != NULL && !keep(fs->city, arg)) continue;
+    for (wl = fs->waitlists; wl != NULL; wl = wl->next) {
+      n_waitlists++;
+      n_waiting += wl->n;
+    }
+  }
+  ok = ok && fwrite(&n_waitlists, sizeof(n_waitlists), 1, file) == 1;
+  for (fs = last; ok && fs != NULL; fs = flight_schedule_link(fs->prev)) {
+    if (keep != NULL && !keep(fs->city, arg)) continue;
+    for (wl = fs->waitlists; ok && wl != NULL; wl = wl->next) {
+      struct snapshot_waitlist record;
+      memset(&record, 0, sizeof(record));
+      strcpy(record.destination, city_name(fs->city));
+      record.time = wl->time;
+      record.overbooked = wl->overbooked;
+      record.n_waiting = wl->n;
+      ok = fwrite(&record, sizeof(record), 1, file) == 1;
+    }
+  }
+  ok = ok && fwrite(&n_waiting, sizeof(n_waiting), 1, file) == 1;
+  for (fs = last; ok && fs != NULL; fs = flight_schedule_link(fs->prev)) {
+    if (keep != NULL && !keep(fs->city, arg)) continue;
+    for (wl = fs->waitlists; ok && wl != NULL; wl = wl->next) {
+      for (int k = 0; ok && k < wl->n; k++) {
+        int32_t seats = wl->seats[(wl->head + k) & (wl->max - 1)];
+        ok = fwrite(&seats, sizeof(seats), 1, file) == 1;
+      }
+    }
+  }
+
+  // the journal has every change up to now, a part of the state moving
+  // elsewhere belongs to no journal
+  pthread_mutex_lock(&journal.lock);
+  uint64_t seq = (keep == NULL && journal.fd >= 0) ? journal.seq : 0;
+  pthread_mutex_unlock(&journal.lock);
+  ok = ok && fwrite(&seq, sizeof(seq), 1, file) == 1;
+
+  // the records of the schedules kept, numbered as written above, in the
+  // sorted order
+  uint64_t ids = atomic_load(&flight_schedules_pool.carved);
+  if (ids > (uint64_t)MAX_SCHEDULE_ID + 1) ids = (uint64_t)MAX_SCHEDULE_ID + 1;
+  uint32_t *record_of = malloc((ids + 1) * sizeof(uint32_t)); // by schedule id
+  uint32_t n_order = 0;
+  ok = ok && record_of != NULL;
+  for (fs = last; ok && fs != NULL; fs = flight_schedule_link(fs->prev)) {
+    if (keep == NULL || keep(fs->city, arg)) record_of[fs->id] = n_order++;
+  }
+  uint64_t n = n_order;
+  ok = ok && fwrite(&n, sizeof(n), 1, file) == 1;
+  for (struct city_order_node *node = city_order_head[0]; ok && node != NULL;
+       node = node->next[0]) {
+    if (keep != NULL && !keep(node->city, arg)) continue;
+    ok = fwrite(&record_of[flight_schedule_find(node->city)->id], sizeof(uint32_t), 1,
+                file) == 1;
+  }
+  free(record_of);
+
+  ok = (fflush(file) == 0) && (fsync(fileno(file)) == 0) && ok;
+  ok = (fclose(file) == 0) && ok;
+  if (ok && rename(tmp, path) != 0) ok = false;
+  if (!ok) {
+    remove(tmp);
+  }
+  return ok;
+}
+
+/* Checks that a mapped snapshot of size bytes is complete and sane */
+bool flight_snapshot_valid(const char *base, size_t size)
+{
+  const struct snapshot_header *header = (const void *)base;
+
+  if (size < sizeof(*header) ||
+      memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version < 1 || header->version > SNAPSHOT_VERSION ||
+      (size - sizeof(*header)) / sizeof(struct snapshot_schedule) < header->n_schedules) {
+    return false;
+  }
+
+  const struct snapshot_schedule *schedules = (const void *)(header + 1);
+  size_t rest = size - sizeof(*header) - header->n_schedules * sizeof(*schedules);
+  uint64_t n_flights = 0;
+
+  if (rest / sizeof(struct snapshot_flight) < header->n_flights) return false;
+
+  // the sections after the flights, each its count and then its records
+  const char *p = base + size - rest + header->n_flights * sizeof(struct snapshot_flight);
+  uint64_t n_connections = 0, n_services = 0, n_words = 0, n_dates = 0;
+  const struct snapshot_connection *connections = NULL;
+  const struct snapshot_service *services = NULL;
+  const char *words = NULL;
+  const struct snapshot_date *dates = NULL;
+  uint64_t n_waitlists = 0, n_waiting = 0;
+  const struct snapshot_waitlist *waitlists = NULL;
+  const char *waiting = NULL;
+  if (header->version >= 2) {
+    connections = snapshot_section(&p, base + size, sizeof(*connections), &n_connections);
+    if (connections == NULL) return false;
+  }
+  if (header->version >= 3) {
+    services = snapshot_section(&p, base + size, sizeof(*services), &n_services);
+    words = (services == NULL) ? NULL
+                               : snapshot_section(&p, base + size, sizeof(uint64_t), &n_words);
+    dates = (words == NULL) ? NULL
+                            : snapshot_section(&p, base + size, sizeof(*dates), &n_dates);
+    if (dates == NULL) return false;
+  }
+  if (header->version >= 4) {
+    waitlists = snapshot_section(&p, base + size, sizeof(*waitlists), &n_waitlists);
+    waiting = (waitlists == NULL) ? NULL
+                                  : snapshot_section(&p, base + size, sizeof(int32_t), &n_waiting);
+    if (waiting == NULL) return false;
+  }
+  if (header->version >= 5) {
+    if ((size_t)(base + size - p) < sizeof(uint64_t)) return false;
+    p += sizeof(uint64_t); // journal_seq
+  }
+  uint64_t n_order = 0;
+  const char *order = NULL;
+  if (header->version >= 6) {
+    order = snapshot_section(&p, base + size, sizeof(uint32_t), &n_order);
+    if (order == NULL || n_order != header->n_schedules) return false;
+  }
+  if (p != base + size) return false;
+
+  for (uint32_t i = 0; i < header->n_schedules; i++) {
+    if (memchr(schedules[i].destination, '\0', MAX_CITY_NAME_LEN+1) == NULL ||
+        schedules[i].n_flights > MAX_FLIGHTS_PER_CITY) {
+      return false;
+    }
+    n_flights += schedules[i].n_flights;
+  }
+  if (n_flights != header->n_flights) return false;
+
+  // the name order has every schedule once, each name after the one before
+  for (uint64_t i = 0; i < n_order; i++) {
+    uint32_t k, before;
+    memcpy(&k, order + i * sizeof(k), sizeof(k));
+    if (k >= header->n_schedules) return false;
+    if (i > 0) {
+      memcpy(&before, order + (i - 1) * sizeof(before), sizeof(before));
+      if (strcmp(schedules[before].destination, schedules[k].destination) >= 0) {
+        return false;
+      }
+    }
+  }
+
+  // the flights have to fit the packed fields of a schedule
+  const struct snapshot_flight *flights = (const void *)(schedules + header->n_schedules);
+  for (uint64_t i = 0; i < n_flights; i++) {
+    if (flights[i].time < TIME_NULL || flights[i].time > TIME_MAX ||
+        flights[i].capacity < 1 || flights[i].capacity > MAX_FLIGHT_CAPACITY ||
+        flights[i].available < 0 || flights[i].available > flights[i].capacity) {
+      return false;
+    }
+  }
+
+  // and so do the connections
+  for (uint64_t i = 0; i < n_connections; i++) {
+    const struct snapshot_connection *c = &connections[i];
+    if (memchr(c->origin, '\0', MAX_CITY_NAME_LEN+1) == NULL ||
+        memchr(c->destination, '\0', MAX_CITY_NAME_LEN+1) == NULL ||
+        strcmp(c->origin, c->destination) == 0 ||
+        c->departure < TIME_MIN || c->arrival < c->departure || c->arrival > TIME_MAX ||
+        c->capacity < 1 || c->capacity > MAX_FLIGHT_CAPACITY ||
+        c->available < 0 || c->available > c->capacity) {
+      return false;
+    }
+  }
+
+  // and the services, each booked date one it operates on, in order
+  uint64_t word = 0, date = 0;
+  for (uint64_t i = 0; i < n_services; i++) {
+    const struct snapshot_service *sv = &services[i];
+    if (memchr(sv->origin, '\0', MAX_CITY_NAME_LEN+1) == NULL ||
+        memchr(sv->destination, '\0', MAX_CITY_NAME_LEN+1) == NULL ||
+        strcmp(sv->origin, sv->destination) == 0 ||
+        sv->departure < TIME_MIN || sv->arrival < sv->departure || sv->arrival > TIME_MAX ||
+        sv->capacity < 1 || sv->capacity > MAX_FLIGHT_CAPACITY ||
+        sv->first_day < 0 || sv->n_days < 1 || sv->n_days > MAX_SEASON_DAYS ||
+        sv->first_day > DAY_MAX - sv->n_days + 1 ||
+        sv->n_dates < 0 || sv->n_dates > sv->n_days ||
+        n_words - word < (uint64_t)(sv->n_days + 63) / 64 ||
+        n_dates - date < (uint64_t)sv->n_dates) {
+      return false;
+    }
+    for (int d = 0; d < sv->n_dates; d++) {
+      const struct snapshot_date *booked = &dates[date + d];
+      int bit = booked->day - sv->first_day;
+      uint64_t bits;
+      if (bit < 0 || bit >= sv->n_days || (d > 0 && booked->day <= booked[-1].day) ||
+          booked->booked < 1 || booked->booked > sv->capacity) {
+        return false;
+      }
+      memcpy(&bits, words + (word + bit / 64) * sizeof(bits), sizeof(bits));
+      if (!(bits >> (bit % 64) & 1)) return false;
+    }
+    word += (sv->n_days + 63) / 64;
+    date += sv->n_dates;
+  }
+  if (word != n_words || date != n_dates) return false;
+
+  // and the waitlists, each with seats booked over capacity or waiting,
+  // grouped in the order of their schedules
+  uint64_t wait = 0, w = 0;
+  for (uint32_t i = 0; i < header->n_schedules; i++) {
+    while (w < n_waitlists &&
+           strncmp(waitlists[w].destination, schedules[i].destination,
+                   MAX_CITY_NAME_LEN+1) == 0) {
+      w++;
+    }
+  }
+  if (w != n_waitlists) return false;
+  for (uint64_t i = 0; i < n_waitlists; i++) {
+    const struct snapshot_waitlist *wl = &waitlists[i];
+    if (memchr(wl->destination, '\0', MAX_CITY_NAME_LEN+1) == NULL ||
+        wl->time < TIME_NULL || wl->time > TIME_MAX ||
+        wl->overbooked < 0 || wl->overbooked > MAX_FLIGHT_CAPACITY ||
+        wl->n_waiting < 0 || wl->n_waiting > MAX_WAITLIST ||
+        (wl->overbooked == 0 && wl->n_waiting == 0) ||
+        n_waiting - wait < (uint64_t)wl->n_waiting) {
+      return false;
+    }
+    for (int k = 0; k < wl->n_waiting; k++) {
+      int32_t seats;
+      memcpy(&seats, waiting + (wait + k) * sizeof(seats), sizeof(seats));
+      if (seats < 1 || seats > MAX_FLIGHT_CAPACITY) return false;
+    }
+    wait += wl->n_waiting;
+  }
+  return wait == n_waiting;
+}
+
+/* Reads the count of a section of a snapshot at *p, see struct
+   snapshot_header, and returns its records of size bytes, moving *p past
+   them.  Returns NULL if they don't all fit before end. */
+const void * snapshot_section(const char **p, const char *end, size_t size, uint64_t *n)
+{
+  if ((size_t)(end - *p) < sizeof(*n)) return NULL;
+  memcpy(n, *p, sizeof(*n));
+  *p += sizeof(*n);
+  if ((size_t)(end - *p) / size < *n) return NULL;
+
+  const void *records = *p;
+  *p += *n * size;
+  return records;
+}
+
+/* Replaces all schedules, connections and services with the ones in the
+   snapshot at path, older versions leaving none of the ones they lack.
+   With a journal the state loaded is handed over to the snapshot a
+   restart loads, saving it there, or if there is none the load is
+   journaled.  Returns
+   false, changing nothing, if it can't be read or is not a valid snapshot,
+   and also if memory runs out part way (leaving what was loaded). */
+bool flight_engine_load(const char *path)
+{
+  return flight_engine_read(path, true);
+}
+
+/* Adds the schedules, connections and services in the snapshot at path to
+   the ones there are, keeping the schedule there is of a city that has
+   one.  Returns false like flight_engine_load. */
+bool flight_engine_merge(const char *path)
+{
+  return flight_engine_read(path, false);
+}
+
+/* Reads the snapshot at path, replacing everything with it or adding it */
+bool flight_engine_read(const char *path, bool replace)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return false;
+
+  if (!flight_snapshot_valid(base, size)) {
+    munmap(base, size);
+    return false;
+  }
+
+  const struct snapshot_header *header = (const void *)base;
+  const struct snapshot_schedule *schedules = (const void *)(header + 1);
+  const struct snapshot_flight *records = (const void *)(schedules + header->n_schedules);
+  struct flight_schedule *fs;
+  bool ok = true;
+
+  // the sections after the flights, missing from older versions
+  const char *p = (const char *)(records + header->n_flights);
+  uint64_t n_connections = 0, n_services = 0, n_words = 0, n_dates = 0;
+  uint64_t n_waitlists = 0, n_waiting = 0, w = 0;
+  const struct snapshot_connection *connections = NULL;
+  const struct snapshot_service *services = NULL;
+  const char *words = NULL;
+  const struct snapshot_date *dates = NULL;
+  const struct snapshot_waitlist *waitlists = NULL;
+  const int32_t *waiting = NULL;
+  if (header->version >= 2) {
+    connections = snapshot_section(&p, base + size, sizeof(*connections), &n_connections);
+  }
+  if (header->version >= 3) {
+    services = snapshot_section(&p, base + size, sizeof(*services), &n_services);
+    words = snapshot_section(&p, base + size, sizeof(uint64_t), &n_words);
+    dates = snapshot_section(&p, base + size, sizeof(*dates), &n_dates);
+  }
+  if (header->version >= 4) {
+    waitlists = snapshot_section(&p, base + size, sizeof(*waitlists), &n_waitlists);
+    waiting = snapshot_section(&p, base + size, sizeof(int32_t), &n_waiting);
+  }
+  uint64_t seq = 0, n_order = 0;
+  const uint32_t *order = NULL;
+  if (header->version >= 5) {
+    memcpy(&seq, p, sizeof(seq));
+    p += sizeof(seq);
+  }
+  if (header->version >= 6) {
+    order = snapshot_section(&p, base + size, sizeof(uint32_t), &n_order);
+  }
+
+  // the schedule each record gave, NULL for one not loaded
+  struct flight_schedule **loaded = calloc(header->n_schedules + 1, sizeof(*loaded));
+  if (loaded == NULL) {
+    munmap(base, size);
+    return false;
+  }
+  city_table_reserve(header->n_schedules);
+
+  pthread_rwlock_wrlock(&flight_schedules_lock);
+
+  // drop all current schedules, keeping their flights for the open views
+  while (replace && (fs = flight_schedules_active) != NULL) {
+    pthread_mutex_lock(&fs->lock);
+    view_preserve(fs);
+    pthread_mutex_unlock(&fs->lock);
+    flight_schedule_deactivate(fs);
+    flight_schedule_free(fs);
+  }
+
+  for (uint32_t i = 0; ok && i < header->n_schedules; i++) {
+    const struct snapshot_schedule *record = &schedules[i];
+    const struct snapshot_flight *flight_records = records;
+    records += record->n_flights;
+
+    // its waitlists are next in their section, see flight_snapshot_valid
+    const int32_t *seats = waiting;
+    uint64_t first_waitlist = w;
+    for (; w < n_waitlists && strcmp(waitlists[w].destination, record->destination) == 0; w++) {
+      waiting += waitlists[w].n_waiting;
+    }
+
+    city_id_t city = city_intern(record->destination);
+    if (city == CITY_NONE) {
+      ok = false;
+      break;
+    }
+    if (flight_schedule_find(city) != NULL) {
+      city_release(city);
+      continue; // a city can only have one schedule, keep the first
+    }
+    fs = flight_schedule_allocate();
+    if (fs == NULL || !flight_schedule_reserve_flights(fs, record->n_flights)) {
+      flight_schedule_free(fs);
+      city_release(city);
+      ok = false;
+      break;
+    }
+    fs->city = city; // it keeps the hold of city_intern
+
+    // the departure index counts them below, all schedules at once
+    struct flight_lanes lanes = flight_schedule_lanes(fs);
+    for (uint32_t j = 0; j < record->n_flights; j++) {
+      lanes.time[j] = flight_records[j].time;
+      lanes.available[j] = flight_records[j].available;
+      lanes.capacity[j] = flight_records[j].capacity;
+    }
+    fs->n_flights = record->n_flights;
+    loaded[i] = fs;
+    for (uint64_t k = first_waitlist; ok && k < w; k++) {
+      ok = waitlist_restore(fs, waitlists[k].time, waitlists[k].overbooked, seats,
+                            waitlists[k].n_waiting);
+      seats += waitlists[k].n_waiting;
+    }
+    flight_schedule_activate(fs);
+  }
+  departure_build(loaded, header->n_schedules);
+  city_order_build(loaded, order, header->n_schedules);
+  free(loaded);
+
+  pthread_rwlock_wrlock(&connections_lock);
+  pthread_rwlock_wrlock(&services_lock);
+  if (ok) {
+    if (replace) connection_clear();
+    for (uint64_t i = 0; ok && i < n_connections; i++) {
+      const struct snapshot_connection *record = &connections[i];
+      city_id_t origin = city_intern(record->origin);
+      struct connection c = {city_intern(record->destination), record->departure,
+                             record->arrival, record->available, record->capacity};
+      ok = origin != CITY_NONE && c.destination != CITY_NONE && connection_insert(origin, &c);
+      city_release(origin);
+      city_release(c.destination);
+    }
+
+    if (replace) service_clear();
+    for (uint64_t i = 0; ok && i < n_services; i++) {
+      const struct snapshot_service *record = &services[i];
+      city_id_t origin = city_intern(record->origin);
+      struct service sv = {.destination = city_intern(record->destination),
+                           .departure = record->departure, .arrival = record->arrival,
+                           .capacity = record->capacity, .first_day = record->first_day,
+                           .n_days = record->n_days, .n_dates = record->n_dates,
+                           .max_dates = record->n_dates};
+      size_t n = (sv.n_days + 63) / 64;
+      if (n > 1) {
+        sv.days.words = malloc(n * sizeof(uint64_t));
+        ok = sv.days.words != NULL;
+      }
+      if (ok && sv.n_dates > 0) {
+        sv.dates = malloc(sv.n_dates * sizeof(*sv.dates));
+        ok = sv.dates != NULL;
+      }
+      if (ok) {
+        memcpy(n > 1 ? sv.days.words : &sv.days.word, words, n * sizeof(uint64_t));
+        for (int d = 0; d < sv.n_dates; d++) {
+          sv.dates[d] = (struct service_date){dates[d].day, dates[d].booked};
+        }
+        ok = origin != CITY_NONE && sv.destination != CITY_NONE && service_insert(origin, &sv);
+      }
+      if (!ok) service_free(&sv);
+      city_release(origin);
+      city_release(sv.destination);
+      words += n * sizeof(uint64_t);
+      dates += record->n_dates;
+    }
+  }
+  if (ok && replace) {
+    journal.loaded = seq;
+  }
+  // the journal has changes the state loaded replaces: a restart has to
+  // load it too, from the snapshot it loads or from the journal
+  if (ok && replace && journal.fd >= 0) {
+    if (journal_snapshot(path) ||
+        (journal.snapshot != NULL && snapshot_write(journal.snapshot, NULL, NULL))) {
+      journal_reset(); // changes from now on are logged against this snapshot
+    } else {
+      journal_log_load(path);
+    }
+  }
+  pthread_rwlock_unlock(&services_lock);
+  pthread_rwlock_unlock(&connections_lock);
+
+  pthread_rwlock_unlock(&flight_schedules_lock);
+  munmap(base, size);
+  return ok;
+}
+
+
+/******************************************************************************
+ * Write-ahead journal                                                        *
+ ******************************************************************************/
+
+/* Hash of a journal record, without its check field */
+uint32_t journal_check(const struct journal_record *record)
+{
+  const unsigned char *p = (const void *)record;
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < offsetof(struct journal_record, check); i++) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* Replays the journal at path through the engine and opens it to log the
+   changes from now on.  A record cut short or damaged by a crash ends the
+   replay and is cut off the file.  The changes the snapshot loaded last
+   has are skipped, and if that is all of them the file is emptied as
+   saving the snapshot would have.  Bookings are replayed with the
+   overbooking of the last 'p' record before them, or --overbook before
+   the first (journals from before there were any), and unless the last
+   one is --overbook a 'p' record of it is logged first.  Returns false if
+   it can't be opened. */
+bool journal_open(const char *path)
+{
+  struct stat st;
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) return false;
+
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+
+  off_t good = 0;
+  int overbook = flight_overbook; // this run's
+  int logged = -1;                // percent of the last 'p' record, if any
+  uint64_t seq = 0, covered = journal.loaded;
+  if (st.st_size > 0) {
+    const struct journal_record *records =
+      mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (records == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+
+    size_t n = st.st_size / sizeof(struct journal_record);
+    city_id_t origin = CITY_NONE;   // of the connection or service in the next record
+    flight_time_t arrival = 0;
+    int day = 0, last_day = 0, weekdays = 0;
+    char file[PATH_MAX] = "";       // of the next 'O'
+    size_t n_file = 0;
+    for (size_t i = 0; i < n; i++) {
+      const struct journal_record *record = &records[i];
+      if (record->check != journal_check(record) ||
+          memchr(record->destination, '\0', sizeof(record->destination)) == NULL) {
+        break;
+      }
+      seq = record->op == 'n'
+            ? (uint64_t)(uint32_t)record->time << 32 | (uint32_t)record->capacity
+            : seq + 1;
+      if (seq <= covered && strchr("opdnf", record->op) == NULL) { // a change it has
+        if (record->op == 'O') n_file = 0;
+        good += sizeof(struct journal_record);
+        continue;
+      }
+      city_id_t city = (record->op == 'A' || record->op == 'g' || record->op == 'v' ||
+                        record->op == 'o')
+                       ? city_intern(record->destination)
+                       : city_lookup(record->destination);
+      switch (record->op) {
+      case 'A': flight_engine_add(city); city_release(city); break;
+      case 'R': flight_engine_remove(city); break;
+      case 'a': flight_engine_add_flight(city, record->time, record->capacity); break;
+      case 'r': flight_engine_remove_flight(city, record->time); break;
+      case 's': // older journals left the seats at 0 for one
+      case 'S':
+        flight_engine_book_seats(city, record->time,
+                                 record->capacity > 0 ? record->capacity : 1,
+                                 record->op == 'S', NULL);
+        break;
+      case 'u':
+        flight_engine_unbook_seats(city, record->time,
+                                   record->capacity > 0 ? record->capacity : 1);
+        break;
+      case 'o':
+        city_release(origin); // held until the next origin
+        origin = city;
+        arrival = record->time;
+        day = record->capacity;
+        break;
+      case 'g':
+        flight_engine_add_connection(origin, city, record->time, arrival, record->capacity);
+        city_release(city);
+        break;
+      case 'G': flight_engine_remove_connection(origin, city, record->time); break;
+      case 'k': flight_engine_book_connection(origin, city, record->time, record->capacity); break;
+      case 'K':
+        flight_engine_unbook_connection(origin, city, record->time, record->capacity);
+        break;
+      case 'd':
+        last_day = record->time;
+        weekdays = record->capacity;
+        break;
+      case 'p':
+        flight_overbook = logged = record->capacity;
+        break;
+      case 'f':
+        if (n_file + strlen(record->destination) < sizeof(file)) {
+          strcpy(file + n_file, record->destination);
+          n_file += strlen(record->destination);
+        }
+        break;
+      case 'O':
+        file[n_file] = '\0';
+        if (!flight_engine_load(file)) msg_snapshot_load_failed(file);
+        n_file = 0;
+        break;
+      case 'v':
+        flight_engine_add_service(origin, city, record->time, arrival, record->capacity,
+                                  day, last_day, weekdays);
+        city_release(city);
+        break;
+      case 'V': flight_engine_remove_service(origin, city, record->time, day); break;
+      case 'y':
+        flight_engine_book_service(origin, city, record->time, day, record->capacity);
+        break;
+      case 'Y':
+        flight_engine_unbook_service(origin, city, record->time, day, record->capacity);
+        break;
+      }
+      good += sizeof(struct journal_record);
+    }
+    city_release(origin);
+    munmap((void *)records, st.st_size);
+  }
+
+  // nothing the snapshot does not have: finish emptying it
+  bool fresh = seq <= covered;
+  if (fresh) {
+    good = 0;
+    seq = covered;
+  }
+
+  // drop a torn tail and append after the last good record
+  if ((good != st.st_size && ftruncate(fd, good) != 0) ||
+      lseek(fd, good, SEEK_SET) != good) {
+    close(fd);
+    return false;
+  }
+
+  flight_overbook = overbook;
+  pthread_mutex_lock(&journal.lock);
+  journal.fd = fd;
+  journal.seq = seq;
+  pthread_mutex_unlock(&journal.lock);
+  if (fresh) {
+    journal_log_sequence();
+  }
+  if (fresh || logged != overbook) {
+    journal_log_overbook();
+  }
+  return true;
+}
+
+/* Logs a change that was just made.  Called by the engine while it still
+   holds the lock that guarded the change, so the journal has the changes
+   to any one schedule in the order they were made. */
+void journal_log(char op, city_id_t city, flight_time_t time, int capacity)
+{
+  struct journal_record record;
+
+  if (journal.fd < 0) return; // no journal, or replaying it
+
+  journal_record_set(&record, op, city, time, capacity);
+  journal_append(&record, 1);
+}
+
+/* Logs a change to a connection: an 'o' record with its origin and
+   arrival, then one with its destination, departure and seats.  The two
+   go in the journal together. */
+void journal_log_connection(char op, city_id_t origin, city_id_t destination,
+                            flight_time_t departure, flight_time_t arrival, int seats)
+{
+  struct journal_record records[2];
+
+  if (journal.fd < 0) return;
+
+  journal_record_set(&records[0], 'o', origin, arrival, 0);
+  journal_record_set(&records[1], op, destination, departure, seats);
+  journal_append(records, 2);
+}
+
+/* Logs a change to the flight of a service on one day: an 'o' record
+   with its origin and the day, then one with its destination, departure
+   and seats */
+void journal_log_service(char op, city_id_t origin, city_id_t destination,
+                         flight_time_t departure, int day, int seats)
+{
+  struct journal_record records[2];
+
+  if (journal.fd < 0) return;
+
+  journal_record_set(&records[0], 'o', origin, 0, day);
+  journal_record_set(&records[1], op, destination, departure, seats);
+  journal_append(records, 2);
+}
+
+/* Logs a service that was added: an 'o' record with its origin, arrival
+   and first day, a 'd' record with the rest of its calendar, then the 'v'
+   record with its destination, departure and capacity */
+void journal_log_service_add(city_id_t origin, city_id_t destination,
+                             flight_time_t departure, flight_time_t arrival, int capacity,
+                             int first_day, int last_day, int weekdays)
+{
+  struct journal_record records[3];
+
+  if (journal.fd < 0) return;
+
+  journal_record_set(&records[0], 'o', origin, arrival, first_day);
+  journal_record_set(&records[1], 'd', destination, last_day, weekdays);
+  journal_record_set(&records[2], 'v', destination, departure, capacity);
+  journal_append(records, 3);
+}
+
+/* Logs the overbooking the bookings from now on are made with, a 'p'
+   record, for when the journal is opened or emptied */
+void journal_log_overbook(void)
+{
+  struct journal_record record;
+
+  if (journal.fd < 0) return;
+
+  memset(&record, 0, sizeof(record));
+  record.op = 'p';
+  record.capacity = flight_overbook;
+  record.check = journal_check(&record);
+  journal_append(&record, 1);
+}
+
+/* Logs the sequence number of the next record, an 'n' record, for an
+   emptied journal to start with.  Nothing else is logged meanwhile. */
+void journal_log_sequence(void)
+{
+  struct journal_record record;
+
+  if (journal.fd < 0) return;
+
+  pthread_mutex_lock(&journal.lock);
+  uint64_t seq = journal.seq + 1;
+  pthread_mutex_unlock(&journal.lock);
+  memset(&record, 0, sizeof(record));
+  record.op = 'n';
+  record.time = (int32_t)(uint32_t)(seq >> 32);
+  record.capacity = (int32_t)(uint32_t)seq;
+  record.check = journal_check(&record);
+  journal_append(&record, 1);
+}
+
+/* Logs that the snapshot at path replaced everything: its full name in
+   'f' records, as many as it takes, then an 'O' record.  Replaying it
+   loads the file again, so it has to stay as it is. */
+void journal_log_load(const char *path)
+{
+  struct journal_record records[PATH_MAX / MAX_CITY_NAME_LEN + 2];
+  size_t piece = sizeof(records[0].destination) - 1;
+  char full[PATH_MAX];
+  int n = 0;
+
+  if (journal.fd < 0) return;
+
+  if (realpath(path, full) == NULL) {
+    snprintf(full, sizeof(full), "%s", path);
+  }
+  for (size_t i = 0, len = strlen(full); i < len; i += piece) {
+    memset(&records[n], 0, sizeof(records[n]));
+    records[n].op = 'f';
+    memcpy(records[n].destination, full + i, len - i < piece ? len - i : piece);
+    records[n].check = journal_check(&records[n]);
+    n++;
+  }
+  memset(&records[n], 0, sizeof(records[n]));
+  records[n].op = 'O';
+  records[n].check = journal_check(&records[n]);
+  journal_append(records, n + 1);
+}
+
+/* Fills in a journal record and its check */
+void journal_record_set(struct journal_record *record, char op, city_id_t city,
+                        flight_time_t time, int capacity)
+{
+  memset(record, 0, sizeof(*record));
+  record->op = op;
+  strcpy(record->destination, city_name(city));
+  record->time = time;
+  record->capacity = capacity;
+  record->check = journal_check(record);
+}
+
+/* Adds n records to the pending ones, committing them if that makes a
+   group */
+void journal_append(const struct journal_record *records, int n)
+{
+  bool full = false;
+
+  pthread_mutex_lock(&journal.lock);
+  if (journal.fd >= 0) {
+    while (journal.n_pending + n > journal.max_pending) {
+      int max = journal.max_pending ? 2 * journal.max_pending : journal.group_commit;
+      struct journal_record *bigger = realloc(journal.pending, max * sizeof(*records));
+      if (bigger == NULL) {
+        output_str("ERROR: Out of memory for the journal.\n");
+        exit(EXIT_FAILURE);
+      }
+      journal.pending = bigger;
+      journal.max_pending = max;
+    }
+    memcpy(&journal.pending[journal.n_pending], records, n * sizeof(*records));
+    journal.n_pending += n;
+    journal.seq += n;
+    full = journal.n_pending >= journal.group_commit;
+  }
+  pthread_mutex_unlock(&journal.lock);
+
+  if (full) journal_commit();
+}
+
+/* Writes and fsyncs all pending records as one group.  The pending records
+   are swapped out under the lock, so other threads keep logging while the
+   group is written. */
+void journal_commit(void)
+{
+  pthread_mutex_lock(&journal.commit_lock);
+
+  pthread_mutex_lock(&journal.lock);
+  struct journal_record *records = journal.pending;
+  int n = journal.n_pending, max = journal.max_pending;
+  journal.pending = journal.writing;
+  journal.max_pending = journal.max_writing;
+  journal.n_pending = 0;
+  journal.writing = records;
+  journal.max_writing = max;
+  int fd = journal.fd;
+  pthread_mutex_unlock(&journal.lock);
+
+  if (fd >= 0 && n > 0) {
+    const char *data = (const void *)records;
+    size_t size = n * sizeof(struct journal_record), done = 0;
+    while (done < size) {
+      ssize_t got = write(fd, data + done, size - done);
+      if (got <= 0) {
+        output_str("ERROR: Can not write the journal.\n");
+        exit(EXIT_FAILURE);
+      }
+      done += got;
+    }
+    if (fsync(fd) != 0) {
+      output_str("ERROR: Can not sync the journal.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  pthread_mutex_unlock(&journal.commit_lock);
+}
+
+/* Empties the journal after its changes were saved to, or replaced by, a
+   snapshot, going on with the numbers of its records.  The caller holds flight_schedules_lock exclusive,
+   connections_lock and services_lock so no change is logged meanwhile. */
+void journal_reset(void)
+{
+  pthread_mutex_lock(&journal.commit_lock);
+  pthread_mutex_lock(&journal.lock);
+  journal.n_pending = 0;
+  if (journal.fd >= 0) {
+    if (ftruncate(journal.fd, 0) != 0 || lseek(journal.fd, 0, SEEK_SET) != 0 ||
+        fsync(journal.fd) != 0) {
+      output_str("ERROR: Can not reset the journal.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  pthread_mutex_unlock(&journal.lock);
+  pthread_mutex_unlock(&journal.commit_lock);
+  journal_log_sequence(); // the emptied journal starts with them
+  journal_log_overbook();
+}
+
+/* Whether path is the snapshot a restart loads before replaying the
+   journal (--snapshot).  Only saving to or loading that one may empty the
+   journal: a restart would not see any other, and would lose the changes
+   logged since it last started. */
+bool journal_snapshot(const char *path)
+{
+  struct stat own, st;
+
+  if (journal.snapshot == NULL) return false;
+  return strcmp(path, journal.snapshot) == 0 ||
+         (stat(path, &st) == 0 && stat(journal.snapshot, &own) == 0 &&
+          st.st_dev == own.st_dev && st.st_ino == own.st_ino);
+}
+
+/* Commits what is pending and closes the journal */
+void journal_close(void)
+{
+  journal_commit();
+  pthread_mutex_lock(&journal.lock);
+  if (journal.fd >= 0) {
+    close(journal.fd);
+    journal.fd = -1;
+  }
+  pthread_mutex_unlock(&journal.lock);
+}
+
+
+/*Takes as input a city id and returns the flight schedule of said city,
+or NULL if there is none
+The caller must hold flight_schedules_lock*/
+
+struct flight_schedule * flight_schedule_find(city_id_t city)
+{
+  if(city >= flight_schedules_by_city_max){ // never added, or CITY_NONE
+    return NULL;
+  }
+  return flight_schedules_by_city[city];
+}
+
+
+/******************************************************************************
+ * City names                                                                 *
+ ******************************************************************************/
+
+/* FNV-1a hash of a null terminated city name */
+unsigned int city_hash(const char *city)
+{
+  unsigned int hash = 2166136261u;
+
+  while(*city != '\0'){
+    hash ^= (unsigned char)*city++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* Returns the id of a city name, giving it a free id or the next new one
+   if it has none yet, and holds it: the caller has to give it back with
+   city_release once whatever it added holds the id.  Returns CITY_NONE
+   if the name is too long or memory runs out. */
+city_id_t city_intern(const char *name)
+{
+  unsigned int hash = city_hash(name);
+
+  if(strlen(name) > MAX_CITY_NAME_LEN){
+    return CITY_NONE;
+  }
+
+  pthread_rwlock_rdlock(&cities.lock);
+  city_id_t city = city_table_find(name, hash);
+  if(city != CITY_NONE){
+    atomic_fetch_add(&city_entry(city)->refs, 1);
+  }
+  pthread_rwlock_unlock(&cities.lock);
+  if(city != CITY_NONE){
+    return city;
+  }
+
+  pthread_rwlock_wrlock(&cities.lock);
+  city = city_table_find(name, hash); // another thread may have added it
+  bool found = city != CITY_NONE;
+  if(!found){
+    city = city_table_reuse();
+  }
+  if(!found && city == CITY_NONE){
+    size_t offset;
+    int k = city_chunk_of(cities.n, &offset);
+
+    if(k < MAX_CITY_CHUNKS && cities.chunks[k] == NULL){
+      cities.chunks[k] = malloc(((size_t)FIRST_CITY_NAMES << k) * sizeof(struct city_entry));
+    }
+    if(k < MAX_CITY_CHUNKS && cities.chunks[k] != NULL &&
+       (2*(cities.n+1) <= cities.slots || city_table_resize(2*cities.slots))){
+      city = cities.n++;
+      atomic_init(&city_entry(city)->on_free, false);
+      atomic_init(&city_entry(city)->refs, 0);
+    }
+  }
+  if(!found && city != CITY_NONE){
+    strcpy(city_entry(city)->name, name);
+    city_table_place(cities.index, cities.slots - 1, hash, city + 1);
+  }
+  if(city != CITY_NONE){
+    atomic_fetch_add(&city_entry(city)->refs, 1);
+  }
+  pthread_rwlock_unlock(&cities.lock);
+  return city;
+}
+
+/* Returns the id of a city name, or CITY_NONE if it has none, without
+   holding it.  A name that has no id can't have a schedule now, so
+   lookups never add.  The id of a name nothing holds may be reused for
+   another one by the time the caller uses it, which then finds what that
+   one has, as if the lookup came after it was added. */
+city_id_t city_lookup(const char *name)
+{
+  pthread_rwlock_rdlock(&cities.lock);
+  city_id_t city = city_table_find(name, city_hash(name));
+  pthread_rwlock_unlock(&cities.lock);
+  return city;
+}
+
+/* Holds a city id once more for something that keeps it, see struct
+   city_table.  The caller holds it already, or it is held by what the
+   caller has locked. */
+void city_hold(city_id_t city)
+{
+  atomic_fetch_add(&city_entry(city)->refs, 1);
+}
+
+/* Gives back a hold on a city id.  The last one puts it on the free
+   stack, unless it is there already, without taking any lock.  Does
+   nothing for CITY_NONE. */
+void city_release(city_id_t city)
+{
+  if(city == CITY_NONE){
+    return;
+  }
+  struct city_entry *e = city_entry(city);
+  if(atomic_fetch_sub(&e->refs, 1) != 1 || atomic_exchange(&e->on_free, true)){
+    return;
+  }
+
+  // push: city becomes the head with a new tag
+  uint64_t head = atomic_load(&cities.free_head);
+  uint64_t next;
+  do {
+    e->free_next = (uint32_t)head;
+    next = (((head >> 32) + 1) << 32) | (city + 1);
+  } while(!atomic_compare_exchange_weak(&cities.free_head, &head, next));
+}
+
+/* Returns the name of an interned city id */
+const char * city_name(city_id_t city)
+{
+  return city_entry(city)->name;
+}
+
+/* Returns the entry of an interned city id */
+struct city_entry * city_entry(city_id_t city)
+{
+  size_t offset;
+  int k = city_chunk_of(city, &offset);
+
+  return &cities.chunks[k][offset];
+}
+
+/* Returns the chunk of the city table that holds id, and the position of
+   its name in it in *offset */
+int city_chunk_of(city_id_t city, size_t *offset)
+{
+  size_t start = 0, size = FIRST_CITY_NAMES;
+  int k = 0;
+
+  while(city >= start + size){
+    start += size;
+    size *= 2;
+    k++;
+  }
+  *offset = city - start;
+  return k;
+}
+
+/* Probes the index for a name with the given hash.  Returns its id, or
+   CITY_NONE.  The caller must hold cities.lock. */
+city_id_t city_table_find(const char *name, unsigned int hash)
+{
+  size_t mask = cities.slots - 1;
+  size_t i;
+
+  // probe until we hit the name or an empty slot
+  for(i = hash & mask; cities.index[i].entry != 0; i = (i+1) & mask){
+    if(cities.index[i].hash == hash &&
+       strcmp(city_name(cities.index[i].entry - 1), name) == 0){ // city match found
+#if FLIGHT_STATS
+      stats_probed(((i - hash) & mask) + 1);
+#endif
+      return cities.index[i].entry - 1;
+    }
+  }
+#if FLIGHT_STATS
+  stats_probed(((i - hash) & mask) + 1);
+#endif
+  return CITY_NONE;
+}
+
+/* Takes an id nothing holds off the free stack and its old name out of
+   the index, for a new name.  Ids that were interned again since they
+   were freed are dropped from the stack on the way, their next release
+   puts them back.  Returns CITY_NONE if there is none.  The caller holds
+   cities.lock exclusive, so it is the only thread popping, and no hold can
+   be taken on an id that has none meanwhile. */
+city_id_t city_table_reuse(void)
+{
+  uint64_t head = atomic_load(&cities.free_head);
+
+  while((uint32_t)head != 0){
+    city_id_t city = (uint32_t)head - 1;
+    struct city_entry *e = city_entry(city);
+    uint64_t next = (((head >> 32) + 1) << 32) | e->free_next;
+    if(!atomic_compare_exchange_weak(&cities.free_head, &head, next)){
+      continue;
+    }
+    // off the stack, so a release from now on pushes it again
+    atomic_store(&e->on_free, false);
+    if(atomic_load(&e->refs) == 0){
+      city_table_unplace(city);
+      return city;
+    }
+    head = atomic_load(&cities.free_head);
+  }
+  return CITY_NONE;
+}
+
+/* Places an entry in the first empty slot of its probe sequence.  The
+   caller guarantees that the table has a free slot. */
+void city_table_place(struct city_slot *slots, size_t mask, unsigned int hash,
+                      uint32_t entry)
+{
+  size_t i = hash & mask;
+
+  while(slots[i].entry != 0){
+    i = (i+1) & mask;
+  }
+  slots[i].hash = hash;
+  slots[i].entry = entry;
+}
+
+/* Takes the name of a city out of the index, moving the entries probed
+   past it back so that every entry stays reachable from its hash slot
+   without a gap.  The caller holds cities.lock exclusive. */
+void city_table_unplace(city_id_t city)
+{
+  size_t mask = cities.slots - 1;
+  size_t i = city_hash(city_name(city)) & mask;
+
+  while(cities.index[i].entry != city + 1){
+    i = (i+1) & mask;
+  }
+  cities.index[i].entry = 0;
+  for(size_t j = (i+1) & mask; cities.index[j].entry != 0; j = (j+1) & mask){
+    size_t home = cities.index[j].hash & mask;
+    if(((j - home) & mask) >= ((j - i) & mask)){ // i is on its probe sequence
+      cities.index[i] = cities.index[j];
+      cities.index[j].entry = 0;
+      i = j;
+    }
+  }
+}
+
+/* Replaces the index with an empty table of the given number of slots
+   (a power of 2) and re-inserts all the current entries into it.  Returns
+   false, keeping the old table, if out of memory. */
+bool city_table_resize(size_t slots)
+{
+  struct city_slot *index = calloc(slots, sizeof(struct city_slot));
+
+  if(index == NULL){
+    return false;
+  }
+  for(size_t i = 0; i < cities.slots; i++){
+    if(cities.index[i].entry != 0){
+      city_table_place(index, slots - 1, cities.index[i].hash, cities.index[i].entry);
+    }
+  }
+  free(cities.index);
+  cities.index = index;
+  cities.slots = slots;
+  return true;
+}
+
+/* Grows the index once to take more names than there are now at a load
+   of 1/2, so that interning them does not grow it step by step.  Out of
+   memory it stays as it is, interning grows it as needed. */
+void city_table_reserve(size_t more)
+{
+  pthread_rwlock_wrlock(&cities.lock);
+  size_t slots = cities.slots;
+  while(slots / 2 < cities.n + more && slots <= SIZE_MAX / 2){
+    slots *= 2;
+  }
+  if(slots != cities.slots){
+    city_table_resize(slots);
+  }
+  pthread_rwlock_unlock(&cities.lock);
+}
+
+/* Creates the index big enough for n names at a load of 1/2, unless
+   there is one already: names stay interned for the whole run */
+void city_table_initialize(size_t n)
+{
+  size_t slots = MIN_INDEX_SLOTS;
+
+  if(cities.index != NULL){
+    return;
+  }
+  while(slots / 2 < n && slots <= SIZE_MAX / 2){
+    slots *= 2;
+  }
+  if(slots / 2 < n || !city_table_resize(slots)){
+    output_str("ERROR: Out of memory for the destination index.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+/******************************************************************************
+ * Sorted destination order                                                   *
+ ******************************************************************************/
+
+/* Finds the first active city whose name is not before name.  If before is
+   not NULL, before[i] is set to the link on level i that leads to it, where
+   a node for name would go.  The caller must hold flight_schedules_lock. */
+struct city_order_node * city_order_seek(const char *name,
+                                         struct city_order_node ***before)
+{
+  struct city_order_node **link = NULL;
+  struct city_order_node **next = city_order_head; // links of the node we are at
+
+  for (int i = city_order_levels - 1; i >= 0; i--) {
+    while (next[i] != NULL && strcmp(city_name(next[i]->city), name) < 0) {
+      next = next[i]->next;
+    }
+    link = &next[i];
+    if (before != NULL) before[i] = link;
+  }
+  return *link;
+}
+
+/* Links an active city into the sorted order.  The caller must hold
+   flight_schedules_lock exclusive. */
+void city_order_insert(city_id_t city)
+{
+  struct city_order_node **before[CITY_ORDER_LEVELS];
+  struct city_order_node *node = city_order_node_new(city);
+
+  city_order_seek(city_name(city), before);
+  for (int i = city_order_levels; i < node->levels; i++) {
+    before[i] = &city_order_head[i];
+  }
+  if (node->levels > city_order_levels) city_order_levels = node->levels;
+
+  for (int i = 0; i < node->levels; i++) {
+    node->next[i] = *before[i];
+    *before[i] = node;
+  }
+}
+
+/* Links the cities of n schedules just loaded, none of them linked yet,
+   into the sorted order.  schedules[k] is the schedule of snapshot record
+   k, NULL if it was not loaded, and order has the records in name order,
+   or is NULL for an older snapshot, which they are sorted in first.  If
+   the order is empty they are appended in one pass, otherwise each is
+   linked on its own.  The caller must hold flight_schedules_lock
+   exclusive. */
+void city_order_build(struct flight_schedule *const *schedules, const uint32_t *order,
+                      size_t n)
+{
+  city_id_t *sorted = malloc((n + 1) * sizeof(city_id_t));
+  size_t m = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    struct flight_schedule *fs = schedules[order != NULL ? order[i] : i];
+    if (fs == NULL) continue;
+    if (sorted == NULL) {
+      city_order_insert(fs->city); // no memory to do better
+    } else {
+      sorted[m++] = fs->city;
+    }
+  }
+  if (sorted == NULL) return;
+  if (order == NULL) {
+    qsort(sorted, m, sizeof(city_id_t), departure_compare);
+  }
+
+  if (city_order_head[0] != NULL) {
+    for (size_t i = 0; i < m; i++) {
+      city_order_insert(sorted[i]);
+    }
+  } else {
+    // the link each level ends on
+    struct city_order_node **last[CITY_ORDER_LEVELS];
+    for (int i = 0; i < CITY_ORDER_LEVELS; i++) {
+      last[i] = &city_order_head[i];
+    }
+    for (size_t k = 0; k < m; k++) {
+      struct city_order_node *node = city_order_node_new(sorted[k]);
+      for (int i = 0; i < node->levels; i++) {
+        *last[i] = node;
+        last[i] = &node->next[i];
+      }
+      if (node->levels > city_order_levels) city_order_levels = node->levels;
+    }
+    for (int i = 0; i < CITY_ORDER_LEVELS; i++) {
+      *last[i] = NULL;
+    }
+  }
+  free(sorted);
+}
+
+/* Makes the node of a city for the sorted order, on a random number of
+   levels, not linked yet */
+struct city_order_node * city_order_node_new(city_id_t city)
+{
+  int levels = 1;
+
+  // each level up with chance 1/4
+  uint32_t r = city_order_random;
+  r ^= r << 13;
+  r ^= r >> 17;
+  r ^= r << 5;
+  city_order_random = r;
+  while (levels < CITY_ORDER_LEVELS && (r & 3) == 0) {
+    levels++;
+    r >>= 2;
+  }
+
+  struct city_order_node *node =
+    malloc(sizeof(*node) + levels * sizeof(struct city_order_node *));
+  if (node == NULL) {
+    output_str("ERROR: Out of memory for the destination index.\n");
+    exit(EXIT_FAILURE);
+  }
+  node->city = city;
+  node->levels = levels;
+  return node;
+}
+
+/* Unlinks a city from the sorted order.  The caller must hold
+   flight_schedules_lock exclusive. */
+void city_order_remove(city_id_t city)
+{
+  struct city_order_node **before[CITY_ORDER_LEVELS];
+  struct city_order_node *node = city_order_seek(city_name(city), before);
+
+  if (node == NULL || node->city != city) {
+    return; // not in the order
+  }
+  for (int i = 0; i < node->levels; i++) {
+    *before[i] = node->next[i];
+  }
+  while (city_order_levels > 1 && city_order_head[city_order_levels - 1] == NULL) {
+    city_order_levels--;
+  }
+  free(node);
+}
+
+
+/******************************************************************************
+ * Departure index                                                            *
+ ******************************************************************************/
+
+/* Sets up the locks of the buckets, all of them empty */
+void departure_initialize(void)
+{
+  for (int b = 0; b < DEPARTURE_BUCKETS; b++) {
+    pthread_mutex_init(&departures[b].lock, NULL);
+  }
+}
+
+/* Counts one more flight to city with seats left leaving at time.  The
+   caller holds the lock of the city's schedule. */
+void departure_open(city_id_t city, flight_time_t time)
+{
+  int bucket = time - TIME_NULL;
+  struct departure_bucket *b = &departures[bucket];
+
+  pthread_mutex_lock(&b->lock);
+  if ((b->n + 1) * 4 > b->max * 3) { // keep it at most 3/4 full
+    departure_resize(b, b->max ? 2 * b->max : MIN_DEPARTURE_SLOTS);
+  }
+  struct departure_slot *slot = &b->slots[departure_slot_of(b, city)];
+  if (slot->city == CITY_NONE) {
+    slot->city = city;
+    slot->count = 0;
+    if (b->n++ == 0) {
+      atomic_fetch_or(&departure_bits[bucket / 64], 1ull << (bucket % 64));
+    }
+  }
+  slot->count++;
+  pthread_mutex_unlock(&b->lock);
+}
+
+/* Counts the flights with seats left of n schedules just loaded, none of
+   them counted yet, in two passes: the first counts what each bucket
+   takes, so that it grows to it once, and the second adds them, each city
+   once per minute with all its flights then, with the buckets locked once
+   for all of them.  Entries of schedules may be NULL.  The caller holds
+   flight_schedules_lock exclusive. */
+void departure_build(struct flight_schedule *const *schedules, size_t n)
+{
+  uint32_t adds[DEPARTURE_BUCKETS] = {0};
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < n; i++) {
+      struct flight_schedule *fs = schedules[i];
+      if (fs == NULL) continue;
+      struct flight_lanes lanes = flight_schedule_lanes(fs);
+      for (int j = 0, next; j < fs->n_flights; j = next) {
+        uint32_t count = 0;
+        for (next = j; next < fs->n_flights && lanes.time[next] == lanes.time[j]; next++) {
+          count += lanes.available[next] > 0;
+        }
+        if (count == 0) continue;
+        int bucket = lanes.time[j] - TIME_NULL;
+        if (pass == 0) {
+          adds[bucket]++;
+          continue;
+        }
+
+        struct departure_bucket *b = &departures[bucket];
+        struct departure_slot *slot = &b->slots[departure_slot_of(b, fs->city)];
+        slot->city = fs->city;
+        slot->count = count;
+        b->n++;
+      }
+    }
+
+    // lock the buckets that take some, in order, and grow each to what it
+    // takes at most 3/4 full; then let them go once they have them
+    for (int bucket = 0; bucket < DEPARTURE_BUCKETS; bucket++) {
+      struct departure_bucket *b = &departures[bucket];
+      if (adds[bucket] == 0) continue;
+      if (pass == 1) {
+        atomic_fetch_or(&departure_bits[bucket / 64], 1ull << (bucket % 64));
+        pthread_mutex_unlock(&b->lock);
+        continue;
+      }
+      pthread_mutex_lock(&b->lock);
+      uint32_t max = b->max ? b->max : MIN_DEPARTURE_SLOTS;
+      while ((b->n + adds[bucket]) * 4 > max * 3) {
+        max *= 2;
+      }
+      if (max != b->max) {
+        departure_resize(b, max);
+      }
+    }
+  }
+}
+
+/* Counts one flight less to city with seats left leaving at time, one that
+   departure_open counted.  The caller holds the lock of the city's
+   schedule. */
+void departure_close(city_id_t city, flight_time_t time)
+{
+  int bucket = time - TIME_NULL;
+  struct departure_bucket *b = &departures[bucket];
+
+  pthread_mutex_lock(&b->lock);
+  uint32_t mask = b->max - 1;
+  uint32_t i = departure_slot_of(b, city);
+  assert(b->slots[i].city == city);
+
+  if (--b->slots[i].count == 0) {
+    // take it out, moving back the slots after it that would not be found
+    // past the gap (deletion without tombstones)
+    uint32_t j = i;
+    while (true) {
+      j = (j + 1) & mask;
+      if (b->slots[j].city == CITY_NONE) break;
+      uint32_t home = (b->slots[j].city * 2654435761u) & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        b->slots[i] = b->slots[j];
+        i = j;
+      }
+    }
+    b->slots[i].city = CITY_NONE;
+
+    if (--b->n == 0) {
+      atomic_fetch_and(&departure_bits[bucket / 64], ~(1ull << (bucket % 64)));
+    }
+    if (b->max > MIN_DEPARTURE_SLOTS && b->n * 8 < b->max) {
+      departure_resize(b, b->max / 2);
+    }
+  }
+  pthread_mutex_unlock(&b->lock);
+}
+
+/* Position of city in the hash table of a bucket, or of the empty slot
+   where it would go.  The table must have an empty slot. */
+uint32_t departure_slot_of(const struct departure_bucket *b, city_id_t city)
+{
+  uint32_t mask = b->max - 1;
+  uint32_t i = (city * 2654435761u) & mask;
+
+  while (b->slots[i].city != city && b->slots[i].city != CITY_NONE) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/* Moves the cities of a bucket to a hash table of max slots.  The caller
+   holds the lock of the bucket. */
+void departure_resize(struct departure_bucket *b, uint32_t max)
+{
+  struct departure_slot *old = b->slots;
+  uint32_t old_max = b->max;
+
+  b->slots = malloc(max * sizeof(struct departure_slot));
+  b->max = max;
+  if (b->slots == NULL) {
+    output_str("ERROR: Out of memory for the departure index.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < max; i++) {
+    b->slots[i].city = CITY_NONE;
+  }
+  for (uint32_t i = 0; i < old_max; i++) {
+    if (old[i].city != CITY_NONE) {
+      b->slots[departure_slot_of(b, old[i].city)] = old[i];
+    }
+  }
+  free(old);
+}
+
+/* Returns the first non empty bucket from bucket on, DEPARTURE_BUCKETS if
+   there is none */
+int departure_next(int bucket)
+{
+  if (bucket >= DEPARTURE_BUCKETS) return DEPARTURE_BUCKETS;
+
+  int w = bucket / 64;
+  uint64_t bits = atomic_load(&departure_bits[w]) & (~0ull << (bucket % 64));
+  while (bits == 0) {
+    if (++w == DEPARTURE_WORDS) return DEPARTURE_BUCKETS;
+    bits = atomic_load(&departure_bits[w]);
+  }
+  int next = w * 64 + __builtin_ctzll(bits);
+  return next < DEPARTURE_BUCKETS ? next : DEPARTURE_BUCKETS;
+}
+
+/* Copies the cities of a bucket to *cities, which is grown as needed and
+   holds *max of them.  Returns how many were copied. */
+int departure_cities(int bucket, city_id_t **cities, int *max)
+{
+  struct departure_bucket *b = &departures[bucket];
+  int n = 0;
+
+  pthread_mutex_lock(&b->lock);
+  if (b->n > (uint32_t)*max) {
+    free(*cities);
+    *max = b->max; // room for it to grow before the next time
+    *cities = malloc(*max * sizeof(city_id_t));
+    if (*cities == NULL) {
+      output_str("ERROR: Out of memory for the departure index.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (uint32_t i = 0; i < b->max; i++) {
+    if (b->slots[i].city != CITY_NONE) {
+      (*cities)[n++] = b->slots[i].city;
+    }
+  }
+  pthread_mutex_unlock(&b->lock);
+  return n;
+}
+
+/* Orders city ids by name for qsort */
+int departure_compare(const void *a, const void *b)
+{
+  return strcmp(city_name(*(const city_id_t *)a), city_name(*(const city_id_t *)b));
+}
+
+
+/******************************************************************************
+ * Connections and itineraries                                                *
+ ******************************************************************************/
+
+/* The connection list of origin, NULL if none ever left it.  The caller
+   holds connections_lock. */
+struct connection_list * connection_list_of(city_id_t origin)
+{
+  if (origin >= connections_by_city_max) { // never an origin, or CITY_NONE
+    return NULL;
+  }
+  return &connections_by_city[origin];
+}
+
+/* Position of the first connection of a list leaving at or after
+   departure, list->n if there is none */
+int connection_lower_bound(const struct connection_list *list, flight_time_t departure)
+{
+  int low = 0, high = list->n;
+
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (list->connections[middle].departure < departure) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/* Position of the first connection of a list to destination leaving at
+   departure, -1 if there is none or no list */
+int connection_find(const struct connection_list *list, city_id_t destination,
+                    flight_time_t departure)
+{
+  if (list == NULL) return -1;
+
+  for (int i = connection_lower_bound(list, departure);
+       i < (int)list->n && list->connections[i].departure == departure; i++) {
+    if (list->connections[i].destination == destination) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Adds a connection from origin after the ones leaving at the same time.
+   It holds both its cities.  Returns false if there is no memory for it.
+   The caller holds connections_lock exclusive. */
+bool connection_insert(city_id_t origin, const struct connection *c)
+{
+  if (origin >= connections_by_city_max) { // a new origin
+    size_t max = connections_by_city_max ? 2 * connections_by_city_max : MIN_INDEX_SLOTS;
+    while (max <= origin) {
+      max *= 2;
+    }
+    struct connection_list *bigger = realloc(connections_by_city, max * sizeof(*bigger));
+    if (bigger == NULL) return false;
+    for (size_t i = connections_by_city_max; i < max; i++) {
+      bigger[i] = (struct connection_list){NULL, 0, 0};
+    }
+    connections_by_city = bigger;
+    connections_by_city_max = max;
+  }
+
+  struct connection_list *list = &connections_by_city[origin];
+  if (list->n == list->max) {
+    uint32_t max = list->max ? 2 * list->max : MIN_CONNECTIONS;
+    struct connection *bigger = realloc(list->connections, max * sizeof(*bigger));
+    if (bigger == NULL) return false;
+    list->connections = bigger;
+    list->max = max;
+  }
+
+  int i = connection_lower_bound(list, c->departure + 1);
+  memmove(&list->connections[i + 1], &list->connections[i],
+          (list->n - i) * sizeof(struct connection));
+  list->connections[i] = *c;
+  list->n++;
+  connections_count++;
+  city_hold(origin);
+  city_hold(c->destination);
+  return true;
+}
+
+/* Takes connection i out of a list, keeping the rest in order, and gives
+   back its holds on its cities */
+void connection_delete(struct connection_list *list, int i)
+{
+  city_release((city_id_t)(list - connections_by_city));
+  city_release(list->connections[i].destination);
+  memmove(&list->connections[i], &list->connections[i + 1],
+          (list->n - i - 1) * sizeof(struct connection));
+  list->n--;
+  connections_count--;
+}
+
+/* Drops every connection.  The caller holds connections_lock exclusive. */
+void connection_clear(void)
+{
+  for (size_t origin = 0; origin < connections_by_city_max; origin++) {
+    struct connection_list *list = &connections_by_city[origin];
+    for (uint32_t i = 0; i < list->n; i++) {
+      city_release(origin);
+      city_release(list->connections[i].destination);
+    }
+    free(connections_by_city[origin].connections);
+    connections_by_city[origin] = (struct connection_list){NULL, 0, 0};
+  }
+  connections_count = 0;
+}
+
+/* Puts city on the heap of a search as arriving at arrival */
+void itinerary_push(struct itinerary_search *s, flight_time_t arrival, city_id_t city)
+{
+  if (s->n_heap == s->max_heap) {
+    s->max_heap = s->max_heap ? 2 * s->max_heap : MIN_INDEX_SLOTS;
+    s->heap = realloc(s->heap, s->max_heap * sizeof(uint64_t));
+    if (s->heap == NULL) {
+      output_str("ERROR: Out of memory for the itinerary search.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // sift up from the end
+  uint64_t entry = (uint64_t)arrival << 32 | city;
+  size_t i = s->n_heap++;
+  while (i > 0 && s->heap[(i - 1) / 2] > entry) {
+    s->heap[i] = s->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  s->heap[i] = entry;
+}
+
+/* Takes the earliest arrival off the heap of a search, which must not be
+   empty.  Returns it as arrival << 32 | city. */
+uint64_t itinerary_pop(struct itinerary_search *s)
+{
+  uint64_t top = s->heap[0];
+  uint64_t last = s->heap[--s->n_heap];
+
+  // sift the last entry down from the top
+  size_t i = 0;
+  while (2 * i + 1 < s->n_heap) {
+    size_t child = 2 * i + 1;
+    if (child + 1 < s->n_heap && s->heap[child + 1] < s->heap[child]) {
+      child++;
+    }
+    if (s->heap[child] >= last) break;
+    s->heap[i] = s->heap[child];
+    i = child;
+  }
+  s->heap[i] = last;
+  return top;
+}
+
+
+/******************************************************************************
+ * Services and calendars                                                     *
+ *                                                                            *
+ * Dates are day numbers, days since 1970-01-01, which the commands read and  *
+ * print as YYYYMMDD.                                                         *
+ ******************************************************************************/
+
+/* Day number of a date of the proleptic Gregorian calendar */
+int date_day(int year, int month, int day)
+{
+  year -= month <= 2; // years start in March, so February is last
+  int era = (year >= 0 ? year : year - 399) / 400;
+  int year_of_era = year - era * 400;
+  int day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+/* The date of a day number as YYYYMMDD, the reverse of date_day */
+int date_of_day(int day)
+{
+  day += 719468;
+  int era = (day >= 0 ? day : day - 146096) / 146097;
+  int day_of_era = day - era * 146097;
+  int year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524
+                     - day_of_era / 146096) / 365;
+  int day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  int month = (5 * day_of_year + 2) / 153; // from March
+  int day_of_month = day_of_year - (153 * month + 2) / 5 + 1;
+  month = month < 10 ? month + 3 : month - 9;
+  return (year_of_era + era * 400 + (month <= 2)) * 10000 + month * 100 + day_of_month;
+}
+
+/* Day of the week of a day number, 0 for Monday to 6 for Sunday */
+int date_weekday(int day)
+{
+  return (day + 3) % 7; // 1970-01-01 was a Thursday
+}
+
+/* Sets the calendar of a service to the days from first_day to last_day
+   on the weekdays set in weekdays, trimmed to the first and last of them
+   so it takes as few words as it can.  Returns false, leaving n_days 0, if
+   there is no such day or they span more than MAX_SEASON_DAYS, and also
+   if there is no memory for the calendar. */
+bool service_calendar(struct service *sv, int first_day, int last_day, int weekdays)
+{
+  while (first_day <= last_day && !(weekdays >> date_weekday(first_day) & 1)) {
+    first_day++;
+  }
+  while (last_day >= first_day && !(weekdays >> date_weekday(last_day) & 1)) {
+    last_day--;
+  }
+  if (first_day > last_day || last_day - first_day >= MAX_SEASON_DAYS) {
+    sv->n_days = 0;
+    return false;
+  }
+
+  sv->first_day = first_day;
+  sv->n_days = last_day - first_day + 1;
+  uint64_t *words = &sv->days.word;
+  if (sv->n_days > 64) {
+    words = sv->days.words = calloc((sv->n_days + 63) / 64, sizeof(uint64_t));
+    if (words == NULL) return false; // n_days is set
+  } else {
+    sv->days.word = 0;
+  }
+  for (int bit = 0; bit < sv->n_days; bit++) {
+    if (weekdays >> date_weekday(first_day + bit) & 1) {
+      words[bit / 64] |= 1ull << (bit % 64);
+    }
+  }
+  return true;
+}
+
+/* The calendar words of a service, inline or allocated */
+const uint64_t * service_words(const struct service *sv)
+{
+  return sv->n_days > 64 ? sv->days.words : &sv->days.word;
+}
+
+/* Returns true if the service has a flight on day */
+bool service_operates(const struct service *sv, int day)
+{
+  int bit = day - sv->first_day;
+
+  if (bit < 0 || bit >= sv->n_days) return false;
+  return service_words(sv)[bit / 64] >> (bit % 64) & 1;
+}
+
+/* Position of the first booked date of a service on or after day */
+int service_date_lower_bound(const struct service *sv, int day)
+{
+  int low = 0, high = sv->n_dates;
+
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (sv->dates[middle].day < day) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/* Seats booked on the flight of a service on day */
+int service_booked(const struct service *sv, int day)
+{
+  int d = service_date_lower_bound(sv, day);
+  return (d < sv->n_dates && sv->dates[d].day == day) ? sv->dates[d].booked : 0;
+}
+
+/* Starts tracking the seats of day, with none booked, at position d of
+   the booked dates.  Returns false if there is no memory for it. */
+bool service_date_insert(struct service *sv, int d, int day)
+{
+  if (sv->n_dates == sv->max_dates) {
+    int max = sv->max_dates ? 2 * sv->max_dates : MIN_SERVICE_DATES;
+    struct service_date *bigger = realloc(sv->dates, max * sizeof(*bigger));
+    if (bigger == NULL) return false;
+    sv->dates = bigger;
+    sv->max_dates = max;
+  }
+  memmove(&sv->dates[d + 1], &sv->dates[d], (sv->n_dates - d) * sizeof(*sv->dates));
+  sv->dates[d] = (struct service_date){day, 0};
+  sv->n_dates++;
+  return true;
+}
+
+/* Stops tracking booked date d of a service, freeing the dates when it
+   was the last one */
+void service_date_delete(struct service *sv, int d)
+{
+  memmove(&sv->dates[d], &sv->dates[d + 1], (sv->n_dates - d - 1) * sizeof(*sv->dates));
+  if (--sv->n_dates == 0) {
+    free(sv->dates);
+    sv->dates = NULL;
+    sv->max_dates = 0;
+  }
+}
+
+/* The service list of origin, NULL if none ever left it.  The caller
+   holds services_lock. */
+struct service_list * service_list_of(city_id_t origin)
+{
+  if (origin >= services_by_city_max) { // never an origin, or CITY_NONE
+    return NULL;
+  }
+  return &services_by_city[origin];
+}
+
+/* Position of the first service of a list leaving at or after departure,
+   list->n if there is none */
+int service_lower_bound(const struct service_list *list, flight_time_t departure)
+{
+  int low = 0, high = list->n;
+
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (list->services[middle].departure < departure) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/* Position of the first service of a list to destination leaving at
+   departure that operates on day, -1 if there is none or no list */
+int service_find(const struct service_list *list, city_id_t destination,
+                 flight_time_t departure, int day)
+{
+  if (list == NULL) return -1;
+
+  for (int i = service_lower_bound(list, departure);
+       i < (int)list->n && list->services[i].departure == departure; i++) {
+    if (list->services[i].destination == destination &&
+        service_operates(&list->services[i], day)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Adds a service from origin after the ones leaving at the same time.
+   The list takes over the memory of its calendar and dates, and it holds
+   both its cities.  Returns
+   false if there is no memory for it.  The caller holds services_lock
+   exclusive. */
+bool service_insert(city_id_t origin, const struct service *sv)
+{
+  if (origin >= services_by_city_max) { // a new origin
+    size_t max = services_by_city_max ? 2 * services_by_city_max : MIN_INDEX_SLOTS;
+    while (max <= origin) {
+      max *= 2;
+    }
+    struct service_list *bigger = realloc(services_by_city, max * sizeof(*bigger));
+    if (bigger == NULL) return false;
+    for (size_t i = services_by_city_max; i < max; i++) {
+      bigger[i] = (struct service_list){NULL, 0, 0};
+    }
+    services_by_city = bigger;
+    services_by_city_max = max;
+  }
+
+  struct service_list *list = &services_by_city[origin];
+  if (list->n == list->max) {
+    uint32_t max = list->max ? 2 * list->max : MIN_CONNECTIONS;
+    struct service *bigger = realloc(list->services, max * sizeof(*bigger));
+    if (bigger == NULL) return false;
+    list->services = bigger;
+    list->max = max;
+  }
+
+  int i = service_lower_bound(list, sv->departure + 1);
+  memmove(&list->services[i + 1], &list->services[i], (list->n - i) * sizeof(struct service));
+  list->services[i] = *sv;
+  list->n++;
+  services_count++;
+  city_hold(origin);
+  city_hold(sv->destination);
+  return true;
+}
+
+/* Takes service i out of a list and frees it, keeping the rest in order,
+   and gives back its holds on its cities */
+void service_delete(struct service_list *list, int i)
+{
+  city_release((city_id_t)(list - services_by_city));
+  city_release(list->services[i].destination);
+  service_free(&list->services[i]);
+  memmove(&list->services[i], &list->services[i + 1],
+          (list->n - i - 1) * sizeof(struct service));
+  list->n--;
+  services_count--;
+}
+
+/* Frees the calendar and dates of a service */
+void service_free(struct service *sv)
+{
+  if (sv->n_days > 64) {
+    free(sv->days.words);
+  }
+  free(sv->dates);
+}
+
+/* Drops every service.  The caller holds services_lock exclusive. */
+void service_clear(void)
+{
+  for (size_t origin = 0; origin < services_by_city_max; origin++) {
+    struct service_list *list = &services_by_city[origin];
+    for (uint32_t i = 0; i < list->n; i++) {
+      city_release(origin);
+      city_release(list->services[i].destination);
+      service_free(&list->services[i]);
+    }
+    free(list->services);
+    *list = (struct service_list){NULL, 0, 0};
+  }
+  services_count = 0;
+}
+
+
+/******************************************************************************
+ * Waitlists                                                                  *
+ *                                                                            *
+ * A booking of a flight without the seats for it is booked over capacity by  *
+ * up to flight_overbook percent, or else waits on the flight's waitlist.     *
+ * Seats given back go to the bookings waiting in the order they came, each   *
+ * taken off the ring in constant time.                                       *
+ ******************************************************************************/
+
+/* Seats a flight of capacity seats can be booked over it */
+int waitlist_margin(int capacity)
+{
+  return capacity * flight_overbook / 100;
+}
+
+/* Returns the link on the waitlists of a locked schedule to the first one
+   of a flight leaving at or after time, where one of time goes */
+struct flight_waitlist ** waitlist_find(struct flight_schedule *fs, flight_time_t time)
+{
+  struct flight_waitlist **link = &fs->waitlists;
+  while (*link != NULL && (*link)->time < time) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+/* The waitlist at a link from waitlist_find if it is of time, or NULL */
+struct flight_waitlist * waitlist_at(struct flight_waitlist **link, flight_time_t time)
+{
+  return (*link != NULL && (*link)->time == time) ? *link : NULL;
+}
+
+/* Books count seats on flight i of a locked schedule when it has fewer
+   left or others may wait for them.  If nobody waits and the seats fit
+   in the ones left and the margin, the ones it lacks are booked over
+   capacity; otherwise the booking waits, unless it asks for more than the
+   flight can ever take, or more than a waitlist entry holds
+   (MAX_FLIGHT_CAPACITY).  Returns FLIGHT_OK, FLIGHT_WAITLISTED, or
+   FLIGHT_NO_SEATS if it can't wait. */
+enum flight_status waitlist_book(struct flight_schedule *fs, int i, int count)
+{
+  struct flight_lanes lanes = flight_schedule_lanes(fs);
+  struct flight_waitlist **link = waitlist_find(fs, lanes.time[i]);
+  struct flight_waitlist *wl = waitlist_at(link, lanes.time[i]);
+  int available = lanes.available[i];
+  int margin = waitlist_margin(lanes.capacity[i]);
+
+  if (count > lanes.capacity[i] + margin || count > MAX_FLIGHT_CAPACITY) {
+    return FLIGHT_NO_SEATS;
+  }
+  if (wl == NULL || wl->n == 0) {
+    int overbooked = (wl != NULL) ? wl->overbooked : 0;
+    if (count <= available) {
+      view_preserve(fs);
+      flight_schedule_set_available(fs, i, available - count);
+      return FLIGHT_OK;
+    }
+    if (count - available <= margin - overbooked &&
+        (wl != NULL || (wl = waitlist_new(link, lanes.time[i], MIN_WAITLIST)) != NULL)) {
+      view_preserve(fs);
+      wl->overbooked += count - available;
+      flight_schedule_set_available(fs, i, 0);
+      return FLIGHT_OK;
+    }
+  }
+  return waitlist_push(link, lanes.time[i], count) ? FLIGHT_WAITLISTED : FLIGHT_NO_SEATS;
+}
+
+/* True if bookings wait on the flight leaving at time.  *cursor starts at
+   the first waitlist of the schedule and is moved along it, so the
+   flights of a schedule can be asked about in time order in one pass. */
+bool waitlist_waiting(struct flight_waitlist **cursor, flight_time_t time)
+{
+  while (*cursor != NULL && (*cursor)->time < time) {
+    *cursor = (*cursor)->next;
+  }
+  return *cursor != NULL && (*cursor)->time == time && (*cursor)->n > 0;
+}
+
+/* Gives back count seats of flight i of a locked schedule, which has a
+   waitlist and that many booked.  Seats booked over capacity go first,
+   then the bookings waiting take the seats left and the margin in the
+   order they came, until the first one that does not fit. */
+void waitlist_unbook(struct flight_schedule *fs, int i, int count)
+{
+  struct flight_lanes lanes = flight_schedule_lanes(fs);
+  struct flight_waitlist **link = waitlist_find(fs, lanes.time[i]);
+  struct flight_waitlist *wl = *link;
+  int back = (count < wl->overbooked) ? count : wl->overbooked;
+  int available = lanes.available[i] + count - back;
+  int room = available + waitlist_margin(lanes.capacity[i]) - (wl->overbooked - back);
+
+  wl->overbooked -= back;
+  while (wl->n > 0 && wl->seats[wl->head] <= room) {
+    int seats = wl->seats[wl->head];
+    wl->head = (wl->head + 1) & (wl->max - 1);
+    wl->n--;
+    room -= seats;
+    if (seats > available) {
+      wl->overbooked += seats - available;
+      available = 0;
+    } else {
+      available -= seats;
+    }
+  }
+  flight_schedule_set_available(fs, i, available);
+  if (wl->n == 0 && wl->overbooked == 0) {
+    waitlist_drop(link);
+  }
+}
+
+/* Adds a booking of seats seats to the end of the waitlist of the flight
+   leaving at time, which is at link from waitlist_find or goes there.  A
+   full ring is moved to one twice its size.  Returns false if the flight
+   has MAX_WAITLIST bookings waiting already or memory runs out. */
+bool waitlist_push(struct flight_waitlist **link, flight_time_t time, int seats)
+{
+  struct flight_waitlist *wl = waitlist_at(link, time);
+
+  if (wl == NULL) {
+    wl = waitlist_new(link, time, MIN_WAITLIST);
+    if (wl == NULL) return false;
+  } else if (wl->n == wl->max) {
+    if (wl->max == MAX_WAITLIST) return false;
+    struct flight_waitlist *bigger = waitlist_get(2 * wl->max);
+    if (bigger == NULL) return false;
+    *bigger = *wl;
+    bigger->head = 0;
+    bigger->max = 2 * wl->max;
+    for (int k = 0; k < wl->n; k++) {
+      bigger->seats[k] = wl->seats[(wl->head + k) & (wl->max - 1)];
+    }
+    *link = bigger;
+    waitlist_put(wl);
+    wl = bigger;
+  }
+  wl->seats[(wl->head + wl->n) & (wl->max - 1)] = seats;
+  wl->n++;
+  return true;
+}
+
+/* Links an empty waitlist of the flight leaving at time, with room for max
+   bookings, at link from waitlist_find.  Returns NULL without memory. */
+struct flight_waitlist * waitlist_new(struct flight_waitlist **link, flight_time_t time,
+                                      int max)
+{
+  struct flight_waitlist *wl = waitlist_get(max);
+  if (wl == NULL) return NULL;
+
+  wl->next = *link;
+  wl->time = time;
+  wl->overbooked = 0;
+  wl->head = 0;
+  wl->n = 0;
+  wl->max = max;
+  *link = wl;
+  return wl;
+}
+
+/* Gives a schedule the waitlist of a snapshot: overbooked seats and the
+   seats of n bookings waiting on its flight leaving at time.  Nothing
+   changes if it has no such flight or has a waitlist for it already.
+   Returns false if memory runs out. */
+bool waitlist_restore(struct flight_schedule *fs, flight_time_t time, int overbooked,
+                      const int32_t *seats, int n)
+{
+  int i = flight_schedule_lower_bound(fs, time);
+  struct flight_waitlist **link = waitlist_find(fs, time);
+  if (i >= fs->n_flights || flight_schedule_lanes(fs).time[i] != time ||
+      waitlist_at(link, time) != NULL) {
+    return true;
+  }
+
+  int max = MIN_WAITLIST;
+  while (max < n) max *= 2;
+  struct flight_waitlist *wl = waitlist_new(link, time, max);
+  if (wl == NULL) return false;
+  wl->overbooked = overbooked;
+  for (int k = 0; k < n; k++) {
+    wl->seats[k] = seats[k];
+  }
+  wl->n = n;
+  return true;
+}
+
+/* Takes the waitlist at link off its schedule and back to the pool */
+void waitlist_drop(struct flight_waitlist **link)
+{
+  struct flight_waitlist *wl = *link;
+  *link = wl->next;
+  waitlist_put(wl);
+}
+
+/* Drops all the waitlists of a schedule */
+void waitlist_clear(struct flight_schedule *fs)
+{
+  while (fs->waitlists != NULL) {
+    waitlist_drop(&fs->waitlists);
+  }
+}
+
+/* Size class of a waitlist ring of max bookings, a power of 2 */
+int waitlist_class(int max)
+{
+  int k = 0;
+  while ((MIN_WAITLIST << k) < max) k++;
+  return k;
+}
+
+/* Takes a waitlist block with a ring of max bookings from the pool,
+   allocates a new one if there is none.  max is a power of 2 from
+   MIN_WAITLIST to MAX_WAITLIST. */
+struct flight_waitlist * waitlist_get(int max)
+{
+  int k = waitlist_class(max);
+
+  pthread_mutex_lock(&waitlists_lock);
+  void *block = waitlists_free[k];
+  if (block != NULL) {
+    memcpy(&waitlists_free[k], block, sizeof(void *)); // pop
+  }
+  pthread_mutex_unlock(&waitlists_lock);
+
+  if (block == NULL) {
+    return malloc(sizeof(struct flight_waitlist) + max * sizeof(packed_seats_t));
+  }
+  return block;
+}
+
+/* Puts a waitlist block back in the pool for reuse */
+void waitlist_put(struct flight_waitlist *wl)
+{
+  int k = waitlist_class(wl->max);
+
+  pthread_mutex_lock(&waitlists_lock);
+  memcpy(wl, &waitlists_free[k], sizeof(void *)); // push
+  waitlists_free[k] = wl;
+  pthread_mutex_unlock(&waitlists_lock);
+}
+
+
+/******************************************************************************
+ * Read views                                                                 *
+ ******************************************************************************/
+
+/* Keeps the flights of a locked schedule for the open views that must not
+   see the change about to be made to them, see struct flight_view.  Called
+   before every change to the flights, which it tags with the current
+   epoch.  Only the first change of an epoch does any more than that. */
+void view_preserve(struct flight_schedule *fs)
 {
-  qsort(fs->flights, MAX_FLIGHTS_PER_CITY, sizeof(struct flight),
-	flight_compare_time);
+  struct flight_view_state *vs = flight_schedule_views(fs);
+  uint64_t epoch = atomic_load(&views.epoch);
+  if (vs->stamp == epoch) return;
+
+  uint64_t oldest = view_oldest(epoch);
+  view_prune(fs, oldest);
+  if (oldest <= epoch) {
+    // views of the epochs (stamp, epoch] see the flights as they are now
+    struct flight_version *v = malloc(sizeof(*v) + fs->n_flights * sizeof(struct flight));
+    if (v == NULL) {
+      output_str("ERROR: Out of memory for a read view.\n");
+      exit(EXIT_FAILURE);
+    }
+    v->older = vs->versions;
+    v->from = vs->stamp;
+    v->to = epoch;
+    v->n_flights = flight_schedule_copy(fs, v->flights, fs->n_flights);
+    vs->versions = v;
+  }
+  vs->stamp = epoch;
 }
 
-int flight_compare_time(const void *a, const void *b) 
+/* Returns the oldest epoch an open view can have, given the current one.
+   The registry is read after the epoch, so a view opened since it was
+   read has a newer epoch and sees any change tagged with it. */
+uint64_t view_oldest(uint64_t epoch)
 {
-  const struct flight *af = a;
-  const struct flight *bf = b;
-  
-  return (af->time - bf->time);
+  if (atomic_load(&views.open) == 0) return epoch + 1;
+  return atomic_load(&views.oldest);
 }
-/*code added here*/
 
-/*Takes a schedule off the free list and places it on the active list  
-Returns the updated flight schedule. */
-struct flight_schedule * flight_schedule_allocate(void)
-{ 
-  if (flight_schedules_free == NULL){ // check corner test max+1 adding schedules
-    return NULL;
+/* Frees the flights a locked schedule keeps that no view from epoch
+   oldest on can see */
+void view_prune(struct flight_schedule *fs, uint64_t oldest)
+{
+  struct flight_version **link = &flight_schedule_views(fs)->versions;
+  while (*link != NULL && (*link)->to >= oldest) { // newest first
+    link = &(*link)->older;
   }
+  struct flight_version *v = *link, *older;
+  *link = NULL;
+  for (; v != NULL; v = older) {
+    older = v->older;
+    free(v);
+  }
+}
 
-  if(flight_schedules_active == NULL){ //first situation: no nodes in active list
-    if(flight_schedules_free->next == NULL){//if only one node left in free
-      flight_schedules_active = flight_schedules_free;
-      flight_schedules_free = NULL;
-    }
-    else{
-      flight_schedules_active = flight_schedules_free; // update the active pointer
-      flight_schedules_free = flight_schedules_free->next; // make the free pointer to point to the next node
-      flight_schedules_active->next = NULL; // update what active->next point to
-      flight_schedules_free->prev = NULL; // update what free->prev point to
+/* Starts a new epoch for view and adds it to the open views.  Returns
+   false if there is no memory for it. */
+bool view_register(struct flight_view *view)
+{
+  pthread_mutex_lock(&views.lock);
+  int open = atomic_load(&views.open);
+  if (open == views.max) {
+    int max = views.max ? 2 * views.max : MIN_VIEWS;
+    uint64_t *bigger = realloc(views.epochs, max * sizeof(*bigger));
+    if (bigger == NULL) {
+      pthread_mutex_unlock(&views.lock);
+      return false;
     }
+    views.epochs = bigger;
+    views.max = max;
   }
 
-  else{ // second situation: there is at least one node in active list
-    if(flight_schedules_free->next == NULL){
-      flight_schedules_active->prev = flight_schedules_free;
-      flight_schedules_free->next = flight_schedules_active;
-      flight_schedules_active = flight_schedules_active->prev;
-      flight_schedules_free = NULL;
-    }  
-    else{
-      flight_schedules_active->prev = flight_schedules_free; // let active->prev point to what free poins to
-      flight_schedules_free = flight_schedules_free->next; 
-      flight_schedules_free->prev = NULL;  //update pointer of free and free->prev
-      
-      flight_schedules_active->prev->next = flight_schedules_active;
-      flight_schedules_active = flight_schedules_active->prev; // update pointer of active and the next of active
-    }
+  // the registry first, see view_oldest
+  uint64_t epoch = atomic_load(&views.epoch) + 1;
+  if (open == 0) {
+    atomic_store(&views.oldest, epoch);
   }
-  
-  
-  return flight_schedules_active; 
+  views.epochs[open] = epoch;
+  atomic_store(&views.open, open + 1);
+  atomic_store(&views.epoch, epoch);
+  view->epoch = epoch;
+  pthread_mutex_unlock(&views.lock);
+  return true;
 }
 
-/*Takes as input a flight schedule struct
-  Takes a schedule off the active list, resets it, and places the node back on the free list
-  return nothing */
-void flight_schedule_free(struct flight_schedule *fs)
-{ 
-  if(fs == NULL){
-    return;
+/* Takes a view off the open views.  The flights kept for the last one are
+   freed here rather than left to the next change of each schedule. */
+void view_unregister(const struct flight_view *view)
+{
+  pthread_mutex_lock(&views.lock);
+  int open = atomic_load(&views.open), i = 0;
+  while (views.epochs[i] != view->epoch) {
+    i++;
+  }
+  memmove(&views.epochs[i], &views.epochs[i + 1], (open - i - 1) * sizeof(uint64_t));
+  if (--open > 0) {
+    atomic_store(&views.oldest, views.epochs[0]);
   }
+  atomic_store(&views.open, open);
+  pthread_mutex_unlock(&views.lock);
 
-  else if(fs->prev == NULL && fs->next == NULL){// remove the only node in active list
-    flight_schedules_active = NULL;
-    flight_schedule_reset(fs);
+  if (open == 0) {
+    view_reclaim();
+  }
+}
 
-    if(flight_schedules_free != NULL){
-        fs->next = flight_schedules_free;
-        flight_schedules_free->prev = fs;
-          }
-    flight_schedules_free = fs;
-    
-    
-    return;
+/* Frees the flights the active schedules keep that no open view can see.
+   Removed schedules free theirs on their first change once reused. */
+void view_reclaim(void)
+{
+  pthread_rwlock_rdlock(&flight_schedules_lock);
+  for (struct flight_schedule *fs = flight_schedules_active; fs != NULL;
+       fs = flight_schedule_link(fs->next)) {
+    pthread_mutex_lock(&fs->lock);
+    if (flight_schedule_views(fs)->versions != NULL) {
+      view_prune(fs, view_oldest(atomic_load(&views.epoch)));
+    }
+    pthread_mutex_unlock(&fs->lock);
   }
+  pthread_rwlock_unlock(&flight_schedules_lock);
+}
 
-  else if(fs->prev == NULL){
-        // case 1: remove the first node in active list
 
-        flight_schedules_active = flight_schedules_active ->next;
-        flight_schedules_active->prev = NULL;
+/******************************************************************************
+ * Sharded inventory                                                          *
+ *                                                                            *
+ * --router PATH serves the same requests as --server, but keeps no schedules *
+ * itself: it starts --shards worker processes, each a server on PATH.<k>,    *
+ * and hands every request on to the shard of its city, the destination (or   *
+ * the origin of a connection or service) placed on a consistent hash ring.   *
+ * The lists of all cities (L P F D N) go to every shard and the answers are  *
+ * merged, by name or by time.  E adds a shard: the cities it takes are moved *
+ * out of the others with X and loaded into it, nothing else moves.           *
+ *                                                                            *
+ * With --journal or --snapshot the sharded state survives a restart: the    *
+ * cities moved to shard k are saved to <base>.k, which it starts from, and   *
+ * the number of shards E made to <base>.shards, which the router starts     *
+ * that many from if --shards asks for fewer.  See router_base.              *
+ ******************************************************************************/
 
-        flight_schedule_reset(fs);
+/* Places shards on a new hash ring */
+struct shard_ring * shard_ring_new(int shards)
+{
+  struct shard_ring *ring = malloc(sizeof(*ring));
+  if (ring == NULL) {
+    output_str("ERROR: Out of memory for the shard ring.\n");
+    exit(EXIT_FAILURE);
+  }
 
-        if(flight_schedules_free == NULL){ // if there's no node in free list
-          flight_schedules_free = fs;
-        }
+  ring->shards = shards;
+  for (int k = 0; k < shards; k++) {
+    for (int i = 0; i < SHARD_POINTS; i++) {
+      uint64_t hash = shard_mix((uint64_t)k << 32 | i) >> 32;
+      ring->points[k * SHARD_POINTS + i] = hash << 32 | k;
+    }
+  }
+  qsort(ring->points, (size_t)shards * SHARD_POINTS, sizeof(uint64_t), load_test_compare);
+  return ring;
+}
+
+/* The shard of the ring that has city */
+int shard_of(const struct shard_ring *ring, const char *city)
+{
+  uint64_t key = shard_mix(city_hash(city)) >> 32 << 32;
+  int lo = 0, hi = ring->shards * SHARD_POINTS;
 
-        else{
-          fs->next = flight_schedules_free;
-          flight_schedules_free->prev = fs;
-          flight_schedules_free = fs;
-        }  
+  while (lo < hi) { // first point at or after key
+    int mid = (lo + hi) / 2;
+    if (ring->points[mid] < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == ring->shards * SHARD_POINTS) lo = 0; // round past the end
+  return ring->points[lo] & 0xffffffff;
+}
 
-        
-        
-        return;
-       
-       }
+/* Spreads the bits of x over all 64 (the splitmix64 finalizer) */
+uint64_t shard_mix(uint64_t x)
+{
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
 
-      // case 2: remove the last node in active list
-     else if(fs->next == NULL){ 
-        (fs->prev)->next = NULL;
-        flight_schedule_reset(fs);//reset node info
+/* True for the cities of the last shard of the ring arg, the ones that
+   move to it when it is added */
+bool shard_moves(city_id_t city, void *arg)
+{
+  const struct shard_ring *ring = arg;
+  return shard_of(ring, city_name(city)) == ring->shards - 1;
+}
 
+/* Starts the shards and serves clients on r->path until killed.  Returns
+   false if a shard can't be started or it can't listen. */
+bool router_run(struct router *r)
+{
+#ifdef __linux__
+  struct epoll_event events[SERVER_MAX_EVENTS];
 
-          if(flight_schedules_free != NULL){
-            fs->next = flight_schedules_free;
-            flight_schedules_free->prev = fs;
-          }
-        flight_schedules_free = fs;
-       
-        return;
-     }
+  r->ep = epoll_create1(EPOLL_CLOEXEC);
+  if (r->ep < 0) return false;
+  int saved = router_saved_shards(r);
+  if (saved > r->n_shards) r->n_shards = saved;
+  for (int k = 0; k < r->n_shards; k++) {
+    if (!router_start_shard(r, k)) return false;
+  }
+  r->ring = shard_ring_new(r->n_shards);
 
+  int listener = server_listen(r->path);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL}; // NULL is the listener
+  if (listener < 0 || fcntl(listener, F_SETFD, FD_CLOEXEC) != 0 ||
+      epoll_ctl(r->ep, EPOLL_CTL_ADD, listener, &ev) != 0) {
+    return false;
+  }
 
-    // case 3: remove the node in middle
-    else if((fs->next!= NULL) && (fs->prev!= NULL)){ // remove the node in middle
-      (fs->prev)->next = fs->next;//update prev node
-      (fs->next)->prev = fs->prev;//update next node
+  while (true) {
+    int n = epoll_wait(r->ep, events, SERVER_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
 
-      flight_schedule_reset(fs);//reset node info
-      
-      if(flight_schedules_free != NULL){
-            fs->next = flight_schedules_free;
-            flight_schedules_free->prev =fs;
+    // hand on what came in and take the answers of the shards
+    for (int i = 0; i < n; i++) {
+      struct server_client *client = events[i].data.ptr;
+      if (client == NULL) {
+        server_accept(r->ep, listener);
+        continue;
+      }
+      if (client->shard != NULL) {
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          router_read_shard(client->shard);
+        }
+        if (events[i].events & EPOLLOUT) {
+          router_send_shard(client->shard);
+        }
+        continue;
       }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        server_read(client, router_run_requests);
+      }
+      router_ready(client);
+    }
 
-      flight_schedules_free = fs;
-      
-      return;
-      
+    // the requests of this round go to each shard in one write
+    for (int k = 0; k < r->n_shards; k++) {
+      if (r->shards[k]->link.out_len > 0 && !r->shards[k]->link.blocked) {
+        router_send_shard(r->shards[k]);
+      }
+    }
+    while (r->ready != NULL) {
+      struct server_client *client = r->ready;
+      r->ready = client->next_ready;
+      client->ready = false;
+      router_reply(client);
+      server_send(r->ep, client);
     }
-  
   }
 
+  close(listener);
+  return true;
+#else
+  (void)r;
+  return false; // needs epoll
+#endif
+}
 
+/* Starts shard k, a server on r->path.<k> journaling to r->journal.<k>
+   and starting from <base>.<k> (see router_base) if there is one, and
+   connects to it.  The shard is given <base>.<k> even before it is made,
+   so that saving to it is what empties the shard's journal.
+   The shard is stopped when the router exits.  Returns false if it does
+   not start listening. */
+bool router_start_shard(struct router *r, int k)
+{
+#ifdef __linux__
+  char server[MAX_PATH_LEN+16], journal[MAX_PATH_LEN+16], snapshot[MAX_PATH_LEN+32];
+  const char *argv[20];
+  int n = 0;
 
+  snprintf(server, sizeof(server), "%s.%d", r->path, k);
+  argv[n++] = r->self;
+  argv[n++] = "--server";
+  argv[n++] = server;
+  argv[n++] = "--group-commit";
+  argv[n++] = r->options[0];
+  argv[n++] = "--min-connection";
+  argv[n++] = r->options[1];
+  argv[n++] = "--overbook";
+  argv[n++] = r->options[2];
+  argv[n++] = "--shard-of";
+  argv[n++] = r->options[4];
+  if (r->journal != NULL) {
+    snprintf(journal, sizeof(journal), "%s.%d", r->journal, k);
+    argv[n++] = "--journal";
+    argv[n++] = journal;
+  }
+  if (router_base(r, snapshot, sizeof(snapshot) - 16)) {
+    size_t len = strlen(snapshot);
+    snprintf(snapshot + len, sizeof(snapshot) - len, ".%d", k);
+    argv[n++] = "--snapshot";
+    argv[n++] = snapshot;
+  }
+  argv[n++] = r->options[3];
+  argv[n] = NULL;
 
-/*Takes as input a city and adds a flight schedule for this given city.
-  Does not return anything.
-  Command line syntax: Ã¢â‚¬ÂA Toronto\nÃ¢â‚¬Â*/
-void flight_schedule_add(city_t city)
-{ 
-  struct flight_schedule *temp = flight_schedule_find(city);
-  if(temp != NULL){
-    msg_city_exists(city); //c
-    return;
+  struct router_shard *shard = calloc(1, sizeof(*shard));
+  if (shard == NULL) return false;
+  unlink(server); // so connecting fails until this shard listens
+  shard->pid = fork();
+  if (shard->pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    execv("/proc/self/exe", (char **)argv);
+    execvp(r->self, (char **)argv);
+    _exit(EXIT_FAILURE);
   }
-    struct flight_schedule *ss = flight_schedule_allocate();
-    
-    if(ss == NULL){
-      msg_schedule_no_free();
-    }else{
-      strcpy(ss->destination, city); 
+
+  int fd = -1;
+  for (int tries = 0; shard->pid > 0 && fd < 0 && tries < SHARD_START_TRIES; tries++) {
+    if (waitpid(shard->pid, NULL, WNOHANG) != 0) break; // it stopped
+    fd = load_test_connect(server);
+    if (fd < 0) {
+      nanosleep(&(struct timespec){0, 10000000}, NULL);
     }
-    
   }
-  
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &shard->link};
+  if (fd < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) != 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+      epoll_ctl(r->ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    if (fd >= 0) close(fd);
+    if (shard->pid > 0) kill(shard->pid, SIGTERM);
+    free(shard);
+    return false;
+  }
+  shard->link.fd = fd;
+  shard->link.shard = shard;
+  shard->line_start = true;
+  r->shards[k] = shard;
+  return true;
+#else
+  (void)r;
+  (void)k;
+  return false;
+#endif
+}
 
+/* Hands on the complete requests a client has sent.  Each is parsed like
+   a batch file holding just it to find where it goes, and sent on as it
+   came. */
+void router_run_requests(struct server_client *client)
+{
+  size_t done = 0, len;
+  char command;
+  city_t city;
+  char path[MAX_PATH_LEN+1], text[MAX_PATH_LEN+32];
+  struct router_request *request;
 
-/*Takes as input a city and removes the flight schedule for this city, if it exists.
- Does not return anything*/
-void flight_schedule_remove(city_t city)
+  while (!client->quit &&
+         (len = server_request_length(client->in + done, client->in + client->in_len)) > 0) {
+    const char *p = client->in + done;
+    batch.base = client->in;
+    batch.pos = p;
+    batch.end = p + len;
+    command_get(&command);
+    switch (command) {
+    case 'L': case 'P': case 'F': case 'D': case 'N': case 'T':
+      // every shard has some of the cities
+      request = router_request(client, command, router.n_shards);
+      for (int k = 0; k < router.n_shards; k++) {
+        router_forward(request, k, k, p, len);
+      }
+      break;
+    case 'S': case 'O':
+      // shard k saves its cities to <file>.k
+      if (path_read(path) == 0) {
+        request = router_request(client, command, 1);
+        router_forward(request, 0, 0, p, len);
+        break;
+      }
+      if (!server_file(client, path)) {
+        router_request(client, command, 0); // refused by the router
+        break;
+      }
+      request = router_request(client, command, router.n_shards);
+      for (int k = 0; k < router.n_shards; k++) {
+        int n = snprintf(text, sizeof(text), "%c %s.%d\n", command, path, k);
+        router_forward(request, k, k, text, n);
+      }
+      break;
+    case 'E':
+      request = router_request(client, command, 0);
+      request->shard = router_add_shard();
+      break;
+    case 'q':
+      router_request(client, command, 0);
+      client->quit = true;
+      break;
+    case 'I': case 'X':
+      router_request(client, command, 0); // answered by the router
+      break;
+    default:
+      // the commands of one city go to its shard, the rest to shard 0
+      request = router_request(client, command, 1);
+      if (command != '\0' && strchr("AlarsubBcWRgGkKivVyYw", command) != NULL) {
+        city_read(city);
+        router_forward(request, 0, shard_of(router.ring, city), p, len);
+      } else {
+        router_forward(request, 0, 0, p, len);
+      }
+    }
+    done += len;
+  }
+  batch.base = NULL;
+  batch.pos = batch.end = NULL;
+
+  memmove(client->in, client->in + done, client->in_len - done);
+  client->in_len -= done;
+}
+
+/* A new request of client, or of the router if it is NULL, to be answered
+   by n shards */
+struct router_request * router_request(struct server_client *client, char command, int n)
 {
-  struct flight_schedule *temp = flight_schedule_find(city); // find node
-  if(temp != NULL){
-    flight_schedule_free(temp); //call helper function if such city exists
+  struct router_request *request =
+    calloc(1, sizeof(*request) + n * sizeof(struct router_answer));
+  if (request == NULL) {
+    output_str("ERROR: Out of memory for client requests.\n");
+    exit(EXIT_FAILURE);
   }
-  else{
-    msg_city_bad(city);// c *msg no schedule for city*/
-    return;
+
+  request->client = client;
+  request->command = command;
+  request->shard = -1;
+  request->n_answers = n;
+  if (client != NULL) {
+    if (client->last_request != NULL) {
+      client->last_request->next = request;
+    } else {
+      client->first_request = request;
+    }
+    client->last_request = request;
   }
-  
+  return request;
 }
 
-/*Lists all of the existing flight schedules.*/
-void flight_schedule_listAll(void)
+/* Queues a request to shard k, its answer going to answer of request */
+void router_forward(struct router_request *request, int answer, int k,
+                    const char *text, size_t len)
 {
-  struct flight_schedule *temp = flight_schedules_active; // use pointer temp points to the start of the schedule
+  struct router_shard *shard = router.shards[k];
+  struct router_pending *pending = malloc(sizeof(*pending));
+  if (pending == NULL) {
+    output_str("ERROR: Out of memory for client requests.\n");
+    exit(EXIT_FAILURE);
+  }
 
-  /*if(temp == NULL){
-    msg_schedule_no_free();
-    return;
-  }*/
-  while(temp != NULL){
-    printf("%s\n", temp->destination);// print the char if it doesn't reach end
-    temp = temp->next; // update temp to point to the next node
+  *pending = (struct router_pending){NULL, request, answer};
+  if (shard->last != NULL) {
+    shard->last->next = pending;
+  } else {
+    shard->first = pending;
   }
+  shard->last = pending;
+  request->waiting++;
+  server_queue(&shard->link, text, len);
 }
 
-/*Lists all of the flights of a given city*/
-void flight_schedule_list(city_t city)
+/* Reads everything a shard has answered, splitting it at the "." lines
+   that end each answer */
+void router_read_shard(struct router_shard *shard)
 {
-  struct flight_schedule *temp = flight_schedule_find(city); //create a new pointer
-  if(temp == NULL){
-    msg_city_bad(city);  //no city in list
-    
-  }
-    
-    msg_city_flights(city); //c
-   
-      
-    /*addddd*/
-    for (int i=0; i<MAX_FLIGHTS_PER_CITY; i++) {
-      if(temp->flights[i].time != TIME_NULL && 
-      temp->flights[i].available >= 0 && 
-      temp->flights[i].capacity >= 0){
-      msg_flight_info(temp->flights[i].time, temp->flights[i].available, temp->flights[i].capacity); // use for loop to print each flight's attributes //c
+  char data[SERVER_INPUT_SIZE];
+
+  while (true) {
+    ssize_t n = read(shard->link.fd, data, sizeof(data));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n <= 0) {
+      output_str("ERROR: A shard stopped.\n");
+      exit(EXIT_FAILURE);
+    }
+
+    ssize_t from = 0;
+    for (ssize_t i = 0; i < n; i++) {
+      if (shard->end_line) { // the rest of a "." line
+        shard->end_line = data[i] != '\n';
+        shard->line_start = !shard->end_line;
+        from = i + 1;
+      } else if (shard->line_start && data[i] == '.') {
+        router_answer(shard, data + from, i - from, true);
+        shard->end_line = true;
+        shard->line_start = false;
+        from = i + 1;
+      } else {
+        shard->line_start = data[i] == '\n';
+      }
     }
+    if (from < n) {
+      router_answer(shard, data + from, n - from, false);
     }
-    printf("\n");
-  
+  }
 }
 
-/*Takes as input a city and adds a given flight for this city.
-  This function should call time get and flight capacity get to take in the time and capacity for the
-newly added flight.
-  Does not return anything.*/
-void flight_schedule_add_flight(city_t city)
+/* Adds len bytes to the answer shard is sending, done if they end it */
+void router_answer(struct router_shard *shard, const char *text, size_t len, bool done)
 {
-  struct flight_schedule *temp = flight_schedule_find(city);
-  time_t time;
-  int capacity;
- 
+  struct router_pending *pending = shard->first;
+  if (pending == NULL) return; // nothing asked
 
-  if(temp == NULL){
-    msg_city_bad(city);  
-    return;
+  struct router_request *request = pending->request;
+  struct router_answer *answer = &request->answers[pending->answer];
+  if (request->orphan) len = 0; // nobody to give it to
+  if (answer->len + len > answer->max) {
+    size_t max = answer->max ? answer->max : 256;
+    while (max < answer->len + len) {
+      max *= 2;
+    }
+    char *bigger = realloc(answer->text, max);
+    if (bigger == NULL) {
+      output_str("ERROR: Out of memory for client answers.\n");
+      exit(EXIT_FAILURE);
+    }
+    answer->text = bigger;
+    answer->max = max;
   }
+  if (len > 0) {
+    memcpy(answer->text + answer->len, text, len);
+    answer->len += len;
+  }
+  if (!done) return;
 
-  else{
-    if ((time_get(&time)) && (flight_capacity_get(&capacity)))
-    { // if such city is added in schedule and we have valid input
-
-    for (int i=0; i < MAX_FLIGHTS_PER_CITY; i++) {
-     
-      if( (temp->flights[i].time == TIME_NULL) && (temp->flights[i].available == 0 ) && (temp->flights[i].capacity == 0)){ // check if there's a space to add info  
-        temp->flights[i].time = time;
-        temp->flights[i].available = capacity;
-        temp->flights[i].capacity = capacity; //update all the variables in flight[i]
-        
-        flight_schedule_sort_flights_by_time(temp);
-        return;
-      }
-     }
-    msg_city_max_flights_reached(city);
-    
-    } 
+  shard->first = pending->next;
+  if (shard->first == NULL) shard->last = NULL;
+  free(pending);
+  if (--request->waiting > 0) return;
+
+  if (request->orphan) {
+    router_free(request);
+  } else if (request->client != NULL) {
+    router_ready(request->client);
   }
 }
- 
 
-/*Takes as input a city and removes the given flight for this city.
- This function should call time get to determine which flight should be removed.
- Does not return anything.*/
-void flight_schedule_remove_flight(city_t city)
+/* Sends as much of the requests queued for a shard as its socket takes */
+void router_send_shard(struct router_shard *shard)
 {
-  struct flight_schedule *temp = flight_schedule_find(city);
-  time_t time; 
+  struct server_client *link = &shard->link;
 
-  if ((temp!=NULL) && (time_get(&time))) { 
-    for (int i=0; i<MAX_FLIGHTS_PER_CITY; i++) {
-      if (temp->flights[i].time == time){// check match
-        temp->flights[i].time = TIME_NULL;
-        temp->flights[i].available = 0;
-        temp->flights[i].capacity = 0; // set those values to default
-        return;
-      } 
-   }
-   msg_flight_bad_time();//c
-  }
-  else{ // if such city is not added in schedule
-    msg_city_bad(city);
-    return; /*printf("2");*/
+  while (link->out_sent < link->out_len) {
+    ssize_t n = send(link->fd, link->out + link->out_sent,
+                     link->out_len - link->out_sent, MSG_NOSIGNAL);
+    if (n > 0) {
+      link->out_sent += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      router_watch_shard(shard, true);
+      return;
+    } else {
+      output_str("ERROR: A shard stopped.\n");
+      exit(EXIT_FAILURE);
+    }
   }
+  link->out_len = link->out_sent = 0;
+  router_watch_shard(shard, false);
 }
 
-/*The user can specify any time and your program should schedule the next available flight from
-the given time.
-Ã¢â‚¬â€œ Be sure to adjust the available seats accordingly.
-Ã¢â‚¬â€œ Does not return anything.*/
-void flight_schedule_schedule_seat(city_t city)
+/* Waits for the answers of a shard, and for room to send to it (out) */
+void router_watch_shard(struct router_shard *shard, bool out)
 {
-  struct flight_schedule *temp = flight_schedule_find(city);
-  time_t time; 
+#ifdef __linux__
+  if (shard->link.blocked != out) {
+    struct epoll_event ev = {.events = EPOLLIN | (out ? EPOLLOUT : 0)};
+    ev.data.ptr = &shard->link;
+    epoll_ctl(router.ep, EPOLL_CTL_MOD, shard->link.fd, &ev);
+    shard->link.blocked = out;
+  }
+#else
+  (void)shard;
+  (void)out;
+#endif
+}
 
-  if(temp == NULL){ // no such city found
-    msg_city_bad(city);
-    return;
+/* Puts client on the list of clients to send answers to */
+void router_ready(struct server_client *client)
+{
+  if (!client->ready) {
+    client->ready = true;
+    client->next_ready = router.ready;
+    router.ready = client;
   }
+}
 
-  if ((temp != NULL) && (time_get(&time))){ // city foundÃ¯Â¼Å’ valid inputs
-    for (int i=0; i < MAX_FLIGHTS_PER_CITY; i++) {
-      if (temp->flights[i].time >= time){ // find the flights or the closest flight
-        
-        if(temp->flights[i].available > 0){ //only -1 when there are available seats
-           temp->flights[i].available -= 1; //available seats -1
-           return;
-        }
+/* Queues the answers of the requests of client that all shards have
+   answered, in the order they came, each ended by a "." line */
+void router_reply(struct server_client *client)
+{
+  struct router_request *request = client->first_request;
 
-        else{ // no available seats
-          msg_flight_no_seats(); //c 
-          return;
+  if (request == NULL || request->waiting > 0) return;
+  output.client = client;
+  while ((request = client->first_request) != NULL && request->waiting == 0) {
+    client->first_request = request->next;
+    if (client->first_request == NULL) client->last_request = NULL;
+
+    switch (request->command) {
+    case 'L': case 'P': case 'F':
+      router_merge_lines(request);
+      break;
+    case 'D': case 'N':
+      router_merge_departures(request);
+      break;
+    case 'T':
+      for (int k = 0; k < request->n_answers; k++) {
+        output_str("Shard ");
+        output_int(k);
+        output_str(":\n");
+        if (request->answers[k].len > 0) {
+          output_write(request->answers[k].text, request->answers[k].len);
         }
- 
-      } 
+      }
+      break;
+    case 'E':
+      if (request->shard >= 0) {
+        msg_shard_added(request->shard, request->shard + 1);
+      } else {
+        msg_shards_full();
+      }
+      break;
+    case 'I': case 'X':
+      msg_not_on_shards();
+      break;
+    default:
+      if (request->n_answers == 0 && (request->command == 'S' || request->command == 'O')) {
+        msg_file_refused(); // not sent on, see router_run_requests
+      }
+      for (int k = 0; k < request->n_answers; k++) {
+        if (request->answers[k].len > 0) {
+          output_write(request->answers[k].text, request->answers[k].len);
+        }
+      }
     }
-    msg_flight_no_seats(); //c no this or next flight schedule time available 
+    output_str(".\n");
+    router_free(request);
   }
-
+  output_flush();
+  output.client = NULL;
 }
 
+/* Prints the lines of all answers of a request in name order, each answer
+   having them in that order */
+void router_merge_lines(const struct router_request *request)
+{
+  const char *p[MAX_SHARDS];
+  int n = request->n_answers;
 
-/*Takes as input a city and unschedules a seat on a given flight for this city.
-Ã¢â‚¬â€œ The user must specify the exact time for the flight that they are unscheduling.
-Ã¢â‚¬â€œ Be sure to adjust the available seats accordingly.
-Ã¢â‚¬â€œ Does not return anything*/
-void flight_schedule_unschedule_seat(city_t city)
+  for (int k = 0; k < n; k++) {
+    p[k] = request->answers[k].text;
+  }
+  while (true) {
+    int first = -1;
+    size_t first_len = 0;
+    for (int k = 0; k < n; k++) {
+      const char *end = request->answers[k].text + request->answers[k].len;
+      if (p[k] == end) continue;
+      const char *nl = memchr(p[k], '\n', end - p[k]);
+      size_t len = (nl != NULL) ? (size_t)(nl - p[k]) : (size_t)(end - p[k]);
+      if (first >= 0) { // like strcmp, a line before the ones it starts
+        int order = memcmp(p[k], p[first], len < first_len ? len : first_len);
+        if (order > 0 || (order == 0 && len >= first_len)) continue;
+      }
+      first = k;
+      first_len = len;
+    }
+    if (first < 0) return;
+
+    const char *end = request->answers[first].text + request->answers[first].len;
+    size_t len = first_len + (p[first] + first_len < end); // with its newline
+    output_write(p[first], len);
+    p[first] += len;
+  }
+}
+
+/* Prints the departure lists of all answers of a request as one, in time
+   and then name order, and no more than an N command asked for.  If the
+   shards answered something else they all said the same. */
+void router_merge_departures(const struct router_request *request)
 {
-  struct flight_schedule *temp = flight_schedule_find(city);
-  time_t time; 
+  const char *p[MAX_SHARDS], *end[MAX_SHARDS];
+  int time[MAX_SHARDS], avail[MAX_SHARDS];
+  city_t city[MAX_SHARDS];
+  bool more[MAX_SHARDS];
+  int n = request->n_answers, count = INT_MAX;
+  const struct router_answer *answer = &request->answers[0];
+  const char *colon = (answer->len >= 4 && memcmp(answer->text, "The ", 4) == 0)
+                      ? memchr(answer->text, ':', answer->len) : NULL;
 
-  if(temp == NULL){
-    msg_city_bad(city);
+  if (colon == NULL) {
+    if (answer->len > 0) output_write(answer->text, answer->len);
     return;
   }
+  if (request->command == 'N') {
+    count = atoi(answer->text + strlen("The next "));
+  }
+  output_write(answer->text, colon + 1 - answer->text);
 
-  if ((temp != NULL) && (time_get(&time))){ //city found and valid time input
-  
-    for (int i=0; i < MAX_FLIGHTS_PER_CITY; i++) {
-      if (temp->flights[i].time == time){ // find the flights or the closest flight
-          
-        if(temp->flights[i].available < temp->flights[i].capacity){ //not reach capacity
-          temp->flights[i].available += 1; //available seats +1
-          return;
-          }
-
-        else{
-          msg_flight_all_seats_empty(); //c //msg input exceed capability
-          return;
-        }
-      }
+  for (int k = 0; k < n; k++) {
+    p[k] = request->answers[k].text;
+    end[k] = p[k] + request->answers[k].len;
+    more[k] = router_departure(&p[k], end[k], &time[k], city[k], &avail[k]);
+  }
+  for (; count > 0; count--) {
+    int first = -1;
+    for (int k = 0; k < n; k++) {
+      if (more[k] && (first < 0 || time[k] < time[first] ||
+                      (time[k] == time[first] && strcmp(city[k], city[first]) < 0))) {
+        first = k;
       }
-      msg_flight_bad_time(); //no this or next flight schedule time available
-      return;
     }
+    if (first < 0) break;
+    msg_departure_info(time[first], city[first], avail[first]);
+    more[first] = router_departure(&p[first], end[first], &time[first], city[first],
+                                   &avail[first]);
+  }
+  output_char('\n');
 }
 
+/* Reads the next " (time, city, seats)" of a departure list at *p, moving
+   *p past it.  Returns false at the end of the list. */
+bool router_departure(const char **p, const char *end, int *time, city_t city, int *avail)
+{
+  const char *open = memchr(*p, '(', end - *p);
+  if (open == NULL) return false;
+
+  // the city ends at the last ", " of the flight, names can have commas
+  const char *close = open;
+  do {
+    close = memchr(close + 1, ')', end - close - 1);
+  } while (close != NULL && close + 1 < end && close[1] != ' ' && close[1] != '\n');
+  if (close == NULL) return false;
+  const char *name = memchr(open, ',', close - open);
+  const char *seats = close;
+  while (seats > open && seats[0] != ',') {
+    seats--;
+  }
+  if (name == NULL || name + 2 > seats) return false;
 
-/*Takes as input a city and traverses the active flight list until it finds the flight schedule for this
-city, if it exists
-Returns the flight schedule of said city*/
+  size_t len = seats - (name + 2);
+  if (len > MAX_CITY_NAME_LEN) len = MAX_CITY_NAME_LEN;
+  memcpy(city, name + 2, len);
+  city[len] = '\0';
+  *time = atoi(open + 1);
+  *avail = atoi(seats + 1);
+  *p = close + 1;
+  return true;
+}
 
-struct flight_schedule * flight_schedule_find(city_t city)
+/* Waits until the shards have answered every request sent to them */
+void router_drain(void)
 {
-  struct flight_schedule *temp = flight_schedules_active; //new pointer point to the active schedule list
+  struct pollfd fds[MAX_SHARDS];
+  bool waiting = true;
 
-  if(temp == NULL){
-    return NULL;
+  while (waiting) {
+    waiting = false;
+    for (int k = 0; k < router.n_shards; k++) {
+      struct router_shard *shard = router.shards[k];
+      if (shard->link.out_len > 0) {
+        router_send_shard(shard);
+      }
+      fds[k].fd = shard->link.fd;
+      fds[k].events = POLLIN | (shard->link.out_len > 0 ? POLLOUT : 0);
+      fds[k].revents = 0;
+      waiting = waiting || shard->first != NULL;
+    }
+    if (!waiting) break;
+    if (poll(fds, router.n_shards, -1) < 0 && errno != EINTR) {
+      output_str("ERROR: Can not wait for the shards.\n");
+      exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < router.n_shards; k++) {
+      if (fds[k].revents & (POLLIN | POLLHUP | POLLERR)) {
+        router_read_shard(router.shards[k]);
+      }
+    }
   }
-  
-  while(temp != NULL){ // use while loop to traverse the active schedule list
-     if(strcmp(temp->destination, city) == 0){ // city match found
-      return temp;
+}
+
+/* Adds a shard: once the shards have answered what they were sent, each
+   moves the cities the new shard takes on the new ring to a snapshot
+   (X), the router puts these together in one and the new shard loads it
+   (O).  Returns the new shard, or -1 if there can't be more. */
+int router_add_shard(void)
+{
+  int k = router.n_shards;
+  char base[MAX_PATH_LEN+1], path[MAX_PATH_LEN+32], text[MAX_PATH_LEN+64];
+  struct router_request *request;
+
+  if (k == MAX_SHARDS) return -1;
+  router_drain();
+  if (!router_start_shard(&router, k)) return -1;
+
+  router_base(&router, base, sizeof(base));
+  request = router_request(NULL, 'X', k);
+  for (int j = 0; j < k; j++) {
+    int n = snprintf(text, sizeof(text), "X %s.%d.%d\n%d\n", base, k, j, k + 1);
+    router_forward(request, j, j, text, n);
+  }
+  router_drain();
+
+  // the router's own engine puts the moving cities together
+  bool ok = true;
+  for (int j = 0; j < k; j++) {
+    snprintf(path, sizeof(path), "%s.%d.%d", base, k, j);
+    ok = ok && request->answers[j].len == 0 &&
+         (j == 0 ? flight_engine_load(path) : flight_engine_merge(path));
+  }
+  snprintf(path, sizeof(path), "%s.%d", base, k);
+  ok = ok && flight_engine_save(path);
+  router_free(request);
+  if (!ok) {
+    output_str("ERROR: Can not move cities to the new shard.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int j = 0; j < k; j++) {
+    snprintf(text, sizeof(text), "%s.%d.%d", base, k, j);
+    unlink(text);
+  }
+
+  router.n_shards = k + 1; // so router_drain waits for it
+  request = router_request(NULL, 'O', 1);
+  int n = snprintf(text, sizeof(text), "O %s\n", path);
+  router_forward(request, 0, k, text, n);
+  router_drain();
+  if (request->answers[0].len != 0) {
+    output_str("ERROR: Can not move cities to the new shard.\n");
+    exit(EXIT_FAILURE);
+  }
+  router_free(request);
+
+  free(router.ring);
+  router.ring = shard_ring_new(k + 1);
+
+  // so a restart starts all of them again
+  if (!router_base(&router, base, sizeof(base))) {
+    unlink(path); // nothing to start from
+  } else {
+    char tmp[MAX_PATH_LEN+48];
+    snprintf(path, sizeof(path), "%s.shards", base);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *file = fopen(tmp, "w");
+    ok = file != NULL && fprintf(file, "%d\n", k + 1) > 0;
+    ok = (file != NULL && fclose(file) == 0) && ok && rename(tmp, path) == 0;
+    if (!ok) {
+      output_str("ERROR: Can not save the number of shards.\n");
+      exit(EXIT_FAILURE);
     }
-    temp = temp->next;
   }
-   
-  return NULL;
+  return k;
+}
+
+/* Puts the base of the router's own files in base: its --snapshot, or
+   PATH.snap if it has none.  Shard k starts from <base>.k and the number
+   of shards is kept in <base>.shards.  Returns false if nothing is kept
+   over a restart, with neither --journal nor --snapshot. */
+bool router_base(const struct router *r, char *base, size_t size)
+{
+  if (r->snapshot != NULL) {
+    snprintf(base, size, "%s", r->snapshot);
+  } else {
+    snprintf(base, size, "%s.snap", r->path);
+  }
+  return r->journal != NULL || r->snapshot != NULL;
 }
 
+/* The number of shards E made before a restart, 0 if none were added */
+int router_saved_shards(const struct router *r)
+{
+  char base[MAX_PATH_LEN+1], path[MAX_PATH_LEN+16];
+  int shards = 0;
 
-  
- 
+  if (!router_base(r, base, sizeof(base))) return 0;
+  snprintf(path, sizeof(path), "%s.shards", base);
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return 0;
+  if (fscanf(file, "%d", &shards) != 1 || shards < 1 || shards > MAX_SHARDS) {
+    shards = 0;
+  }
+  fclose(file);
+  return shards;
+}
+
+/* Drops the requests of a client that is gone.  The ones shards still
+   have to answer are freed once they do. */
+void router_close(struct server_client *client)
+{
+  struct router_request *request = client->first_request, *next;
+
+  for (; request != NULL; request = next) {
+    next = request->next;
+    if (request->waiting == 0) {
+      router_free(request);
+    } else {
+      request->orphan = true;
+      request->client = NULL;
+    }
+  }
+  client->first_request = client->last_request = NULL;
+}
+
+/* Frees a request and its answers */
+void router_free(struct router_request *request)
+{
+  for (int k = 0; k < request->n_answers; k++) {
+    free(request->answers[k].text);
+  }
+  free(request);
+}